@@ -11,6 +11,8 @@
 #define WORD_SIZE 16
 
 #define MAX_ROM 0x7FFF;
+// Bytes pushByteToRam emits for every byte it places
+#define RAM_BYTE_LEN 10
 #define STRING_BUFFER_LOCATION 0x9001
 
 #define EMPTY_TOKEN                                                            \
@@ -25,18 +27,13 @@
                    consume(assembler, TOKEN_NUMBER, "Expected number.").val);  \
   }
 
-#define GENERATE_RA(pushByteMethod, pushTwoBytesMethod, name)                  \
-  static void name(Assembler *assembler,                                       \
-                   char labelQueue[MAX_REFERENCE_AMOUNT][MAX_IDENTIFIER_LEN],  \
-                   int *queueHead, Token tkn, uint8_t op) {                    \
+#define GENERATE_RA(pushByteMethod, pushLabelMethod, name)                     \
+  static void name(Assembler *assembler, uint8_t op) {                         \
     pushByteMethod(assembler, op);                                             \
     pushByteMethod(assembler, consumeRegister(assembler));                     \
     consume(assembler, TOKEN_COMMA, "Expected ','.");                          \
-    memcpy(labelQueue[(*queueHead)++],                                         \
-           (tkn = consume(assembler, TOKEN_IDENTIFIER, "Unexpected keyword.")) \
-               .start,                                                         \
-           tkn.len);                                                           \
-    pushTwoBytesMethod(assembler, 0xFFFF);                                     \
+    pushLabelMethod(assembler, consume(assembler, TOKEN_IDENTIFIER,            \
+                                       "Unexpected keyword."));                \
   }
 
 #define GENERATE_R(pushByteMethod, name)                                       \
@@ -53,14 +50,52 @@
     pushByteMethod(assembler, consumeRegister(assembler));                     \
   }
 
-#define GENERATE_A(pushByteMethod, pushTwoBytesMethod, name)                   \
-  static void name(Assembler *assembler,                                       \
-                   char labelQueue[MAX_REFERENCE_AMOUNT][MAX_IDENTIFIER_LEN],  \
-                   int *queueHead, Token tkn, uint8_t op) {                    \
+#define GENERATE_A(pushByteMethod, pushLabelMethod, name)                      \
+  static void name(Assembler *assembler, uint8_t op) {                         \
+    pushByteMethod(assembler, op);                                             \
+    pushLabelMethod(assembler, consume(assembler, TOKEN_IDENTIFIER,            \
+                                       "Unexpected keyword.\n"));              \
+  }
+
+#define GENERATE_RRA(pushByteMethod, pushLabelMethod, name)                    \
+  static void name(Assembler *assembler, uint8_t op) {                         \
+    pushByteMethod(assembler, op);                                             \
+    pushByteMethod(assembler, consumeRegister(assembler));                     \
+    consume(assembler, TOKEN_COMMA, "Expected ','.");                          \
+    pushByteMethod(assembler, consumeRegister(assembler));                     \
+    consume(assembler, TOKEN_COMMA, "Expected ','.");                          \
+    pushLabelMethod(assembler, consume(assembler, TOKEN_IDENTIFIER,            \
+                                       "Unexpected keyword."));                \
+  }
+
+// Block instructions take their byte count as a 16 bit number, which has to be
+// the last operand since a number runs to the end of the line
+
+#define GENERATE_AAW(pushByteMethod, pushTwoBytesMethod, pushLabelMethod,      \
+                     name)                                                     \
+  static void name(Assembler *assembler, uint8_t op) {                         \
+    pushByteMethod(assembler, op);                                             \
+    pushLabelMethod(assembler, consume(assembler, TOKEN_IDENTIFIER,            \
+                                       "Expected destination label."));        \
+    consume(assembler, TOKEN_COMMA, "Expected ','.");                          \
+    pushLabelMethod(assembler, consume(assembler, TOKEN_IDENTIFIER,            \
+                                       "Expected source label."));             \
+    consume(assembler, TOKEN_COMMA, "Expected ','.");                          \
+    pushTwoBytesMethod(                                                        \
+        assembler, consume(assembler, TOKEN_NUMBER, "Expected length.").val);  \
+  }
+
+#define GENERATE_RAW(pushByteMethod, pushTwoBytesMethod, pushLabelMethod,      \
+                     name)                                                     \
+  static void name(Assembler *assembler, uint8_t op) {                         \
     pushByteMethod(assembler, op);                                             \
-    tkn = consume(assembler, TOKEN_IDENTIFIER, "Unexpected keyword.\n");       \
-    memcpy(labelQueue[(*queueHead)++], tkn.start, tkn.len);                    \
-    pushTwoBytesMethod(assembler, 0xFFFF);                                     \
+    pushByteMethod(assembler, consumeRegister(assembler));                     \
+    consume(assembler, TOKEN_COMMA, "Expected ','.");                          \
+    pushLabelMethod(assembler, consume(assembler, TOKEN_IDENTIFIER,            \
+                                       "Expected destination label."));        \
+    consume(assembler, TOKEN_COMMA, "Expected ','.");                          \
+    pushTwoBytesMethod(                                                        \
+        assembler, consume(assembler, TOKEN_NUMBER, "Expected length.").val);  \
   }
 
 #define EMPTY_BYTE                                                             \
@@ -76,6 +111,10 @@ void initAssembler(Assembler *assembler, char *src, char *filename) {
   assembler->stringHead = STRING_BUFFER_LOCATION;
   assembler->filename = filename;
 
+  assembler->fixups = NULL;
+  assembler->fixupCount = 0;
+  assembler->fixupCapacity = 0;
+
   memset(assembler->output, '\0', BYTE_MAX);
 
   initTable(&assembler->symbolTable);
@@ -128,42 +167,78 @@ static void pushTwoBytes(Assembler *assembler, uint16_t bytes) {
 // to an address above the max rom address we must instead utilize the st
 // instruction to put the instructions in RAM
 
+// SC holds each byte on its way to RAM. It is derived from the register
+// tokens rather than a fixed offset, so new opcode tokens cannot move it.
+#define SCRATCH_REGISTER (TOKEN_SC - TOKEN_SR + 1)
+
 static void pushByteToRam(Assembler *assembler, byte b) {
   uint16_t temp = assembler->byteHead;
   assembler->byteHead = assembler->startHead;
 
   pushByte(assembler, OP_ADD);
-  pushByte(assembler, TOKEN_G0 - 22); // 0x04 is the enumerated register
+  pushByte(assembler, SCRATCH_REGISTER);
   pushByte(assembler, b);
 
   pushByte(assembler, OP_ST);
-  pushByte(assembler, TOKEN_G0 - 22);
+  pushByte(assembler, SCRATCH_REGISTER);
   pushTwoBytes(assembler, assembler->orgHead++);
 
   pushByte(assembler, OP_SUBR);
-  pushByte(assembler, TOKEN_G0 - 22);
-  pushByte(assembler, TOKEN_G0 - 22);
+  pushByte(assembler, SCRATCH_REGISTER);
+  pushByte(assembler, SCRATCH_REGISTER);
 
   assembler->startHead = assembler->byteHead;
   assembler->byteHead = temp;
 }
 
+// pushByteToRam moves startHead on by itself
 static void pushTwoBytesToRam(Assembler *assembler, uint16_t b) {
-  uint16_t temp = assembler->byteHead;
-  assembler->byteHead = assembler->startHead;
-
   pushByteToRam(assembler, b);
   pushByteToRam(assembler, b >> 8);
+}
 
-  assembler->startHead = assembler->byteHead;
-  assembler->byteHead = temp;
+// Remembers where the two address bytes for a label reference went
+static void addFixup(Assembler *assembler, Token label, uint16_t lo,
+                     uint16_t hi) {
+  if (label.len >= MAX_IDENTIFIER_LEN) {
+    printf("[Line %d] Label exceeds max identifier length.\n", label.line);
+    exit(-1);
+  }
+
+  if (assembler->fixupCount == assembler->fixupCapacity) {
+    assembler->fixupCapacity =
+        assembler->fixupCapacity ? assembler->fixupCapacity * 2 : START_SIZE;
+    assembler->fixups = realloc(assembler->fixups,
+                                assembler->fixupCapacity * sizeof(Fixup));
+  }
+
+  Fixup *fixup = &assembler->fixups[assembler->fixupCount++];
+
+  memcpy(fixup->label, label.start, label.len);
+  fixup->label[label.len] = '\0';
+  fixup->lo = lo;
+  fixup->hi = hi;
+}
+
+static void pushLabel(Assembler *assembler, Token label) {
+  addFixup(assembler, label, assembler->byteHead, assembler->byteHead + 1);
+  pushTwoBytes(assembler, 0);
+}
+
+// Each byte becomes the immediate of an add in the sequence pushByteToRam
+// emits
+static void pushLabelToRam(Assembler *assembler, Token label) {
+  uint16_t lo = assembler->startHead + 2;
+
+  addFixup(assembler, label, lo, lo + RAM_BYTE_LEN);
+  pushTwoBytesToRam(assembler, 0);
 }
 
 GENERATE_RV(pushByte, pushRegisterValue)
 GENERATE_RV(pushByteToRam, pushRegisterValueToRam)
 
-GENERATE_RA(pushByte, pushTwoBytes, pushRegisterAddress)
-GENERATE_RA(pushByteToRam, pushTwoBytesToRam, pushRegisterAddressToRam)
+GENERATE_RA(pushByte, pushLabel, pushRegisterAddress)
+GENERATE_RA(pushByteToRam, pushLabelToRam, pushRegisterAddressToRam)
 
 GENERATE_R(pushByte, pushRegister)
 GENERATE_R(pushByteToRam, pushRegisterToRam)
@@ -171,13 +246,57 @@ GENERATE_R(pushByteToRam, pushRegisterToRam)
 GENERATE_RR(pushByte, pushRegisterRegister)
 GENERATE_RR(pushByteToRam, pushRegisterRegisterToRam)
 
-GENERATE_A(pushByte, pushTwoBytes, pushAddress)
-GENERATE_A(pushByteToRam, pushTwoBytesToRam, pushAddressToRam)
+GENERATE_A(pushByte, pushLabel, pushAddress)
+GENERATE_A(pushByteToRam, pushLabelToRam, pushAddressToRam)
+
+GENERATE_RRA(pushByte, pushLabel, pushRegisterIndexed)
+GENERATE_RRA(pushByteToRam, pushLabelToRam, pushRegisterIndexedToRam)
+
+GENERATE_AAW(pushByte, pushTwoBytes, pushLabel, pushBlockCopy)
+GENERATE_AAW(pushByteToRam, pushTwoBytesToRam, pushLabelToRam,
+             pushBlockCopyToRam)
+
+GENERATE_RAW(pushByte, pushTwoBytes, pushLabel, pushBlockFill)
+GENERATE_RAW(pushByteToRam, pushTwoBytesToRam, pushLabelToRam,
+             pushBlockFillToRam)
+
+// Branches to a label already placed in ROM and within reach of a signed 8
+// bit offset from the next instruction take the short form. Forward
+// references are not placed yet, so they always take the long one.
+static void pushBranch(Assembler *assembler, uint8_t op, uint8_t shortOp) {
+  Token label =
+      consume(assembler, TOKEN_IDENTIFIER, "Expected label after branch.");
+  char buf[MAX_IDENTIFIER_LEN] = {'\0'};
+
+  if (label.len >= MAX_IDENTIFIER_LEN) {
+    printf("[Line %d] Label exceeds max identifier length.\n", label.line);
+    exit(-1);
+  }
+
+  memcpy(buf, label.start, label.len);
+
+  if (assembler->byteHead >= 0x8000) {
+    pushByteToRam(assembler, op);
+    pushLabelToRam(assembler, label);
+    return;
+  }
+
+  if (checkElement(&assembler->symbolTable, buf)) {
+    int offset = getElement(&assembler->symbolTable, buf) -
+                 (assembler->byteHead + 2);
+
+    if (offset >= INT8_MIN && offset <= INT8_MAX) {
+      pushByte(assembler, shortOp);
+      pushByte(assembler, (uint8_t)offset);
+      return;
+    }
+  }
+
+  pushByte(assembler, op);
+  pushLabel(assembler, label);
+}
 
-static void
-pushInstruction(Assembler *assembler,
-                char labelQueue[MAX_REFERENCE_AMOUNT][MAX_IDENTIFIER_LEN],
-                int *queueHead) {
+static void pushInstruction(Assembler *assembler) {
   Token tkn = advance(assembler);
 
   switch (tkn.type) {
@@ -199,9 +318,9 @@ pushInstruction(Assembler *assembler,
   }
   case TOKEN_LD: {
     if (assembler->byteHead >= 0x8000) {
-      pushRegisterAddressToRam(assembler, labelQueue, queueHead, tkn, OP_LD);
+      pushRegisterAddressToRam(assembler, OP_LD);
     } else {
-      pushRegisterAddress(assembler, labelQueue, queueHead, tkn, OP_LD);
+      pushRegisterAddress(assembler, OP_LD);
     }
     break;
   }
@@ -215,9 +334,9 @@ pushInstruction(Assembler *assembler,
   }
   case TOKEN_JMP: {
     if (assembler->byteHead >= 0x8000) {
-      pushAddressToRam(assembler, labelQueue, queueHead, tkn, OP_JMP);
+      pushAddressToRam(assembler, OP_JMP);
     } else {
-      pushAddress(assembler, labelQueue, queueHead, tkn, OP_JMP);
+      pushAddress(assembler, OP_JMP);
     }
     break;
   }
@@ -287,9 +406,9 @@ pushInstruction(Assembler *assembler,
   }
   case TOKEN_ST: {
     if (assembler->byteHead >= 0x8000) {
-      pushRegisterAddressToRam(assembler, labelQueue, queueHead, tkn, OP_ST);
+      pushRegisterAddressToRam(assembler, OP_ST);
     } else {
-      pushRegisterAddress(assembler, labelQueue, queueHead, tkn, OP_ST);
+      pushRegisterAddress(assembler, OP_ST);
     }
     break;
   }
@@ -311,33 +430,33 @@ pushInstruction(Assembler *assembler,
   }
   case TOKEN_JE: {
     if (assembler->byteHead >= 0x8000) {
-      pushAddress(assembler, labelQueue, queueHead, tkn, OP_JE);
+      pushAddressToRam(assembler, OP_JE);
     } else {
-      pushAddress(assembler, labelQueue, queueHead, tkn, OP_JE);
+      pushAddress(assembler, OP_JE);
     }
     break;
   }
   case TOKEN_JNE: {
     if (assembler->byteHead >= 0x8000) {
-      pushRegisterValueToRam(assembler, OP_ADD);
+      pushAddressToRam(assembler, OP_JNE);
     } else {
-      pushRegisterValue(assembler, OP_ADD);
+      pushAddress(assembler, OP_JNE);
     }
     break;
   }
   case TOKEN_JG: {
     if (assembler->byteHead >= 0x8000) {
-      pushAddressToRam(assembler, labelQueue, queueHead, tkn, TOKEN_JG);
+      pushAddressToRam(assembler, OP_JG);
     } else {
-      pushAddress(assembler, labelQueue, queueHead, tkn, TOKEN_JG);
+      pushAddress(assembler, OP_JG);
     }
     break;
   }
   case TOKEN_JL: {
     if (assembler->byteHead >= 0x8000) {
-      pushAddressToRam(assembler, labelQueue, queueHead, tkn, OP_JL);
+      pushAddressToRam(assembler, OP_JL);
     } else {
-      pushAddress(assembler, labelQueue, queueHead, tkn, OP_JL);
+      pushAddress(assembler, OP_JL);
     }
     break;
   }
@@ -373,13 +492,106 @@ pushInstruction(Assembler *assembler,
     }
     break;
   }
+  case TOKEN_LDR:
+  case TOKEN_STR: {
+    // The second register holds the low byte of the address, the one after
+    // it the high byte
+    uint8_t op = tkn.type == TOKEN_LDR ? OP_LDR : OP_STR;
+
+    if (assembler->byteHead >= 0x8000) {
+      pushRegisterRegisterToRam(assembler, op);
+    } else {
+      pushRegisterRegister(assembler, op);
+    }
+    break;
+  }
+  case TOKEN_LDX:
+  case TOKEN_STX: {
+    uint8_t op = tkn.type == TOKEN_LDX ? OP_LDX : OP_STX;
+
+    if (assembler->byteHead >= 0x8000) {
+      pushRegisterIndexedToRam(assembler, op);
+    } else {
+      pushRegisterIndexed(assembler, op);
+    }
+    break;
+  }
+  case TOKEN_BR:
+    pushBranch(assembler, OP_BR, OP_BRS);
+    break;
+  case TOKEN_BRE:
+    pushBranch(assembler, OP_BRE, OP_BRES);
+    break;
+  case TOKEN_BRNE:
+    pushBranch(assembler, OP_BRNE, OP_BRNES);
+    break;
+  case TOKEN_BRG:
+    pushBranch(assembler, OP_BRG, OP_BRGS);
+    break;
+  case TOKEN_BRL:
+    pushBranch(assembler, OP_BRL, OP_BRLS);
+    break;
+  case TOKEN_JSR: {
+    if (assembler->byteHead >= 0x8000) {
+      pushAddressToRam(assembler, OP_JSR);
+    } else {
+      pushAddress(assembler, OP_JSR);
+    }
+    break;
+  }
+  case TOKEN_XCHG:
+  case TOKEN_XADD: {
+    uint8_t op = tkn.type == TOKEN_XCHG ? OP_XCHG : OP_XADD;
+
+    if (assembler->byteHead >= 0x8000) {
+      pushRegisterAddressToRam(assembler, op);
+    } else {
+      pushRegisterAddress(assembler, op);
+    }
+    break;
+  }
+  case TOKEN_CAS: {
+    // Same layout as the indexed forms, the second register holding the new
+    // value
+    if (assembler->byteHead >= 0x8000) {
+      pushRegisterIndexedToRam(assembler, OP_CAS);
+    } else {
+      pushRegisterIndexed(assembler, OP_CAS);
+    }
+    break;
+  }
+  case TOKEN_FENCE: {
+    if (assembler->byteHead >= 0x8000) {
+      pushByteToRam(assembler, OP_FENCE);
+    } else {
+      pushByte(assembler, OP_FENCE);
+    }
+    break;
+  }
+  case TOKEN_COPY: {
+    if (assembler->byteHead >= 0x8000) {
+      pushBlockCopyToRam(assembler, OP_COPY);
+    } else {
+      pushBlockCopy(assembler, OP_COPY);
+    }
+    break;
+  }
+  case TOKEN_FILL: {
+    if (assembler->byteHead >= 0x8000) {
+      pushBlockFillToRam(assembler, OP_FILL);
+    } else {
+      pushBlockFill(assembler, OP_FILL);
+    }
+    break;
+  }
   case TOKEN_IDENTIFIER: {
-    // We encounter the label and push it to the symbol stack
+    // We encounter the label and push it to the symbol stack. In RAM sections
+    // byteHead stays put, orgHead is where the next byte lands.
     char buf[MAX_IDENTIFIER_LEN] = {'\0'};
     memcpy(buf, tkn.start, tkn.len);
-    addElement(&assembler->symbolTable, buf, assembler->byteHead);
-    char test = *(assembler->prev.start);
-    bool t = checkElement(&assembler->symbolTable, buf);
+    addElement(&assembler->symbolTable, buf,
+               assembler->byteHead >= 0x8000 ? assembler->orgHead
+                                             : assembler->byteHead);
     consume(assembler, TOKEN_COLON, "Expected ':'' after identifier.");
     break;
   }
@@ -428,12 +640,9 @@ static void resetScanner(Assembler *assembler) {
   assembler->next = scanToken(&assembler->scanner);
 }
 
-byte *assemble(Assembler *assembler) {
+void assembleCode(Assembler *assembler) {
   Token tkn;
 
-  char labelQueue[MAX_REFERENCE_AMOUNT][MAX_IDENTIFIER_LEN] = {{'\0'}};
-  int queueHead = 0;
-
   uint16_t stringBufferHead = STRING_BUFFER_LOCATION;
 
   char *startTokens = NULL;
@@ -465,7 +674,7 @@ byte *assemble(Assembler *assembler) {
       assembler->orgHead = address;
 
       while (!atEndDirective(assembler)) {
-        pushInstruction(assembler, labelQueue, &queueHead);
+        pushInstruction(assembler);
       }
       break;
     }
@@ -474,7 +683,7 @@ byte *assemble(Assembler *assembler) {
       assembler->orgHead = assembler->stringHead;
 
       while (!atEndDirective(assembler)) {
-        pushInstruction(assembler, labelQueue, &queueHead);
+        pushInstruction(assembler);
       }
 
       assembler->stringHead = assembler->orgHead;
@@ -486,8 +695,6 @@ byte *assemble(Assembler *assembler) {
     }
   }
 
-  int popQueueHead = 0;
-
   if (startTokens) {
     assembler->scanner.cur = startTokens;
     assembler->scanner.lineStart = startLine;
@@ -497,27 +704,55 @@ byte *assemble(Assembler *assembler) {
     while (!atEndDirective(assembler)) {
       assembler->byteHead = assembler->startHead;
       assembler->orgHead = assembler->startHead;
-      pushInstruction(assembler, labelQueue, &queueHead);
+      pushInstruction(assembler);
       assembler->startHead = assembler->byteHead;
     }
   }
 
-  for (int i = 0; i < assembler->byteHead; i++) {
-    // Last token is always halt (which is 0x17) so we should never go out of
-    // bounds.
-    if (assembler->output[i] == 0xFF && assembler->output[i + 1] == 0xFF) {
-      char *label = labelQueue[popQueueHead++];
+}
 
-      uint16_t address = getElement(&assembler->symbolTable, label);
+void resolveLabels(Assembler *assembler) {
+  for (int i = 0; i < assembler->fixupCount; i++) {
+    Fixup *fixup = &assembler->fixups[i];
+    uint16_t address = getElement(&assembler->symbolTable, fixup->label);
 
-      assembler->output[i] = address;
-      assembler->output[i + 1] = address >> 8;
-    }
+    assembler->output[fixup->lo] = address;
+    assembler->output[fixup->hi] = address >> 8;
   }
+}
+
+byte *assemble(Assembler *assembler) {
+  assembleCode(assembler);
+  resolveLabels(assembler);
 
   return assembler->output;
 }
 
+static int compareAddresses(const void *a, const void *b) {
+  return ((const Element *)a)->element - ((const Element *)b)->element;
+}
+
+void writeSymbols(Assembler *assembler, FILE *out) {
+  Table *table = &assembler->symbolTable;
+  Element *labels = malloc(table->size * sizeof(Element));
+  int count = 0;
+
+  for (int i = 0; i < table->size; i++) {
+    if (table->elements[i].str) {
+      labels[count++] = table->elements[i];
+    }
+  }
+
+  qsort(labels, count, sizeof(Element), compareAddresses);
+
+  for (int i = 0; i < count; i++) {
+    fprintf(out, "%04X %s\n", labels[i].element, labels[i].str);
+  }
+
+  free(labels);
+}
+
 void freeAssembler(Assembler *assembler) {
   freeTable(&assembler->symbolTable);
+  free(assembler->fixups);
 }
\ No newline at end of file
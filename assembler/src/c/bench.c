@@ -0,0 +1,604 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "assembler.h"
+#include "eval.h"
+#include "scanner.h"
+#include "table.h"
+
+#ifndef BUILD_TYPE
+#define BUILD_TYPE "unknown"
+#endif
+
+// The generated sections share the ROM above the .start code
+#define CODE_START 0x0100
+#define CODE_END 0x8000
+// Longest instruction the generator emits, in bytes
+#define MAX_INSTRUCTION_LEN 4
+
+// Shape of the generated program
+struct Config {
+  int lines;
+  int labelEvery;
+  int orgs;
+  int exprEvery;
+  unsigned seed;
+};
+
+typedef struct Config Config;
+
+// A growing string
+struct Text {
+  char *data;
+  size_t len;
+  size_t capacity;
+};
+
+typedef struct Text Text;
+
+static void append(Text *text, const char *format, ...) {
+  va_list args;
+
+  while (true) {
+    size_t space = text->capacity - text->len;
+
+    va_start(args, format);
+    int len = vsnprintf(text->data + text->len, space, format, args);
+    va_end(args);
+
+    if ((size_t)len < space) {
+      text->len += len;
+      return;
+    }
+
+    text->capacity = text->capacity ? text->capacity * 2 : 4096;
+    text->data = realloc(text->data, text->capacity);
+  }
+}
+
+static int randomBelow(int n) { return rand() % n; }
+
+static const char *randomRegister(void) {
+  static const char *registers[] = {"G0", "G1", "G2", "G3", "G4",
+                                    "G5", "G6", "G7", "G8", "G9"};
+
+  return registers[randomBelow(10)];
+}
+
+// Writes a number operand, every exprEvery-th one as an expression
+static void appendNumber(Text *text, const Config *config, int line) {
+  if (config->exprEvery && line % config->exprEvery == 0) {
+    append(text, "%d + %d * %d - %d\n", randomBelow(50), randomBelow(10),
+           randomBelow(10), randomBelow(50));
+  } else {
+    append(text, "%d\n", randomBelow(200));
+  }
+}
+
+// Writes one instruction, returning its length in bytes. Label references go
+// to any label in the program, before or after this one.
+static int appendInstruction(Text *text, const Config *config, int line,
+                             int labels) {
+  int label = randomBelow(labels);
+
+  switch (randomBelow(12)) {
+  case 0:
+    append(text, "  add %s, ", randomRegister());
+    appendNumber(text, config, line);
+    return 3;
+  case 1:
+    append(text, "  sub %s, ", randomRegister());
+    appendNumber(text, config, line);
+    return 3;
+  case 2:
+    append(text, "  mv %s, %s\n", randomRegister(), randomRegister());
+    return 3;
+  case 3:
+    append(text, "  addr %s, %s\n", randomRegister(), randomRegister());
+    return 3;
+  case 4:
+    append(text, "  nand %s, %s\n", randomRegister(), randomRegister());
+    return 3;
+  case 6:
+    append(text, "  not %s\n", randomRegister());
+    return 2;
+  case 7:
+    append(text, "  jl L%d\n", label);
+    return 3;
+  case 5:
+  case 8:
+    append(text, "  st %s, L%d\n", randomRegister(), label);
+    return 4;
+  case 9:
+    append(text, "  jmp L%d\n", label);
+    return 3;
+  case 10:
+    append(text, "  je L%d\n", label);
+    return 3;
+  default:
+    append(text, "  ret\n");
+    return 1;
+  }
+}
+
+// Generates config->lines instructions spread over config->orgs sections,
+// with a label every config->labelEvery instructions
+static char *generate(const Config *config) {
+  Text text = {NULL, 0, 0};
+  int labels = (config->lines + config->labelEvery - 1) / config->labelEvery;
+  int span = (CODE_END - CODE_START) / config->orgs;
+  int perOrg = (config->lines + config->orgs - 1) / config->orgs;
+
+  if (perOrg * MAX_INSTRUCTION_LEN > span) {
+    printf("%d lines do not fit in %d sections, use more or fewer lines.\n",
+           config->lines, config->orgs);
+    exit(-1);
+  }
+
+  srand(config->seed);
+
+  append(&text, "; Generated: %d lines, a label every %d, %d sections\n",
+         config->lines, config->labelEvery, config->orgs);
+  append(&text, ".start\n  jmp L0\n  halt\n");
+
+  for (int line = 0; line < config->lines; line++) {
+    if (line % perOrg == 0) {
+      append(&text, "\n.org %d\n", CODE_START + line / perOrg * span);
+    }
+
+    if (line % config->labelEvery == 0) {
+      append(&text, "; Block %d\nL%d:\n", line / config->labelEvery,
+             line / config->labelEvery);
+    }
+
+    appendInstruction(&text, config, line, labels);
+  }
+
+  append(&text, "  halt\n");
+  return text.data;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// What the stages work on, gathered from one assembly of the source
+struct Inputs {
+  char *source;
+  // Number operands as written, each evaluated by the scanner
+  char **exprs;
+  int exprCount;
+  // Every label, then every reference to one
+  char **labels;
+  int labelCount;
+  Fixup *fixups;
+  int fixupCount;
+};
+
+typedef struct Inputs Inputs;
+
+static void gatherInputs(Inputs *inputs, char *source, int labels) {
+  inputs->source = source;
+
+  Scanner scanner;
+  Token tkn;
+  int capacity = 0;
+
+  inputs->exprs = NULL;
+  inputs->exprCount = 0;
+  initScanner(&scanner, source);
+
+  // A number token's text runs up to where the scanner stopped
+  while ((tkn = scanToken(&scanner)).type != TOKEN_END) {
+    if (tkn.type != TOKEN_NUMBER) {
+      continue;
+    }
+
+    if (inputs->exprCount == capacity) {
+      capacity = capacity ? capacity * 2 : 256;
+      inputs->exprs = realloc(inputs->exprs, capacity * sizeof(char *));
+    }
+
+    char *expr = malloc(tkn.len + 1);
+    memcpy(expr, scanner.cur - tkn.len, tkn.len);
+    expr[tkn.len] = '\0';
+    inputs->exprs[inputs->exprCount++] = expr;
+  }
+
+  inputs->labels = malloc(labels * sizeof(char *));
+  inputs->labelCount = labels;
+
+  for (int i = 0; i < labels; i++) {
+    char name[MAX_IDENTIFIER_LEN];
+
+    snprintf(name, sizeof(name), "L%d", i);
+    inputs->labels[i] = strdup(name);
+  }
+
+  Assembler *assembler = malloc(sizeof(Assembler));
+
+  initAssembler(assembler, source, "generated");
+  assembleCode(assembler);
+
+  inputs->fixupCount = assembler->fixupCount;
+  inputs->fixups = malloc(inputs->fixupCount * sizeof(Fixup));
+  memcpy(inputs->fixups, assembler->fixups,
+         inputs->fixupCount * sizeof(Fixup));
+
+  freeAssembler(assembler);
+  free(assembler);
+}
+
+static void freeInputs(Inputs *inputs) {
+  for (int i = 0; i < inputs->exprCount; i++) {
+    free(inputs->exprs[i]);
+  }
+
+  for (int i = 0; i < inputs->labelCount; i++) {
+    free(inputs->labels[i]);
+  }
+
+  free(inputs->exprs);
+  free(inputs->labels);
+  free(inputs->fixups);
+}
+
+// Results keep the compiler from dropping the work
+static volatile long sink;
+
+static double timeScan(const Inputs *inputs) {
+  Scanner scanner;
+  long tokens = 0;
+
+  double start = now();
+  initScanner(&scanner, inputs->source);
+
+  while (scanToken(&scanner).type != TOKEN_END) {
+    tokens++;
+  }
+
+  double seconds = now() - start;
+
+  sink = tokens;
+  return seconds;
+}
+
+static double timeEval(const Inputs *inputs) {
+  long sum = 0;
+
+  double start = now();
+
+  for (int i = 0; i < inputs->exprCount; i++) {
+    Expr expr;
+
+    initExpr(&expr, inputs->exprs[i]);
+    sum += evaluate(&expr);
+  }
+
+  double seconds = now() - start;
+
+  sink = sum;
+  return seconds;
+}
+
+static double timeTable(const Inputs *inputs) {
+  Table table;
+  long sum = 0;
+
+  double start = now();
+  initTable(&table);
+
+  for (int i = 0; i < inputs->labelCount; i++) {
+    addElement(&table, inputs->labels[i], i);
+  }
+
+  for (int i = 0; i < inputs->fixupCount; i++) {
+    sum += getElement(&table, inputs->fixups[i].label);
+  }
+
+  double seconds = now() - start;
+
+  freeTable(&table);
+  sink = sum;
+  return seconds;
+}
+
+// Times assembling the source, code and fixups separately
+static void timeAssemble(const Inputs *inputs, double *code, double *fixup) {
+  Assembler *assembler = malloc(sizeof(Assembler));
+
+  initAssembler(assembler, inputs->source, "generated");
+
+  double start = now();
+  assembleCode(assembler);
+  double middle = now();
+  resolveLabels(assembler);
+  double end = now();
+
+  *code = middle - start;
+  *fixup = end - middle;
+
+  freeAssembler(assembler);
+  free(assembler);
+}
+
+enum Stage {
+  STAGE_SCAN,
+  STAGE_EVAL,
+  STAGE_TABLE,
+  STAGE_CODE,
+  STAGE_FIXUP,
+  STAGE_COUNT,
+};
+
+static const char *stageNames[] = {
+    [STAGE_SCAN] = "scan",   [STAGE_EVAL] = "evaluate",
+    [STAGE_TABLE] = "table", [STAGE_CODE] = "assembleCode",
+    [STAGE_FIXUP] = "resolveLabels",
+};
+
+static const char *stageNotes[] = {
+    [STAGE_SCAN] = "scanToken over the source, evaluating numbers",
+    [STAGE_EVAL] = "evaluate on every number operand",
+    [STAGE_TABLE] = "addElement every label, getElement every reference",
+    [STAGE_CODE] = "every section, scanning and labels included",
+    [STAGE_FIXUP] = "patching every label reference",
+};
+
+static void runStages(const Inputs *inputs, int repeat) {
+  double best[STAGE_COUNT];
+
+  for (int i = 0; i < repeat; i++) {
+    double seconds[STAGE_COUNT];
+
+    seconds[STAGE_SCAN] = timeScan(inputs);
+    seconds[STAGE_EVAL] = timeEval(inputs);
+    seconds[STAGE_TABLE] = timeTable(inputs);
+    timeAssemble(inputs, &seconds[STAGE_CODE], &seconds[STAGE_FIXUP]);
+
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+      if (i == 0 || seconds[stage] < best[stage]) {
+        best[stage] = seconds[stage];
+      }
+    }
+  }
+
+  printf("%-14s %10s  %s\n", "stage", "best ms", "measures");
+
+  for (int stage = 0; stage < STAGE_COUNT; stage++) {
+    printf("%-14s %10.3f  %s\n", stageNames[stage], best[stage] * 1e3,
+           stageNotes[stage]);
+  }
+}
+
+static double perCall(double seconds, long calls) {
+  return calls ? seconds * 1e9 / calls : 0;
+}
+
+static void benchTable(int size, int repeat) {
+  char **names = malloc(size * sizeof(char *));
+  char **missing = malloc(size * sizeof(char *));
+
+  for (int i = 0; i < size; i++) {
+    char name[MAX_IDENTIFIER_LEN];
+
+    snprintf(name, sizeof(name), "symbol_%d", i);
+    names[i] = strdup(name);
+    snprintf(name, sizeof(name), "missing_%d", i);
+    missing[i] = strdup(name);
+  }
+
+  double add = 0, get = 0, check = 0;
+
+  for (int round = 0; round < repeat; round++) {
+    Table table;
+    long sum = 0;
+
+    initTable(&table);
+
+    double start = now();
+    for (int i = 0; i < size; i++) {
+      addElement(&table, names[i], i);
+    }
+    double added = now();
+    for (int i = 0; i < size; i++) {
+      sum += getElement(&table, names[i]);
+    }
+    double got = now();
+    for (int i = 0; i < size; i++) {
+      sum += checkElement(&table, missing[i]);
+    }
+    double checked = now();
+
+    freeTable(&table);
+    sink = sum;
+
+    if (round == 0 || added - start < add) {
+      add = added - start;
+    }
+    if (round == 0 || got - added < get) {
+      get = got - added;
+    }
+    if (round == 0 || checked - got < check) {
+      check = checked - got;
+    }
+  }
+
+  printf("table %-8d %10.1f %10.1f %10.1f\n", size, perCall(add, size),
+         perCall(get, size), perCall(check, size));
+
+  for (int i = 0; i < size; i++) {
+    free(names[i]);
+    free(missing[i]);
+  }
+
+  free(names);
+  free(missing);
+}
+
+static void benchEval(const char *src, int iterations, int repeat) {
+  double best = 0;
+
+  for (int round = 0; round < repeat; round++) {
+    long sum = 0;
+
+    double start = now();
+    for (int i = 0; i < iterations; i++) {
+      // evaluate works on its own copy, like the scanner's
+      char buf[MAX_EXPR_LEN];
+      Expr expr;
+
+      strcpy(buf, src);
+      initExpr(&expr, buf);
+      sum += evaluate(&expr);
+    }
+    double seconds = now() - start;
+
+    sink = sum;
+
+    if (round == 0 || seconds < best) {
+      best = seconds;
+    }
+  }
+
+  printf("eval  %-34s %10.1f\n", src, perCall(best, iterations));
+}
+
+static void runMicro(int iterations, int repeat) {
+  printf("%-14s %10s %10s %10s\n", "table", "add ns", "get ns", "miss ns");
+
+  int sizes[] = {16, 256, 4096, 16384};
+
+  for (int i = 0; i < 4; i++) {
+    benchTable(sizes[i], repeat);
+  }
+
+  printf("\n%-40s %10s\n", "eval", "ns");
+
+  const char *exprs[] = {
+      "42",
+      "1 + 2",
+      "12 * 3 + 7 - 5 / 1",
+      "1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + 9 + 10",
+  };
+
+  for (int i = 0; i < 4; i++) {
+    benchEval(exprs[i], iterations, repeat);
+  }
+}
+
+static void usage(void) {
+  printf("Usage: asm_bench [options]\n"
+         "  --lines=N          Instructions in the generated program, 8000 by "
+         "default\n"
+         "  --label-every=N    Define a label every N instructions, 8 by "
+         "default\n"
+         "  --orgs=N           Spread the code over N .org sections, 4 by "
+         "default\n"
+         "  --expr-every=N     Write every Nth number as an expression, 4 by "
+         "default,\n"
+         "                     0 for none\n"
+         "  --seed=N           Seed of the generator\n"
+         "  --emit=PATH        Also write the generated source to PATH\n"
+         "  --repeat=N         Rounds per measurement, the best is reported, "
+         "5 by\n"
+         "                     default\n"
+         "  --iterations=N     Calls per eval microbenchmark, 100000 by "
+         "default\n");
+}
+
+// Returns the value of a '--name=value' argument, or NULL if arg is not name
+static char *option(char *arg, const char *name) {
+  int len = strlen(name);
+
+  if (strncmp(arg, name, len) != 0 || arg[len] != '=') {
+    return NULL;
+  }
+
+  return arg + len + 1;
+}
+
+static int number(const char *str, const char *name, int min) {
+  char *end;
+  long n = strtol(str, &end, 0);
+
+  if (*str == '\0' || *end != '\0' || n < min) {
+    printf("Expected number of at least %d for '%s'.\n", min, name);
+    exit(-1);
+  }
+
+  return n;
+}
+
+int main(int count, char **args) {
+  Config config = {8000, 8, 4, 4, 1};
+  char *emit = NULL;
+  int repeat = 5;
+  int iterations = 100000;
+
+  for (int i = 1; i < count; i++) {
+    char *arg = args[i];
+    char *val;
+
+    if ((val = option(arg, "--lines"))) {
+      config.lines = number(val, "--lines", 1);
+    } else if ((val = option(arg, "--label-every"))) {
+      config.labelEvery = number(val, "--label-every", 1);
+    } else if ((val = option(arg, "--orgs"))) {
+      config.orgs = number(val, "--orgs", 1);
+    } else if ((val = option(arg, "--expr-every"))) {
+      config.exprEvery = number(val, "--expr-every", 0);
+    } else if ((val = option(arg, "--seed"))) {
+      config.seed = number(val, "--seed", 0);
+    } else if ((val = option(arg, "--emit"))) {
+      emit = val;
+    } else if ((val = option(arg, "--repeat"))) {
+      repeat = number(val, "--repeat", 1);
+    } else if ((val = option(arg, "--iterations"))) {
+      iterations = number(val, "--iterations", 1);
+    } else {
+      usage();
+      exit(-1);
+    }
+  }
+
+  char *source = generate(&config);
+
+  if (emit) {
+    FILE *fileptr = fopen(emit, "w");
+
+    if (!fileptr) {
+      printf("Error opening '%s'.\n", emit);
+      exit(-1);
+    }
+
+    fputs(source, fileptr);
+    fclose(fileptr);
+  }
+
+  int labels = (config.lines + config.labelEvery - 1) / config.labelEvery;
+  Inputs inputs;
+
+  gatherInputs(&inputs, source, labels);
+
+  printf("%s build, %d lines, %zu bytes of source, %d labels, %d "
+         "references, %d numbers\n\n",
+         BUILD_TYPE, config.lines, strlen(source), labels, inputs.fixupCount,
+         inputs.exprCount);
+
+  runStages(&inputs, repeat);
+  printf("\n");
+  runMicro(iterations, repeat);
+
+  freeInputs(&inputs);
+  free(source);
+  return 0;
+}
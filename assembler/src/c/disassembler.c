@@ -18,6 +18,13 @@ const char *opCodeStrings[] = {
     [CODE_CMP] = "CMP",   [CODE_JE] = "JE",     [CODE_JNE] = "JNE",
     [CODE_JG] = "JG",     [CODE_JL] = "JL",     [CODE_PUSH] = "PUSH",
     [CODE_POP] = "POP",   [CODE_CALL] = "CALL", [CODE_HALT] = "HALT",
+    [CODE_COPY] = "COPY", [CODE_FILL] = "FILL", [CODE_LDR] = "LDR",
+    [CODE_STR] = "STR",   [CODE_LDX] = "LDX",   [CODE_STX] = "STX",
+    [CODE_BR] = "BR",     [CODE_BRE] = "BRE",   [CODE_BRNE] = "BRNE",
+    [CODE_BRG] = "BRG",   [CODE_BRL] = "BRL",   [CODE_BRS] = "BRS",
+    [CODE_BRES] = "BRES", [CODE_BRNES] = "BRNES", [CODE_BRGS] = "BRGS",
+    [CODE_BRLS] = "BRLS", [CODE_JSR] = "JSR",   [CODE_XCHG] = "XCHG",
+    [CODE_XADD] = "XADD", [CODE_CAS] = "CAS",   [CODE_FENCE] = "FENCE",
 };
 
 static void printR(uint8_t r) {
@@ -64,12 +71,16 @@ void disassemble(uint8_t *bytes, int size) {
     case CODE_NAND:
     case CODE_SHFT:
     case CODE_CMP:
+    case CODE_LDR:
+    case CODE_STR:
       printf("%s OP, ARGS [", opCodeStrings[bytes[i]]);
       printRR(bytes[++i], bytes[++i]);
       printf("]\n");
       break;
     case CODE_LD:
     case CODE_ST:
+    case CODE_XCHG:
+    case CODE_XADD:
       printf("%s OP, ARGS [", opCodeStrings[bytes[i]]);
       printRA(bytes[i + 1], bytes[i + 2] + (bytes[i + 3] << 8));
       printf("]\n");
@@ -88,14 +99,56 @@ void disassemble(uint8_t *bytes, int size) {
     case CODE_JNE:
     case CODE_JG:
     case CODE_JL:
+    case CODE_BR:
+    case CODE_BRE:
+    case CODE_BRNE:
+    case CODE_BRG:
+    case CODE_BRL:
+    case CODE_JSR:
       printf("%s OP, ARGS [", opCodeStrings[bytes[i]]);
       printA(bytes[i + 1] + (bytes[i + 2] << 8));
       printf("]\n");
       i += 2;
       break;
+    case CODE_BRS:
+    case CODE_BRES:
+    case CODE_BRNES:
+    case CODE_BRGS:
+    case CODE_BRLS:
+      // Offset from the next instruction
+      printf("%s OP, ARGS [", opCodeStrings[bytes[i]]);
+      printA(i + 2 + (int8_t)bytes[i + 1]);
+      printf("]\n");
+      i++;
+      break;
+    case CODE_LDX:
+    case CODE_STX:
+    case CODE_CAS:
+      printf("%s OP, ARGS [", opCodeStrings[bytes[i]]);
+      printRR(bytes[i + 1], bytes[i + 2]);
+      printf(", ");
+      printA(bytes[i + 3] + (bytes[i + 4] << 8));
+      printf("]\n");
+      i += 4;
+      break;
+    case CODE_COPY:
+      printf("%s OP, ARGS [", opCodeStrings[bytes[i]]);
+      printA(bytes[i + 1] + (bytes[i + 2] << 8));
+      printf(", ");
+      printA(bytes[i + 3] + (bytes[i + 4] << 8));
+      printf(", Length %d]\n", bytes[i + 5] + (bytes[i + 6] << 8));
+      i += 6;
+      break;
+    case CODE_FILL:
+      printf("%s OP, ARGS [", opCodeStrings[bytes[i]]);
+      printRA(bytes[i + 1], bytes[i + 2] + (bytes[i + 3] << 8));
+      printf(", Length %d]\n", bytes[i + 4] + (bytes[i + 5] << 8));
+      i += 5;
+      break;
     case CODE_RET:
     case CODE_HALT:
     case CODE_CALL:
+    case CODE_FENCE:
       printf("OP %s\n", opCodeStrings[bytes[i]]);
       break;
     default:
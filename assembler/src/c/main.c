@@ -62,6 +62,19 @@ int main(int count, char **args) {
 
   writeBinary(assembler.output, BYTE_MAX, args[2]);
 
+  // An optional third argument receives the symbol map
+  if (count > 3) {
+    FILE *fileptr = fopen(args[3], "w");
+
+    if (!fileptr) {
+      printf("Unexpected error opening file.\n");
+      exit(-1);
+    }
+
+    writeSymbols(&assembler, fileptr);
+    fclose(fileptr);
+  }
+
   //disassemble(bytes, 50);
 
   // for (int i = 0; i < 50; i++) {
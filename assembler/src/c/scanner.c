@@ -56,8 +56,19 @@ static TokenType getKeyword(char *start, char *end, int len) {
     return checkKeyword(start + 1, end, 2, "rg", TOKEN_DIR_ORG);
   case 'm':
     return checkKeyword(start + 1, end, 1, "v", TOKEN_MV);
-  case 'x':
-    return checkKeyword(start + 1, end, 2, "or", TOKEN_XOR);
+  case 'x': {
+    if (len > 1) {
+      switch (start[1]) {
+      case 'o':
+        return checkKeyword(start + 2, end, 1, "r", TOKEN_XOR);
+      case 'c':
+        return checkKeyword(start + 2, end, 2, "hg", TOKEN_XCHG);
+      case 'a':
+        return checkKeyword(start + 2, end, 2, "dd", TOKEN_XADD);
+      }
+    }
+    return TOKEN_IDENTIFIER;
+  }
   case 'j': {
     if (len >= 1) {
       switch (start[1]) {
@@ -71,6 +82,8 @@ static TokenType getKeyword(char *start, char *end, int len) {
         return !isAlpha(start[2]) ? TOKEN_JG : TOKEN_IDENTIFIER;
       case 'l':
         return !isAlpha(start[2]) ? TOKEN_JL : TOKEN_IDENTIFIER;
+      case 's':
+        return checkKeyword(start + 2, end, 1, "r", TOKEN_JSR);
       default:
         return TOKEN_IDENTIFIER;
       }
@@ -92,7 +105,15 @@ static TokenType getKeyword(char *start, char *end, int len) {
       case 4:
         return checkKeyword(start + 1, end, 3, "ubr", TOKEN_SUBR);
       case 3:
-        return checkKeyword(start + 1, end, 2, "ub", TOKEN_SUB);
+        switch (start[1]) {
+        case 'u':
+          return checkKeyword(start + 2, end, 1, "b", TOKEN_SUB);
+        case 't':
+          return start[2] == 'r'   ? TOKEN_STR
+                 : start[2] == 'x' ? TOKEN_STX
+                                   : TOKEN_IDENTIFIER;
+        }
+        return TOKEN_IDENTIFIER;
       case 2:
         return start[1] == 't' ? TOKEN_ST : TOKEN_IDENTIFIER;
     }
@@ -151,7 +172,48 @@ static TokenType getKeyword(char *start, char *end, int len) {
     return checkKeyword(start + 1, end, 3, "alt", TOKEN_HALT);
   }
   case 'c': {
-    return checkKeyword(start + 1, end, 3, "all", TOKEN_CALL);
+    if (len > 1) {
+      switch (start[1]) {
+      case 'a':
+        return len == 3 ? checkKeyword(start + 2, end, 1, "s", TOKEN_CAS)
+                        : checkKeyword(start + 2, end, 2, "ll", TOKEN_CALL);
+      case 'o':
+        return checkKeyword(start + 2, end, 2, "py", TOKEN_COPY);
+      }
+    }
+    return TOKEN_IDENTIFIER;
+  }
+  case 'b': {
+    if (len < 2 || start[1] != 'r') {
+      return TOKEN_IDENTIFIER;
+    }
+
+    switch (len) {
+    case 2:
+      return TOKEN_BR;
+    case 3:
+      return start[2] == 'e'   ? TOKEN_BRE
+             : start[2] == 'g' ? TOKEN_BRG
+             : start[2] == 'l' ? TOKEN_BRL
+                               : TOKEN_IDENTIFIER;
+    case 4:
+      return checkKeyword(start + 2, end, 2, "ne", TOKEN_BRNE);
+    }
+    return TOKEN_IDENTIFIER;
+  }
+  case 'l': {
+    if (len == 3 && start[1] == 'd') {
+      return start[2] == 'r'   ? TOKEN_LDR
+             : start[2] == 'x' ? TOKEN_LDX
+                               : TOKEN_IDENTIFIER;
+    }
+    return len == 2 && start[1] == 'd' ? TOKEN_LD : TOKEN_IDENTIFIER;
+  }
+  case 'f': {
+    if (len > 1 && start[1] == 'e') {
+      return checkKeyword(start + 2, end, 3, "nce", TOKEN_FENCE);
+    }
+    return checkKeyword(start + 1, end, 3, "ill", TOKEN_FILL);
   }
   }
 
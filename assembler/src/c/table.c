@@ -5,12 +5,9 @@
 #include <string.h>
 
 #define START_SIZE 16
-#define EMPTY_ELEMENT                                                          \
-  (Element) { 0, NULL }
 #define NEW_SIZE(n) (n * 2)
 
 static int hash(char *str, int size) {
-  int index = 0;
   int len = strlen(str);
   int hash = 0;
 
@@ -21,14 +18,15 @@ static int hash(char *str, int size) {
   return hash;
 }
 
-static void putElement(Table *table, int index, Element element) {
-  while (table->elements[index].str) {
-    if (index == table->size)
-      index = 2;
-    index++;
+// Returns the slot holding str, or the empty slot it would go in
+static int findSlot(Element *elements, int size, char *str) {
+  int index = hash(str, size);
+
+  while (elements[index].str && strcmp(str, elements[index].str) != 0) {
+    index = (index + 1) % size;
   }
 
-  table->elements[index] = element;
+  return index;
 }
 
 void initTable(Table *table) {
@@ -38,37 +36,46 @@ void initTable(Table *table) {
   table->size = START_SIZE;
 }
 
-void addElement(Table *table, char *str, uint16_t value) {
-  if (table->size == table->count + 1) {
-    // Reallocate elements pointer
-    table->elements = realloc(table->elements, NEW_SIZE(table->size));
-    table->size = NEW_SIZE(table->size);
-
-    // Now we gotta re-hash everything
-    for (int i = 0; i < table->size; i++) {
-      if (table->elements[i].str) {
-        putElement(table, hash(str, table->size), table->elements[i]);
-        table->elements[i] = EMPTY_ELEMENT;
-      }
+static void growTable(Table *table) {
+  int size = NEW_SIZE(table->size);
+  Element *elements = calloc(size, sizeof(Element));
+
+  // Now we gotta re-hash everything
+  for (int i = 0; i < table->size; i++) {
+    if (table->elements[i].str) {
+      elements[findSlot(elements, size, table->elements[i].str)] =
+          table->elements[i];
     }
   }
 
+  free(table->elements);
+  table->elements = elements;
+  table->size = size;
+}
+
+void addElement(Table *table, char *str, uint16_t value) {
+  // Keep at least half the slots empty so probes stay short
+  if ((table->count + 1) * 2 > table->size) {
+    growTable(table);
+  }
+
+  int index = findSlot(table->elements, table->size, str);
+
+  if (table->elements[index].str) {
+    table->elements[index].element = value;
+    return;
+  }
+
   char *newStr = malloc((strlen(str) + 1) * sizeof(char));
 
   memcpy(newStr, str, strlen(str) + 1);
 
-  table->elements[hash(str, table->size)] = (Element){value, newStr};
+  table->elements[index] = (Element){value, newStr};
+  table->count++;
 }
 
 uint16_t getElement(Table *table, char *str) {
-  int index = hash(str, table->size);
-
-  while (table->elements[index].str &&
-         memcmp(str, table->elements[index].str, strlen(str)) != 0) {
-    if (index == table->size - 1)
-      index = 2;
-    index++;
-  }
+  int index = findSlot(table->elements, table->size, str);
 
   if (!table->elements[index].str) {
     printf("Warning: Element '%s' does not exist.\n", str);
@@ -79,7 +86,7 @@ uint16_t getElement(Table *table, char *str) {
 }
 
 bool checkElement(Table *table, char *str) {
-  return table->elements[hash(str, table->size)].str;
+  return table->elements[findSlot(table->elements, table->size, str)].str;
 }
 
 void freeTable(Table *table) {
@@ -2,13 +2,13 @@
 #define ASSEMBLER_H_
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include "scanner.h"
 #include "table.h"
 
 #define BYTE_MAX 0xFFFF + 1
 #define MAX_IDENTIFIER_LEN 64
-#define MAX_REFERENCE_AMOUNT 512
 
 typedef uint8_t byte;
 
@@ -37,8 +37,39 @@ enum OPCODES {
   OP_POP,
   OP_CALL,
   OP_HALT,
+  OP_COPY,
+  OP_FILL,
+  OP_LDR,
+  OP_STR,
+  OP_LDX,
+  OP_STX,
+  OP_BR,
+  OP_BRE,
+  OP_BRNE,
+  OP_BRG,
+  OP_BRL,
+  OP_BRS,
+  OP_BRES,
+  OP_BRNES,
+  OP_BRGS,
+  OP_BRLS,
+  OP_JSR,
+  OP_XCHG,
+  OP_XADD,
+  OP_CAS,
+  OP_FENCE,
 };
 
+// A label reference waiting for the label's address, lo and hi being where
+// its two bytes go
+struct Fixup {
+  char label[MAX_IDENTIFIER_LEN];
+  uint16_t lo;
+  uint16_t hi;
+};
+
+typedef struct Fixup Fixup;
+
 struct Assembler {
   Scanner scanner;
   char *src;
@@ -55,6 +86,10 @@ struct Assembler {
 
   Table symbolTable;
 
+  Fixup *fixups;
+  int fixupCount;
+  int fixupCapacity;
+
   char *filename;
 };
 
@@ -66,6 +101,15 @@ void initAssembler(Assembler *assembler, char *src, char *filename);
 // Assemble the file
 byte *assemble(Assembler *assembler);
 
+// The two stages of assemble. assembleCode emits every section with its
+// label references left as zeroes, resolveLabels then fills them in.
+void assembleCode(Assembler *assembler);
+void resolveLabels(Assembler *assembler);
+
+// Write the address of every label, one 'ADDRESS NAME' line each in address
+// order, for the VM's profiler
+void writeSymbols(Assembler *assembler, FILE *out);
+
 // Free assembler
 void freeAssembler(Assembler *assembler);
 
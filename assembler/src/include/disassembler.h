@@ -28,6 +28,27 @@ enum Ops {
   CODE_POP,
   CODE_CALL,
   CODE_HALT,
+  CODE_COPY,
+  CODE_FILL,
+  CODE_LDR,
+  CODE_STR,
+  CODE_LDX,
+  CODE_STX,
+  CODE_BR,
+  CODE_BRE,
+  CODE_BRNE,
+  CODE_BRG,
+  CODE_BRL,
+  CODE_BRS,
+  CODE_BRES,
+  CODE_BRNES,
+  CODE_BRGS,
+  CODE_BRLS,
+  CODE_JSR,
+  CODE_XCHG,
+  CODE_XADD,
+  CODE_CAS,
+  CODE_FENCE,
 };
 
 enum Registers {
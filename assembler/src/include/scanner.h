@@ -30,6 +30,22 @@ enum TokenType {
   TOKEN_POP,
   TOKEN_CALL,
   TOKEN_HALT,
+  TOKEN_COPY,
+  TOKEN_FILL,
+  TOKEN_LDR,
+  TOKEN_STR,
+  TOKEN_LDX,
+  TOKEN_STX,
+  TOKEN_BR,
+  TOKEN_BRE,
+  TOKEN_BRNE,
+  TOKEN_BRG,
+  TOKEN_BRL,
+  TOKEN_JSR,
+  TOKEN_XCHG,
+  TOKEN_XADD,
+  TOKEN_CAS,
+  TOKEN_FENCE,
 
   // Registers
   TOKEN_SR,
@@ -0,0 +1,69 @@
+#include "aot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static bool covered(const Translation *translation, uint16_t address) {
+  return translation->covered[address >> 3] & (1 << (address & 7));
+}
+
+void translationWritten(VM *vm, uint16_t address, int len) {
+  Translation *translation = vm->_translation;
+
+  if (translation->stale) {
+    return;
+  }
+
+  // Writing back what was there leaves the translation valid, as when a
+  // program reads its console over its own code at address 0
+  for (int i = 0; i < len; i++) {
+    uint16_t at = address + i;
+
+    if (covered(translation, at) &&
+        readByte(vm, at) != translation->image[at]) {
+      translation->stale = true;
+      return;
+    }
+  }
+}
+
+int runTranslation(Translation *translation) {
+  VM vm;
+
+  initCpu(&vm, translation->image);
+  vm._translation = translation;
+  translation->stale = false;
+
+  // Stores only look for decoded code where a decode page exists, so every
+  // page holding translated code gets one
+  for (int page = 0; page < MEMORY_PAGES; page++) {
+    for (int i = 0; i < MEMORY_PAGE_SIZE / 8; i++) {
+      if (translation->covered[page * MEMORY_PAGE_SIZE / 8 + i]) {
+        vm._decode.pages[page] = calloc(DECODE_PAGE_SIZE, sizeof(MicroOp));
+        break;
+      }
+    }
+  }
+
+  while (vm._state == STATUS_PAUSED) {
+    if (translation->stale) {
+      run(&vm, NO_BUDGET);
+      break;
+    }
+
+    translation->run(&vm);
+
+    // What the translation left behind, one instruction at a time so it
+    // gets back into translated code as soon as possible
+    if (!translation->stale) {
+      run(&vm, 1);
+    }
+  }
+
+  fputs(vm._message, vm._output);
+
+  int status = vm._state == STATUS_HALTED ? 0 : -1;
+
+  freeCpu(&vm);
+  return status;
+}
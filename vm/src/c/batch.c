@@ -0,0 +1,289 @@
+#include "batch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "jit.h"
+#include "pool.h"
+#include "sched.h"
+#include "vm.h"
+
+// State shared by the workers of one runBatch call
+struct BatchRun {
+  Batch *batch;
+
+  // One JIT per worker, handed from instance to instance. NULL entries have
+  // not been created yet or have no backend on this host.
+  Jit **jits;
+  bool *jitTried;
+};
+
+typedef struct BatchRun BatchRun;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Jit *workerJit(BatchRun *state, int worker) {
+  if (!state->jitTried[worker]) {
+    state->jitTried[worker] = true;
+    state->jits[worker] = malloc(sizeof(Jit));
+
+    if (!initJit(state->jits[worker])) {
+      free(state->jits[worker]);
+      state->jits[worker] = NULL;
+    }
+  }
+
+  if (state->jits[worker]) {
+    resetJit(state->jits[worker]);
+  }
+
+  return state->jits[worker];
+}
+
+// Opens the instance's streams and creates its VM. If the input cannot be
+// read the instance fails with the reason as its output and NULL is returned.
+static VM *startInstance(Batch *batch, BatchInstance *instance, FILE **input,
+                         FILE **output) {
+  *output = open_memstream(&instance->output, &instance->outputLen);
+  *input = fopen(instance->input, "r");
+
+  if (!*input) {
+    fprintf(*output, "Cannot open file '%s'.\n", instance->input);
+    fclose(*output);
+    instance->status = -1;
+    return NULL;
+  }
+
+  // A VM holds all of memory, too much for a worker's stack
+  VM *vm = malloc(sizeof(VM));
+
+  initCpu(vm, batch->image);
+  vm->_input = *input;
+  vm->_output = *output;
+
+  return vm;
+}
+
+static void finishInstance(BatchInstance *instance, VM *vm, FILE *input,
+                           FILE *output) {
+  instance->status = vm->_state == STATUS_HALTED ? 0 : -1;
+  fputs(vm->_message, output);
+
+  freeCpu(vm);
+  free(vm);
+  fclose(input);
+  fclose(output);
+}
+
+static bool watched(Batch *batch) {
+  return batch->maxInstructions || batch->timeout;
+}
+
+static void watch(Batch *batch, Scheduler *sched) {
+  sched->maxInstructions = batch->maxInstructions;
+  sched->timeout = batch->timeout;
+}
+
+static void runInstance(void *ctx, int task, int worker) {
+  BatchRun *state = ctx;
+  Batch *batch = state->batch;
+  BatchInstance *instance = &batch->instances[task];
+  double start = now();
+
+  FILE *input;
+  FILE *output;
+  VM *vm = startInstance(batch, instance, &input, &output);
+
+  if (vm) {
+    if (batch->jit) {
+      vm->_jit = workerJit(state, worker);
+    }
+
+    // Without a watchdog the VM runs unsliced, on the fastest loop
+    if (watched(batch)) {
+      Scheduler sched;
+
+      initScheduler(&sched, SCHED_SLICE);
+      watch(batch, &sched);
+      scheduleVm(&sched, vm);
+      runScheduler(&sched);
+      freeScheduler(&sched);
+    } else {
+      run(vm, NO_BUDGET);
+    }
+
+    finishInstance(instance, vm, input, output);
+  }
+
+  instance->seconds = now() - start;
+}
+
+bool loadBatch(Batch *batch, const char *list, const uint8_t *image) {
+  FILE *fptr = fopen(list, "r");
+
+  if (!fptr) {
+    return false;
+  }
+
+  batch->image = image;
+  batch->jit = false;
+  batch->maxInstructions = 0;
+  batch->timeout = 0;
+  batch->instances = NULL;
+  batch->count = 0;
+  batch->seconds = 0;
+
+  int capacity = 0;
+  char *line = NULL;
+  size_t lineCap = 0;
+  ssize_t len;
+
+  while ((len = getline(&line, &lineCap, fptr)) != -1) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
+
+    if (len == 0) {
+      continue;
+    }
+
+    if (batch->count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      batch->instances =
+          realloc(batch->instances, capacity * sizeof(BatchInstance));
+    }
+
+    batch->instances[batch->count++] =
+        (BatchInstance){strdup(line), NULL, 0, 0, 0};
+  }
+
+  free(line);
+  fclose(fptr);
+  return true;
+}
+
+void runBatch(Batch *batch, int threads) {
+  if (threads < 1) {
+    threads = processorCount();
+  }
+
+  BatchRun state = {batch, calloc(threads, sizeof(Jit *)),
+                    calloc(threads, sizeof(bool))};
+  double start = now();
+
+  runPool(threads, batch->count, runInstance, &state);
+
+  batch->seconds = now() - start;
+
+  for (int i = 0; i < threads; i++) {
+    if (state.jits[i]) {
+      freeJit(state.jits[i]);
+      free(state.jits[i]);
+    }
+  }
+
+  free(state.jits);
+  free(state.jitTried);
+}
+
+void runBatchSliced(Batch *batch, uint64_t slice) {
+  VM **vms = calloc(batch->count, sizeof(VM *));
+  FILE **inputs = calloc(batch->count, sizeof(FILE *));
+  FILE **outputs = calloc(batch->count, sizeof(FILE *));
+  int *entries = calloc(batch->count, sizeof(int));
+
+  Scheduler sched;
+  double start = now();
+
+  initScheduler(&sched, slice);
+  watch(batch, &sched);
+
+  for (int i = 0; i < batch->count; i++) {
+    vms[i] = startInstance(batch, &batch->instances[i], &inputs[i],
+                           &outputs[i]);
+
+    if (vms[i]) {
+      entries[i] = scheduleVm(&sched, vms[i]);
+    }
+  }
+
+  runScheduler(&sched);
+
+  for (int i = 0; i < batch->count; i++) {
+    BatchInstance *instance = &batch->instances[i];
+
+    // Time spent running the instance rather than waiting for its turns
+    instance->seconds = 0;
+
+    if (vms[i]) {
+      instance->seconds = sched.entries[entries[i]].seconds;
+      finishInstance(instance, vms[i], inputs[i], outputs[i]);
+    }
+  }
+
+  batch->seconds = now() - start;
+
+  freeScheduler(&sched);
+  free(vms);
+  free(inputs);
+  free(outputs);
+  free(entries);
+}
+
+bool writeBatchOutput(Batch *batch, const char *dir) {
+  char path[4096];
+
+  for (int i = 0; i < batch->count; i++) {
+    BatchInstance *instance = &batch->instances[i];
+
+    snprintf(path, sizeof(path), "%s/%d.out", dir, i);
+
+    FILE *fptr = fopen(path, "w");
+
+    if (!fptr) {
+      return false;
+    }
+
+    fwrite(instance->output, sizeof(char), instance->outputLen, fptr);
+    fclose(fptr);
+  }
+
+  return true;
+}
+
+void printBatchSummary(Batch *batch, FILE *out) {
+  int failed = 0;
+
+  fprintf(out, "%-8s %-6s %-10s %-10s %s\n", "instance", "status", "ms",
+          "output", "input");
+
+  for (int i = 0; i < batch->count; i++) {
+    BatchInstance *instance = &batch->instances[i];
+
+    if (instance->status != 0) {
+      failed++;
+    }
+
+    fprintf(out, "%-8d %-6d %-10.3f %-10zu %s\n", i, instance->status,
+            instance->seconds * 1000, instance->outputLen, instance->input);
+  }
+
+  fprintf(out, "%d instances, %d succeeded, %d failed in %.3fs (%.1f/s)\n",
+          batch->count, batch->count - failed, failed, batch->seconds,
+          batch->seconds > 0 ? batch->count / batch->seconds : 0);
+}
+
+void freeBatch(Batch *batch) {
+  for (int i = 0; i < batch->count; i++) {
+    free(batch->instances[i].input);
+    free(batch->instances[i].output);
+  }
+
+  free(batch->instances);
+}
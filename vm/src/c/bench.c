@@ -0,0 +1,510 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "jit.h"
+#include "vm.h"
+
+#ifndef BUILD_TYPE
+#define BUILD_TYPE "unknown"
+#endif
+
+// Where the corpus puts subroutines and the data it copies
+#define SUBROUTINE 0x4000
+#define COPY_SOURCE 0x1000
+#define COPY_DEST 0x2000
+#define COPY_BYTES 32
+
+// Builds an image instruction by instruction
+struct Builder {
+  uint8_t *image;
+  uint16_t at;
+};
+
+typedef struct Builder Builder;
+
+static void emitBytes(Builder *b, const uint8_t *bytes, int len) {
+  memcpy(b->image + b->at, bytes, len);
+  b->at += len;
+}
+
+static void emitOp(Builder *b, uint8_t op) { emitBytes(b, &op, 1); }
+
+static void emitR(Builder *b, uint8_t op, uint8_t reg) {
+  emitBytes(b, (uint8_t[]){op, reg}, 2);
+}
+
+// Register and value, or two registers
+static void emitRV(Builder *b, uint8_t op, uint8_t reg, uint8_t val) {
+  emitBytes(b, (uint8_t[]){op, reg, val}, 3);
+}
+
+static void emitA(Builder *b, uint8_t op, uint16_t address) {
+  emitBytes(b, (uint8_t[]){op, address, address >> 8}, 3);
+}
+
+static void emitRA(Builder *b, uint8_t op, uint8_t reg, uint16_t address) {
+  emitBytes(b, (uint8_t[]){op, reg, address, address >> 8}, 4);
+}
+
+// Two addresses and a 16 bit length, as block instructions take
+static void emitAAW(Builder *b, uint8_t op, uint16_t dest, uint16_t src,
+                    uint16_t len) {
+  emitBytes(b,
+            (uint8_t[]){op, dest, dest >> 8, src, src >> 8, len, len >> 8},
+            7);
+}
+
+// Starts a loop counting reg down from count. Every jump pushes a link, so
+// the loop head drops the one that brought it there.
+static uint16_t beginLoop(Builder *b, uint8_t reg, uint8_t count) {
+  emitRV(b, OP_ADD, reg, count);
+  emitA(b, OP_JMP, b->at + 3);
+
+  uint16_t head = b->at;
+  emitRV(b, OP_SUB, R_SP, 2);
+  return head;
+}
+
+// Jumps back to head until reg reaches 1
+static void endLoop(Builder *b, uint8_t reg, uint16_t head) {
+  emitRV(b, OP_SUB, reg, 1);
+  emitRV(b, OP_MV, reg, R_SR);
+  emitA(b, OP_JNE, head);
+}
+
+// The same loop closed by a short branch, which pushes nothing
+static uint16_t beginShortLoop(Builder *b, uint8_t reg, uint8_t count) {
+  emitRV(b, OP_ADD, reg, count);
+  return b->at;
+}
+
+static void endShortLoop(Builder *b, uint8_t reg, uint16_t head) {
+  emitRV(b, OP_SUB, reg, 1);
+  emitRV(b, OP_MV, reg, R_SR);
+  emitBytes(b, (uint8_t[]){OP_BRNES, (uint8_t)(head - (b->at + 2))}, 2);
+}
+
+static void emitAluBody(Builder *b) {
+  emitRV(b, OP_ADD, R_G0, 3);
+  emitRV(b, OP_XOR, R_G1, R_G0);
+  emitRV(b, OP_ADDR, R_G2, R_G1);
+  emitRV(b, OP_AND, R_G3, R_G2);
+  emitRV(b, OP_OR, R_G4, R_G0);
+  emitRV(b, OP_NAND, R_G5, R_G4);
+  emitRV(b, OP_SHFT, R_G5, R_G6);
+  emitRV(b, OP_SUBR, R_G4, R_G5);
+  emitR(b, OP_NOT, R_G3);
+}
+
+// Arithmetic and logic on registers only
+static void buildAlu(uint8_t *image) {
+  Builder b = {image, 0};
+
+  emitRV(&b, OP_ADD, R_G6, 9);
+
+  uint16_t outer = beginLoop(&b, R_G9, 40);
+  uint16_t middle = beginLoop(&b, R_G8, 250);
+  uint16_t inner = beginLoop(&b, R_G7, 250);
+
+  emitAluBody(&b);
+
+  endLoop(&b, R_G7, inner);
+  endLoop(&b, R_G8, middle);
+  endLoop(&b, R_G9, outer);
+  emitOp(&b, OP_HALT);
+}
+
+// The alu loops with short branches
+static void buildBranch(uint8_t *image) {
+  Builder b = {image, 0};
+
+  emitRV(&b, OP_ADD, R_G6, 9);
+
+  uint16_t outer = beginShortLoop(&b, R_G9, 40);
+  uint16_t middle = beginShortLoop(&b, R_G8, 250);
+  uint16_t inner = beginShortLoop(&b, R_G7, 250);
+
+  emitAluBody(&b);
+
+  endShortLoop(&b, R_G7, inner);
+  endShortLoop(&b, R_G8, middle);
+  endShortLoop(&b, R_G9, outer);
+  emitOp(&b, OP_HALT);
+}
+
+// Recursion a hundred calls deep, every call returned from
+static void buildCalls(uint8_t *image) {
+  Builder b = {image, 0};
+
+  uint16_t outer = beginLoop(&b, R_G8, 60);
+  uint16_t inner = beginLoop(&b, R_G9, 250);
+
+  emitRV(&b, OP_ADD, R_G0, 100);
+  emitA(&b, OP_JMP, SUBROUTINE);
+
+  endLoop(&b, R_G9, inner);
+  endLoop(&b, R_G8, outer);
+  emitOp(&b, OP_HALT);
+
+  // Calls itself until G0 reaches 1, the link of each call being the ret
+  b.at = SUBROUTINE;
+  emitRV(&b, OP_ADD, R_G1, 1);
+  emitRV(&b, OP_SUB, R_G0, 1);
+  emitRV(&b, OP_MV, R_G0, R_SR);
+  emitA(&b, OP_JNE, SUBROUTINE);
+  emitOp(&b, OP_RET);
+}
+
+// Copies a block with unrolled ld and st
+static void buildCopy(uint8_t *image) {
+  Builder b = {image, 0};
+
+  for (int i = 0; i < COPY_BYTES; i++) {
+    image[COPY_SOURCE + i] = i * 7;
+  }
+
+  uint16_t outer = beginLoop(&b, R_G8, 200);
+  uint16_t inner = beginLoop(&b, R_G9, 250);
+
+  for (int i = 0; i < COPY_BYTES; i++) {
+    emitRA(&b, OP_LD, R_G0 + i % 4, COPY_SOURCE + i);
+    emitRA(&b, OP_ST, R_G0 + i % 4, COPY_DEST + i);
+  }
+
+  endLoop(&b, R_G9, inner);
+  endLoop(&b, R_G8, outer);
+  emitOp(&b, OP_HALT);
+}
+
+// The same copy as a single block instruction
+static void buildBlock(uint8_t *image) {
+  Builder b = {image, 0};
+
+  for (int i = 0; i < COPY_BYTES; i++) {
+    image[COPY_SOURCE + i] = i * 7;
+  }
+
+  uint16_t outer = beginLoop(&b, R_G8, 200);
+  uint16_t inner = beginLoop(&b, R_G9, 250);
+
+  emitAAW(&b, OP_COPY, COPY_DEST, COPY_SOURCE, COPY_BYTES);
+
+  endLoop(&b, R_G9, inner);
+  endLoop(&b, R_G8, outer);
+  emitOp(&b, OP_HALT);
+}
+
+// Prints a line per iteration
+static void buildPrint(uint8_t *image) {
+  Builder b = {image, 0};
+  const char *line = "The quick brown fox jumps over the lazy dog.\n";
+
+  memcpy(image + PRINT_BUFFER, line, strlen(line));
+
+  emitRV(&b, OP_ADD, R_SC, CALL_PRINT);
+
+  uint16_t outer = beginLoop(&b, R_G8, 250);
+  uint16_t inner = beginLoop(&b, R_G9, 250);
+
+  emitOp(&b, OP_CALL);
+
+  endLoop(&b, R_G9, inner);
+  endLoop(&b, R_G8, outer);
+  emitOp(&b, OP_HALT);
+}
+
+struct Program {
+  const char *name;
+  void (*build)(uint8_t *image);
+};
+
+typedef struct Program Program;
+
+static const Program corpus[] = {
+    {"alu", buildAlu},
+    {"branch", buildBranch},
+    {"calls", buildCalls},
+    {"copy", buildCopy},
+    {"block", buildBlock},
+    {"print", buildPrint},
+};
+
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+// Timings of one program
+struct Result {
+  const char *name;
+  uint64_t instructions;
+  double *seconds;
+  double best;
+  double mean;
+};
+
+typedef struct Result Result;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs image once, returning the seconds run() took. Counting the
+// instructions needs a budget, which keeps the run on the checked loop, so
+// timed runs leave it unlimited.
+static double runOnce(const uint8_t *image, Jit *jit, FILE *output,
+                      uint64_t *instructions) {
+  VM vm;
+
+  initCpu(&vm, image);
+  vm._output = output;
+
+  if (jit) {
+    resetJit(jit);
+    vm._jit = jit;
+  }
+
+  uint64_t budget = instructions ? NO_BUDGET - 1 : NO_BUDGET;
+
+  double start = now();
+  run(&vm, budget);
+  double seconds = now() - start;
+
+  if (vm._state != STATUS_HALTED) {
+    printf("Benchmark program faulted: %s", vm._message);
+    exit(-1);
+  }
+
+  if (instructions) {
+    *instructions = budget - vm._budget;
+  }
+
+  freeCpu(&vm);
+  return seconds;
+}
+
+static void runProgram(const Program *program, Result *result, Jit *jit,
+                       FILE *output, int warmup, int repeat) {
+  uint8_t *image = calloc(MEMORY_SIZE, 1);
+  program->build(image);
+
+  result->name = program->name;
+  result->seconds = malloc(repeat * sizeof(double));
+  runOnce(image, jit, output, &result->instructions);
+
+  for (int i = 0; i < warmup; i++) {
+    runOnce(image, jit, output, NULL);
+  }
+
+  result->best = 0;
+  result->mean = 0;
+
+  for (int i = 0; i < repeat; i++) {
+    double seconds = runOnce(image, jit, output, NULL);
+
+    result->seconds[i] = seconds;
+    result->mean += seconds / repeat;
+
+    if (i == 0 || seconds < result->best) {
+      result->best = seconds;
+    }
+  }
+
+  free(image);
+}
+
+// Instructions per second over the best run
+static double rate(const Result *result) {
+  return result->best > 0 ? result->instructions / result->best : 0;
+}
+
+static bool writeJson(const char *path, const Result *results, int count,
+                      bool jitting, int warmup, int repeat) {
+  FILE *out = fopen(path, "w");
+
+  if (!out) {
+    return false;
+  }
+
+  fprintf(out,
+          "{\n  \"build\": \"%s\",\n  \"jit\": %s,\n  \"warmup\": %d,\n"
+          "  \"repeat\": %d,\n  \"programs\": [\n",
+          BUILD_TYPE, jitting ? "true" : "false", warmup, repeat);
+
+  for (int i = 0; i < count; i++) {
+    const Result *result = &results[i];
+
+    fprintf(out,
+            "    {\"name\": \"%s\", \"instructions\": %llu, \"best\": %.9f, "
+            "\"mean\": %.9f, \"ips\": %.0f, \"seconds\": [",
+            result->name, (unsigned long long)result->instructions,
+            result->best, result->mean, rate(result));
+
+    for (int j = 0; j < repeat; j++) {
+      fprintf(out, "%s%.9f", j ? ", " : "", result->seconds[j]);
+    }
+
+    fprintf(out, "]}%s\n", i + 1 < count ? "," : "");
+  }
+
+  fprintf(out, "  ]\n}\n");
+  fclose(out);
+  return true;
+}
+
+static void usage(void) {
+  printf("Usage: vm_bench [options] [program...]\n"
+         "  program              Only run these, out of alu, branch, calls, "
+         "copy, block and print\n"
+         "  --jit                Compile hot code to native code\n"
+         "  --warmup=N           Untimed runs before timing, 1 by default\n"
+         "  --repeat=N           Timed runs per program, 5 by default\n"
+         "  --json=PATH          Write the results to PATH as JSON\n");
+}
+
+// Returns the value of a '--name=value' argument, or NULL if arg is not name
+static char *option(char *arg, const char *name) {
+  int len = strlen(name);
+
+  if (strncmp(arg, name, len) != 0) {
+    return NULL;
+  }
+
+  if (arg[len] == '=') {
+    return arg + len + 1;
+  }
+
+  return arg[len] == '\0' ? "" : NULL;
+}
+
+static int number(const char *str, const char *name) {
+  char *end;
+  long n = strtol(str, &end, 0);
+
+  if (*str == '\0' || *end != '\0' || n < 0) {
+    printf("Expected number for '%s'.\n", name);
+    exit(-1);
+  }
+
+  return n;
+}
+
+static const Program *findProgram(const char *name) {
+  for (size_t i = 0; i < CORPUS_SIZE; i++) {
+    if (strcmp(corpus[i].name, name) == 0) {
+      return &corpus[i];
+    }
+  }
+
+  return NULL;
+}
+
+int main(int count, char **args) {
+  bool jitting = false;
+  int warmup = 1;
+  int repeat = 5;
+  char *json = NULL;
+
+  const Program *selected[CORPUS_SIZE];
+  int programs = 0;
+
+  for (int i = 1; i < count; i++) {
+    char *arg = args[i];
+    char *val;
+
+    if (arg[0] != '-') {
+      const Program *program = findProgram(arg);
+
+      if (!program) {
+        printf("Unknown program '%s'.\n", arg);
+        usage();
+        exit(-1);
+      }
+
+      if (programs == CORPUS_SIZE) {
+        printf("Too many args.\n");
+        exit(-1);
+      }
+      selected[programs++] = program;
+    } else if ((val = option(arg, "--jit"))) {
+      jitting = true;
+    } else if ((val = option(arg, "--warmup"))) {
+      warmup = number(val, "--warmup");
+    } else if ((val = option(arg, "--repeat"))) {
+      repeat = number(val, "--repeat");
+    } else if ((val = option(arg, "--json"))) {
+      json = val;
+    } else {
+      usage();
+      exit(-1);
+    }
+  }
+
+  if (repeat == 0) {
+    printf("Expected at least one run for '--repeat'.\n");
+    exit(-1);
+  }
+
+  if (!programs) {
+    for (size_t i = 0; i < CORPUS_SIZE; i++) {
+      selected[programs++] = &corpus[i];
+    }
+  }
+
+  Jit jit;
+  Jit *jitPtr = NULL;
+
+  if (jitting) {
+    if (initJit(&jit)) {
+      jitPtr = &jit;
+    } else {
+      printf("JIT unavailable on this host, interpreting.\n");
+      jitting = false;
+    }
+  }
+
+  // Printed output is part of the work measured, not of the report
+  FILE *output = fopen("/dev/null", "w");
+
+  if (!output) {
+    printf("Cannot open file '/dev/null'.\n");
+    exit(-1);
+  }
+
+  Result results[CORPUS_SIZE];
+
+  printf("%s build, %s, %d warmup, %d timed runs\n\n", BUILD_TYPE,
+         jitting ? "jit" : "interpreted", warmup, repeat);
+  printf("%-8s %14s %12s %12s %10s\n", "program", "instructions", "best ms",
+         "mean ms", "MIPS");
+
+  for (int i = 0; i < programs; i++) {
+    Result *result = &results[i];
+
+    runProgram(selected[i], result, jitPtr, output, warmup, repeat);
+    printf("%-8s %14llu %12.3f %12.3f %10.1f\n", result->name,
+           (unsigned long long)result->instructions, result->best * 1e3,
+           result->mean * 1e3, rate(result) / 1e6);
+  }
+
+  fclose(output);
+
+  if (jitPtr) {
+    freeJit(jitPtr);
+  }
+
+  if (json && !writeJson(json, results, programs, jitting, warmup, repeat)) {
+    printf("Cannot open file '%s'.\n", json);
+    exit(-1);
+  }
+
+  for (int i = 0; i < programs; i++) {
+    free(results[i].seconds);
+  }
+
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include "cost.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <strings.h>
+
+#include "decode.h"
+
+void initCostModel(CostModel *costs) {
+  for (int op = 0; op < 256; op++) {
+    costs->ops[op] = DEFAULT_OP_CYCLES;
+  }
+
+  costs->memory = DEFAULT_MEMORY_CYCLES;
+  costs->branch = DEFAULT_BRANCH_CYCLES;
+  costs->syscall = DEFAULT_SYSCALL_CYCLES;
+}
+
+// Points at the cost name is given by, NULL if it names nothing
+static uint32_t *costNamed(CostModel *costs, const char *name) {
+  if (strcasecmp(name, "memory") == 0) {
+    return &costs->memory;
+  }
+
+  if (strcasecmp(name, "branch") == 0) {
+    return &costs->branch;
+  }
+
+  if (strcasecmp(name, "syscall") == 0) {
+    return &costs->syscall;
+  }
+
+  for (int op = 0; op < 256; op++) {
+    const char *mnemonic = opInfo(op)->name;
+
+    // Fused records are charged per instruction, so only real opcodes
+    if (op < UOP_BAD_REGISTER && mnemonic && strcasecmp(mnemonic, name) == 0) {
+      return &costs->ops[op];
+    }
+  }
+
+  return NULL;
+}
+
+bool loadCostModel(CostModel *costs, const char *path) {
+  FILE *fptr = fopen(path, "r");
+
+  if (!fptr) {
+    printf("Cannot open file '%s'.\n", path);
+    return false;
+  }
+
+  char line[128];
+  int number = 0;
+
+  while (fgets(line, sizeof(line), fptr)) {
+    char name[32];
+    unsigned cycles;
+    char *start = line;
+    number++;
+
+    while (isspace((unsigned char)*start)) {
+      start++;
+    }
+
+    if (*start == '\0' || *start == '#') {
+      continue;
+    }
+
+    uint32_t *cost = NULL;
+
+    if (sscanf(start, "%31s %u", name, &cycles) != 2 ||
+        !(cost = costNamed(costs, name))) {
+      printf("[%s:%d] Expected a mnemonic, memory, branch or syscall and a "
+             "cycle count.\n",
+             path, number);
+      fclose(fptr);
+      return false;
+    }
+
+    *cost = cycles;
+  }
+
+  fclose(fptr);
+  return true;
+}
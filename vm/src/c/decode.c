@@ -0,0 +1,391 @@
+#include "decode.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+static const OpInfo OpTable[256] = {
+    [OP_ADD] = {"ADD", FORMAT_RV},    [OP_SUB] = {"SUB", FORMAT_RV},
+    [OP_LD] = {"LD", FORMAT_RA},      [OP_MV] = {"MV", FORMAT_RR},
+    [OP_JMP] = {"JMP", FORMAT_A},     [OP_ADDR] = {"ADDR", FORMAT_RR},
+    [OP_SUBR] = {"SUBR", FORMAT_RR},  [OP_XOR] = {"XOR", FORMAT_RR},
+    [OP_AND] = {"AND", FORMAT_RR},    [OP_OR] = {"OR", FORMAT_RR},
+    [OP_NAND] = {"NAND", FORMAT_RR},  [OP_NOT] = {"NOT", FORMAT_R},
+    [OP_SHFT] = {"SHFT", FORMAT_RR},  [OP_ST] = {"ST", FORMAT_RA},
+    [OP_RET] = {"RET", FORMAT_NONE},  [OP_CMP] = {"CMP", FORMAT_VV},
+    [OP_JE] = {"JE", FORMAT_A},       [OP_JNE] = {"JNE", FORMAT_A},
+    [OP_JG] = {"JG", FORMAT_A},       [OP_JL] = {"JL", FORMAT_A},
+    [OP_PUSH] = {"PUSH", FORMAT_V},   [OP_POP] = {"POP", FORMAT_V},
+    [OP_CALL] = {"CALL", FORMAT_NONE}, [OP_HALT] = {"HALT", FORMAT_NONE},
+    [OP_COPY] = {"COPY", FORMAT_AAW},  [OP_FILL] = {"FILL", FORMAT_RAW},
+    [OP_LDR] = {"LDR", FORMAT_RP},     [OP_STR] = {"STR", FORMAT_RP},
+    [OP_LDX] = {"LDX", FORMAT_RRA},    [OP_STX] = {"STX", FORMAT_RRA},
+    [OP_BR] = {"BR", FORMAT_A},        [OP_BRE] = {"BRE", FORMAT_A},
+    [OP_BRNE] = {"BRNE", FORMAT_A},    [OP_BRG] = {"BRG", FORMAT_A},
+    [OP_BRL] = {"BRL", FORMAT_A},      [OP_BRS] = {"BRS", FORMAT_A},
+    [OP_BRES] = {"BRES", FORMAT_A},    [OP_BRNES] = {"BRNES", FORMAT_A},
+    [OP_BRGS] = {"BRGS", FORMAT_A},    [OP_BRLS] = {"BRLS", FORMAT_A},
+    [OP_JSR] = {"JSR", FORMAT_A},
+    [OP_XCHG] = {"XCHG", FORMAT_RA},   [OP_XADD] = {"XADD", FORMAT_RA},
+    [OP_CAS] = {"CAS", FORMAT_RRA},    [OP_FENCE] = {"FENCE", FORMAT_NONE},
+    [UOP_STORE_IMM] = {"ADD+ST+SUBR", FORMAT_RA},
+    [UOP_CMP_JUMP] = {"CMP+JCC", FORMAT_A},
+    [UOP_TEST_JUMP] = {"MV+JCC", FORMAT_A},
+    [UOP_TEST_BRANCH] = {"MV+BRCC", FORMAT_A},
+};
+
+static const char *RegisterNames[16] = {
+    [R_SR] = "SR",   [R_SP] = "SP",   [R_PC] = "PC",   [R_SC] = "SC",
+    [R_G0] = "G0",   [R_G1] = "G1",   [R_G2] = "G2",   [R_G3] = "G3",
+    [R_G4] = "G4",   [R_G5] = "G5",   [R_G6] = "G6",   [R_G7] = "G7",
+    [R_G8] = "G8",   [R_G9] = "G9",   [R_G10] = "G10",
+};
+
+const OpInfo *opInfo(uint8_t op) { return &OpTable[op]; }
+
+const char *registerName(uint8_t code) {
+  if (code >= 16 || !RegisterNames[code]) {
+    return "?";
+  }
+
+  return RegisterNames[code];
+}
+
+void initDecodeCache(DecodeCache *cache) {
+  memset(cache->pages, 0, sizeof(cache->pages));
+}
+
+void freeDecodeCache(DecodeCache *cache) {
+  for (int i = 0; i < DECODE_PAGES; i++) {
+    free(cache->pages[i]);
+    cache->pages[i] = NULL;
+  }
+}
+
+// Returns whether the register code names a register an instruction may use.
+// The program counter is not in the register file, and G10 is rejected as it
+// always has been.
+static bool validRegister(uint8_t code) {
+  return code == R_SR || code == R_SP || (code >= R_SC && code < R_G10);
+}
+
+static uint8_t byteAt(VM *vm, uint16_t address) {
+  return readByte(vm, address);
+}
+
+static uint16_t addressAt(VM *vm, uint16_t address) {
+  return byteAt(vm, address) + (byteAt(vm, address + 1) << 8);
+}
+
+// Checks a register operand, turning the whole record into a deferred fault
+// if the register is invalid so the error is still raised on execution
+static bool resolve(MicroOp *uop, uint8_t code, uint8_t *reg) {
+  if (!validRegister(code)) {
+    uop->op = UOP_BAD_REGISTER;
+    uop->a = code;
+    return false;
+  }
+
+  *reg = code;
+  return true;
+}
+
+// Checks the register holding the low byte of a pair whose high byte is in
+// the register after it, as with the syscalls' G5:G4
+static bool resolvePair(MicroOp *uop, uint8_t code, uint8_t *reg) {
+  uint8_t high;
+
+  return resolve(uop, code, reg) && resolve(uop, code + 1, &high);
+}
+
+static bool isConditionalJump(uint8_t op) {
+  return op == OP_JE || op == OP_JNE || op == OP_JG || op == OP_JL;
+}
+
+// The conditional jump testing the same condition as a conditional branch, 0
+// for anything else
+static uint8_t branchCondition(uint8_t op) {
+  switch (op) {
+  case OP_BRE:
+  case OP_BRES:
+    return OP_JE;
+  case OP_BRNE:
+  case OP_BRNES:
+    return OP_JNE;
+  case OP_BRG:
+  case OP_BRGS:
+    return OP_JG;
+  case OP_BRL:
+  case OP_BRLS:
+    return OP_JL;
+  default:
+    return 0;
+  }
+}
+
+// Widens the decoded instruction at pc into a fused record if it starts one
+// of the recognized sequences. Each fused record has exactly the effect of
+// running its instructions one after the other.
+static void fuse(VM *vm, MicroOp *uop, uint16_t pc) {
+  uint16_t next = pc + uop->len;
+
+  switch (uop->op) {
+  case OP_ADD: {
+    uint8_t code = byteAt(vm, pc + 1);
+    uint16_t address = addressAt(vm, pc + 5);
+
+    if (byteAt(vm, pc + 3) != OP_ST || byteAt(vm, pc + 4) != code ||
+        byteAt(vm, pc + 7) != OP_SUBR || byteAt(vm, pc + 8) != code ||
+        byteAt(vm, pc + 9) != code) {
+      return;
+    }
+
+    // A store into the sequence itself changes what runs after it
+    if ((uint16_t)(address - pc) < 10) {
+      return;
+    }
+
+    uop->op = UOP_STORE_IMM;
+    uop->len = 10;
+    uop->count = 3;
+    uop->address = address;
+    break;
+  }
+  case OP_CMP: {
+    uint8_t jump = byteAt(vm, next);
+
+    if (!isConditionalJump(jump)) {
+      return;
+    }
+
+    uint8_t status = uop->b > uop->a ? 2 : uop->b == uop->a ? 1 : 0;
+
+    uop->op = UOP_CMP_JUMP;
+    uop->len += 3;
+    uop->count = 2;
+    uop->a = status;
+    uop->b = branchTaken(jump, status);
+    uop->address = addressAt(vm, next + 1);
+    break;
+  }
+  case OP_MV: {
+    uint8_t jump = byteAt(vm, next);
+
+    if (uop->b != R_SR) {
+      return;
+    }
+
+    if (isConditionalJump(jump)) {
+      uop->op = UOP_TEST_JUMP;
+      uop->len += 3;
+      uop->count = 2;
+      uop->b = jump;
+      uop->address = addressAt(vm, next + 1);
+    } else if (branchCondition(jump)) {
+      MicroOp branch;
+
+      decodeSingle(vm, next, &branch);
+      uop->op = UOP_TEST_BRANCH;
+      uop->len += branch.len;
+      uop->count = 2;
+      uop->b = branch.b;
+      uop->address = branch.address;
+    }
+    break;
+  }
+  }
+}
+
+bool fallsThrough(uint8_t op) {
+  switch (op) {
+  case OP_BR:
+  case OP_BRS:
+  case OP_RET:
+  case OP_HALT:
+  case UOP_BAD_REGISTER:
+  case UOP_UNKNOWN:
+    return false;
+  default:
+    return true;
+  }
+}
+
+bool jumps(uint8_t op) {
+  switch (op) {
+  case OP_JMP:
+  case OP_JSR:
+  case OP_JE:
+  case OP_JNE:
+  case OP_JG:
+  case OP_JL:
+  case OP_BR:
+  case OP_BRS:
+  case OP_BRE:
+  case OP_BRNE:
+  case OP_BRG:
+  case OP_BRL:
+  case OP_BRES:
+  case OP_BRNES:
+  case OP_BRGS:
+  case OP_BRLS:
+    return true;
+  default:
+    return false;
+  }
+}
+
+void decodeSingle(VM *vm, uint16_t pc, MicroOp *uop) {
+  uint8_t op = byteAt(vm, pc);
+
+  *uop = (MicroOp){op, 1, 1, 0, 0, 0, 0, 0, 0};
+
+  switch (op) {
+  case OP_ADD:
+  case OP_SUB:
+    uop->len = 3;
+    uop->b = byteAt(vm, pc + 2);
+    resolve(uop, byteAt(vm, pc + 1), &uop->a);
+    break;
+  case OP_LD:
+  case OP_ST:
+  case OP_XCHG:
+  case OP_XADD:
+    uop->len = 4;
+    uop->address = addressAt(vm, pc + 2);
+    resolve(uop, byteAt(vm, pc + 1), &uop->a);
+    break;
+  case OP_MV:
+  case OP_ADDR:
+  case OP_SUBR:
+  case OP_XOR:
+  case OP_AND:
+  case OP_OR:
+  case OP_NAND:
+  case OP_SHFT:
+    uop->len = 3;
+    if (resolve(uop, byteAt(vm, pc + 1), &uop->a)) {
+      resolve(uop, byteAt(vm, pc + 2), &uop->b);
+    }
+    break;
+  case OP_NOT:
+    uop->len = 2;
+    resolve(uop, byteAt(vm, pc + 1), &uop->a);
+    break;
+  case OP_JMP:
+  case OP_JE:
+  case OP_JNE:
+  case OP_JG:
+  case OP_JL:
+    uop->len = 3;
+    uop->address = addressAt(vm, pc + 1);
+    break;
+  case OP_CMP:
+    uop->len = 3;
+    uop->a = byteAt(vm, pc + 1);
+    uop->b = byteAt(vm, pc + 2);
+    break;
+  case OP_PUSH:
+  case OP_POP:
+    uop->len = 2;
+    uop->a = byteAt(vm, pc + 1);
+    break;
+  case OP_COPY:
+    uop->len = 7;
+    uop->address = addressAt(vm, pc + 1);
+    uop->source = addressAt(vm, pc + 3);
+    uop->size = addressAt(vm, pc + 5);
+    break;
+  case OP_FILL:
+    uop->len = 6;
+    uop->address = addressAt(vm, pc + 2);
+    uop->size = addressAt(vm, pc + 4);
+    resolve(uop, byteAt(vm, pc + 1), &uop->a);
+    break;
+  case OP_LDR:
+  case OP_STR:
+    uop->len = 3;
+    if (resolve(uop, byteAt(vm, pc + 1), &uop->a)) {
+      resolvePair(uop, byteAt(vm, pc + 2), &uop->b);
+    }
+    break;
+  case OP_LDX:
+  case OP_STX:
+  case OP_CAS:
+    uop->len = 5;
+    uop->address = addressAt(vm, pc + 3);
+    if (resolve(uop, byteAt(vm, pc + 1), &uop->a)) {
+      resolve(uop, byteAt(vm, pc + 2), &uop->b);
+    }
+    break;
+  case OP_BR:
+  case OP_BRE:
+  case OP_BRNE:
+  case OP_BRG:
+  case OP_BRL:
+  case OP_JSR:
+    uop->len = 3;
+    uop->b = branchCondition(op);
+    uop->address = addressAt(vm, pc + 1);
+    break;
+  case OP_BRS:
+  case OP_BRES:
+  case OP_BRNES:
+  case OP_BRGS:
+  case OP_BRLS:
+    uop->len = 2;
+    uop->b = branchCondition(op);
+    uop->address = pc + 2 + (int8_t)byteAt(vm, pc + 1);
+    break;
+  case OP_RET:
+  case OP_CALL:
+  case OP_HALT:
+  case OP_FENCE:
+    break;
+  default:
+    uop->op = UOP_UNKNOWN;
+    uop->a = op;
+    break;
+  }
+}
+
+MicroOp *decode(VM *vm, uint16_t pc) {
+  MicroOp **page = &vm->_decode.pages[pc >> 8];
+
+  if (!*page) {
+    *page = calloc(DECODE_PAGE_SIZE, sizeof(MicroOp));
+  }
+
+  MicroOp *uop = &(*page)[pc & 0xFF];
+
+  decodeSingle(vm, pc, uop);
+
+  // The trace and the profile see every instruction on its own
+  if (!vm->_trace && !vm->_profile) {
+    fuse(vm, uop, pc);
+  }
+
+  return uop;
+}
+
+void invalidateDecode(DecodeCache *cache, uint16_t address, int len) {
+  // Records starting up to MAX_RECORD_LEN - 1 bytes before the write can
+  // still cover it
+  uint16_t start = address - (MAX_RECORD_LEN - 1);
+  int count = len + MAX_RECORD_LEN - 1;
+
+  for (int i = 0; i < count;) {
+    uint16_t pc = start + i;
+    MicroOp *page = cache->pages[pc >> 8];
+
+    if (!page) {
+      // Nothing decoded here, skip to the next page
+      i += DECODE_PAGE_SIZE - (pc & 0xFF);
+      continue;
+    }
+
+    page[pc & 0xFF].op = 0;
+    page[pc & 0xFF].verifiedOp = 0;
+    i++;
+  }
+}
@@ -0,0 +1,122 @@
+#include "files.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static HostFile *fileAt(FileTable *table, uint8_t handle) {
+  return &table->files[handle - 1];
+}
+
+// Passes pending writes to the file, returns false if it could not take them
+static bool flushFile(HostFile *file) {
+  size_t done = 0;
+
+  while (done < file->buffered) {
+    ssize_t n = write(file->fd, file->buffer + done, file->buffered - done);
+
+    if (n <= 0) {
+      break;
+    }
+
+    done += n;
+  }
+
+  bool flushed = done == file->buffered;
+
+  file->buffered = 0;
+  return flushed;
+}
+
+void initFiles(FileTable *table) {
+  for (int i = 0; i < FILE_HANDLES; i++) {
+    table->files[i] = (HostFile){-1, NULL, 0};
+  }
+}
+
+uint8_t openHandle(FileTable *table, const char *name, enum FileMode mode) {
+  for (int i = 0; i < FILE_HANDLES; i++) {
+    HostFile *file = &table->files[i];
+
+    if (file->fd >= 0) {
+      continue;
+    }
+
+    int flags = mode == FILE_READ    ? O_RDONLY
+                : mode == FILE_WRITE ? O_WRONLY | O_CREAT | O_TRUNC
+                                     : O_WRONLY | O_CREAT | O_APPEND;
+
+    if ((file->fd = open(name, flags, 0644)) < 0) {
+      return 0;
+    }
+
+    file->buffered = 0;
+    return i + 1;
+  }
+
+  return 0;
+}
+
+bool validHandle(const FileTable *table, uint8_t handle) {
+  return handle >= 1 && handle <= FILE_HANDLES &&
+         table->files[handle - 1].fd >= 0;
+}
+
+size_t readHandle(FileTable *table, uint8_t handle, void *buf, size_t len) {
+  HostFile *file = fileAt(table, handle);
+
+  flushFile(file);
+
+  ssize_t n = read(file->fd, buf, len);
+  return n > 0 ? n : 0;
+}
+
+bool writeHandle(FileTable *table, uint8_t handle, const void *buf,
+                 size_t len) {
+  HostFile *file = fileAt(table, handle);
+  bool flushed = true;
+
+  if (!file->buffer) {
+    file->buffer = malloc(FILE_BUFFER_SIZE);
+  }
+
+  if (file->buffered + len > FILE_BUFFER_SIZE) {
+    flushed = flushFile(file);
+  }
+
+  // Too large to be worth collecting
+  if (len > FILE_BUFFER_SIZE) {
+    return flushed && write(file->fd, buf, len) == (ssize_t)len;
+  }
+
+  memcpy(file->buffer + file->buffered, buf, len);
+  file->buffered += len;
+  return flushed;
+}
+
+int64_t seekHandle(FileTable *table, uint8_t handle, int64_t offset,
+                   int whence) {
+  HostFile *file = fileAt(table, handle);
+
+  flushFile(file);
+  return lseek(file->fd, offset, whence);
+}
+
+void closeHandle(FileTable *table, uint8_t handle) {
+  HostFile *file = fileAt(table, handle);
+
+  flushFile(file);
+  close(file->fd);
+  free(file->buffer);
+
+  *file = (HostFile){-1, NULL, 0};
+}
+
+void freeFiles(FileTable *table) {
+  for (int i = 0; i < FILE_HANDLES; i++) {
+    if (table->files[i].fd >= 0) {
+      closeHandle(table, i + 1);
+    }
+  }
+}
@@ -0,0 +1,406 @@
+// Translates a GISC image into a C translation unit that runs it natively.
+// Every instruction reachable from address 0 the translation can run itself
+// gets a label, statically known jumps become gotos and returns go through a
+// switch over the labels. Anything else is left to the interpreter linked in
+// with the runtime, see aot.h.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode.h"
+#include "image.h"
+#include "vm.h"
+
+struct Translator {
+  // Holds the image for the decoder
+  VM vm;
+
+  MicroOp *ops;
+  // Instructions reachable from address 0, and those translated
+  bool *reached;
+  bool *native;
+  uint8_t covered[MEMORY_SIZE / 8];
+
+  int reachedCount;
+  int nativeCount;
+  bool returns;
+
+  FILE *out;
+};
+
+typedef struct Translator Translator;
+
+static bool isNative(const MicroOp *u, uint16_t pc) {
+  // The stack page is written by every push, keeping it out of the
+  // translation means pushes never make it stale
+  if (pc >> 8 == 0xF0 || (uint16_t)(pc + u->len - 1) >> 8 == 0xF0) {
+    return false;
+  }
+
+  switch (u->op) {
+  case OP_ADD:
+  case OP_SUB:
+  case OP_LD:
+  case OP_MV:
+  case OP_ADDR:
+  case OP_SUBR:
+  case OP_XOR:
+  case OP_AND:
+  case OP_OR:
+  case OP_NAND:
+  case OP_NOT:
+  case OP_SHFT:
+  case OP_ST:
+  case OP_CMP:
+  case OP_PUSH:
+  case OP_LDR:
+  case OP_STR:
+  case OP_LDX:
+  case OP_STX:
+  case OP_JMP:
+  case OP_JSR:
+  case OP_JE:
+  case OP_JNE:
+  case OP_JG:
+  case OP_JL:
+  case OP_BR:
+  case OP_BRS:
+  case OP_BRE:
+  case OP_BRNE:
+  case OP_BRG:
+  case OP_BRL:
+  case OP_BRES:
+  case OP_BRNES:
+  case OP_BRGS:
+  case OP_BRLS:
+  case OP_RET:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void explore(Translator *t) {
+  uint16_t *pending = malloc(MEMORY_SIZE * sizeof(uint16_t));
+  int count = 0;
+
+  pending[count++] = 0;
+  t->reached[0] = true;
+
+  while (count > 0) {
+    uint16_t pc = pending[--count];
+    MicroOp *u = &t->ops[pc];
+
+    decodeSingle(&t->vm, pc, u);
+    t->reachedCount++;
+
+    if (isNative(u, pc)) {
+      t->native[pc] = true;
+      t->nativeCount++;
+      t->returns |= u->op == OP_RET;
+
+      for (int i = 0; i < u->len; i++) {
+        uint16_t at = pc + i;
+        t->covered[at >> 3] |= 1 << (at & 7);
+      }
+    }
+
+    uint16_t next[2];
+    int targets = 0;
+
+    if (fallsThrough(u->op)) {
+      next[targets++] = pc + u->len;
+    }
+    if (jumps(u->op)) {
+      next[targets++] = u->address;
+    }
+
+    for (int i = 0; i < targets; i++) {
+      if (!t->reached[next[i]]) {
+        t->reached[next[i]] = true;
+        pending[count++] = next[i];
+      }
+    }
+  }
+
+  free(pending);
+}
+
+// Leaves translated code with the program counter at pc, nested depth
+// blocks deep
+static void emitExit(Translator *t, uint16_t pc, int depth) {
+  fprintf(t->out, "%*svm->_programCounter = 0x%04X;\n%*sreturn;\n",
+          2 * depth, "", pc, 2 * depth, "");
+}
+
+static void emitJump(Translator *t, uint16_t target, int depth) {
+  if (t->native[target]) {
+    fprintf(t->out, "%*sgoto L_%04X;\n", 2 * depth, "", target);
+  } else {
+    emitExit(t, target, depth);
+  }
+}
+
+// Pushes the return address, or leaves the jump to the interpreter when the
+// stack is too full
+static void emitLink(Translator *t, uint16_t pc, uint16_t next, int depth) {
+  fprintf(t->out, "%*sif (!aotLink(vm, 0x%04X)) {\n", 2 * depth, "", next);
+  emitExit(t, pc, depth + 1);
+  fprintf(t->out, "%*s}\n", 2 * depth, "");
+}
+
+static void emitStore(Translator *t, const char *address, uint8_t slot,
+                      uint16_t next) {
+  fprintf(t->out,
+          "  if (!aotWrite(vm, %s, AOT_REG(%d))) {\n"
+          "    vm->_programCounter = 0x%04X;\n"
+          "    return;\n"
+          "  }\n",
+          address, slot, next);
+}
+
+static void emitInstruction(Translator *t, uint16_t pc) {
+  const MicroOp *u = &t->ops[pc];
+  uint16_t next = pc + u->len;
+  FILE *out = t->out;
+  char address[64];
+
+  fprintf(out, "L_%04X: // %s\n", pc, opInfo(u->op)->name);
+
+  switch (u->op) {
+  case OP_ADD:
+    fprintf(out, "  AOT_REG(%d) += %d;\n", u->a, u->b);
+    break;
+  case OP_SUB:
+    fprintf(out, "  AOT_REG(%d) -= %d;\n", u->a, u->b);
+    break;
+  case OP_LD:
+    fprintf(out, "  AOT_REG(%d) = readByte(vm, 0x%04X);\n", u->a, u->address);
+    break;
+  case OP_MV:
+    fprintf(out, "  AOT_REG(%d) = AOT_REG(%d);\n", u->b, u->a);
+    break;
+  case OP_ADDR:
+    fprintf(out, "  AOT_REG(%d) += AOT_REG(%d);\n", u->a, u->b);
+    break;
+  case OP_SUBR:
+    fprintf(out, "  AOT_REG(%d) -= AOT_REG(%d);\n", u->a, u->b);
+    break;
+  case OP_XOR:
+    fprintf(out, "  AOT_REG(%d) ^= AOT_REG(%d);\n", u->a, u->b);
+    break;
+  case OP_AND:
+    fprintf(out, "  AOT_REG(%d) &= AOT_REG(%d);\n", u->a, u->b);
+    break;
+  case OP_OR:
+    fprintf(out, "  AOT_REG(%d) |= AOT_REG(%d);\n", u->a, u->b);
+    break;
+  case OP_NAND:
+    fprintf(out, "  AOT_REG(%d) = ~(AOT_REG(%d) & AOT_REG(%d));\n", u->a,
+            u->a, u->b);
+    break;
+  case OP_NOT:
+    fprintf(out, "  AOT_REG(%d) = ~AOT_REG(%d);\n", u->a, u->a);
+    break;
+  case OP_SHFT:
+    fprintf(out, "  AOT_REG(%d) <<= (int)AOT_REG(%d) - 8;\n", u->a, u->b);
+    break;
+  case OP_ST:
+    sprintf(address, "0x%04X", u->address);
+    emitStore(t, address, u->a, next);
+    break;
+  case OP_CMP:
+    // Only looks at its operand bytes, the status is known here
+    fprintf(out, "  vm->_registers[R_SR] = %d;\n",
+            u->b > u->a ? 2 : u->b == u->a ? 1 : 0);
+    break;
+  case OP_PUSH:
+    fprintf(out,
+            "  if (!aotPush(vm, %d)) {\n"
+            "    vm->_programCounter = 0x%04X;\n"
+            "    return;\n"
+            "  }\n",
+            u->a, pc);
+    break;
+  case OP_LDR:
+    fprintf(out,
+            "  AOT_REG(%d) = readByte(vm, (AOT_REG(%d) << 8) | AOT_REG(%d));\n",
+            u->a, u->b + 1, u->b);
+    break;
+  case OP_STR:
+    sprintf(address, "(AOT_REG(%d) << 8) | AOT_REG(%d)", u->b + 1, u->b);
+    emitStore(t, address, u->a, next);
+    break;
+  case OP_LDX:
+    fprintf(out, "  AOT_REG(%d) = readByte(vm, 0x%04X + AOT_REG(%d));\n",
+            u->a, u->address, u->b);
+    break;
+  case OP_STX:
+    sprintf(address, "0x%04X + AOT_REG(%d)", u->address, u->b);
+    emitStore(t, address, u->a, next);
+    break;
+  case OP_JMP:
+  case OP_JSR:
+    emitLink(t, pc, next, 1);
+    emitJump(t, u->address, 1);
+    return;
+  case OP_JE:
+  case OP_JNE:
+  case OP_JG:
+  case OP_JL:
+    fprintf(out, "  if (branchTaken(%d, vm->_registers[R_SR])) {\n", u->op);
+    emitLink(t, pc, next, 2);
+    emitJump(t, u->address, 2);
+    fprintf(out, "  }\n");
+    break;
+  case OP_BR:
+  case OP_BRS:
+    emitJump(t, u->address, 1);
+    return;
+  case OP_BRE:
+  case OP_BRNE:
+  case OP_BRG:
+  case OP_BRL:
+  case OP_BRES:
+  case OP_BRNES:
+  case OP_BRGS:
+  case OP_BRLS:
+    fprintf(out, "  if (branchTaken(%d, vm->_registers[R_SR])) {\n", u->b);
+    emitJump(t, u->address, 2);
+    fprintf(out, "  }\n");
+    break;
+  case OP_RET:
+    fprintf(out,
+            "  if (!aotReturn(vm)) {\n"
+            "    vm->_programCounter = 0x%04X;\n"
+            "    return;\n"
+            "  }\n"
+            "  goto dispatch;\n",
+            pc);
+    return;
+  }
+
+  // Straight into the next label when it follows
+  int follows = pc + u->len;
+
+  if (follows > 0xFFFF || !t->native[next]) {
+    emitExit(t, next, 1);
+    return;
+  }
+
+  for (int at = pc + 1; at < follows; at++) {
+    if (t->native[at]) {
+      emitJump(t, next, 1);
+      return;
+    }
+  }
+}
+
+static void emitBytes(Translator *t, const char *name, const uint8_t *bytes,
+                      int len) {
+  fprintf(t->out, "static const uint8_t %s[%d] = {\n", name, len);
+
+  for (int i = 0; i < len; i++) {
+    if (bytes[i]) {
+      fprintf(t->out, "    [0x%04X] = 0x%02X,\n", i, bytes[i]);
+    }
+  }
+
+  fprintf(t->out, "};\n\n");
+}
+
+static void translate(Translator *t, const Image *image, const char *filename) {
+  FILE *out = t->out;
+
+  fprintf(out,
+          "// Translated from %s by gisc2c, link with the gisc_vm library\n\n"
+          "#include \"aot.h\"\n\n",
+          filename);
+
+  emitBytes(t, "image", image->bytes, MEMORY_SIZE);
+  emitBytes(t, "covered", t->covered, MEMORY_SIZE / 8);
+
+  fprintf(out, "static void translated(VM *vm) {\n");
+
+  if (t->returns) {
+    fprintf(out, "dispatch:\n");
+  }
+
+  fprintf(out, "  switch (vm->_programCounter) {\n");
+  for (int pc = 0; pc < MEMORY_SIZE; pc++) {
+    if (t->native[pc]) {
+      fprintf(out, "  case 0x%04X:\n    goto L_%04X;\n", pc, pc);
+    }
+  }
+  fprintf(out, "  default:\n    return;\n  }\n\n");
+
+  for (int pc = 0; pc < MEMORY_SIZE; pc++) {
+    if (t->native[pc]) {
+      emitInstruction(t, pc);
+    }
+  }
+
+  fprintf(out,
+          "}\n\n"
+          "static Translation translation = {image, covered, translated, "
+          "false};\n\n"
+          "int main(void) { return runTranslation(&translation); }\n");
+}
+
+int main(int count, char **args) {
+  Image image;
+  Translator t;
+
+  if (count < 2 || count > 3) {
+    printf("Usage: gisc2c file [out.c]\n"
+           "  file                 Image of at most 64 KB, '-' reads it from "
+           "stdin\n"
+           "  out.c                C file to write, stdout by default\n");
+    exit(-1);
+  }
+
+  switch (loadImage(&image, args[1])) {
+  case IMAGE_UNREADABLE:
+    printf("Cannot open file '%s'.\n", args[1]);
+    exit(-1);
+  case IMAGE_TOO_LARGE:
+    printf("Image must be at most 64 KB.\n");
+    exit(-1);
+  default:
+    break;
+  }
+
+  if (!(t.out = count == 3 ? fopen(args[2], "w") : stdout)) {
+    printf("Cannot open file '%s'.\n", args[2]);
+    exit(-1);
+  }
+
+  initCpu(&t.vm, image.bytes);
+  t.ops = malloc(MEMORY_SIZE * sizeof(MicroOp));
+  t.reached = calloc(MEMORY_SIZE, sizeof(bool));
+  t.native = calloc(MEMORY_SIZE, sizeof(bool));
+  memset(t.covered, 0, sizeof(t.covered));
+  t.reachedCount = 0;
+  t.nativeCount = 0;
+  t.returns = false;
+
+  explore(&t);
+  translate(&t, &image, args[1]);
+
+  fprintf(stderr, "Translated %d of %d reachable instructions.\n",
+          t.nativeCount, t.reachedCount);
+
+  if (t.out != stdout) {
+    fclose(t.out);
+  }
+
+  free(t.ops);
+  free(t.reached);
+  free(t.native);
+  freeCpu(&t.vm);
+  freeImage(&image);
+  return 0;
+}
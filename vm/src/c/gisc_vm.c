@@ -0,0 +1,142 @@
+#include "gisc_vm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+struct gisc_vm {
+  VM vm;
+  // The VM shares the pages of its image, so the copy lives alongside it
+  uint8_t image[MEMORY_SIZE];
+};
+
+gisc_vm *gisc_vm_create(const uint8_t *image, size_t len) {
+  if (len > MEMORY_SIZE) {
+    return NULL;
+  }
+
+  gisc_vm *vm = malloc(sizeof(gisc_vm));
+
+  if (!vm) {
+    return NULL;
+  }
+
+  memcpy(vm->image, image, len);
+  memset(vm->image + len, 0, MEMORY_SIZE - len);
+
+  initCpu(&vm->vm, vm->image);
+  return vm;
+}
+
+void gisc_vm_destroy(gisc_vm *vm) {
+  if (!vm) {
+    return;
+  }
+
+  freeCpu(&vm->vm);
+  free(vm);
+}
+
+void gisc_vm_set_io(gisc_vm *vm, FILE *input, FILE *output) {
+  vm->vm._input = input;
+  vm->vm._output = output;
+}
+
+static gisc_status toStatus(enum VMStatus state) {
+  switch (state) {
+  case STATUS_BREAK:
+    return GISC_BREAKPOINT;
+  case STATUS_HALTED:
+    return GISC_HALTED;
+  case STATUS_FAULTED:
+    return GISC_FAULTED;
+  default:
+    return GISC_PAUSED;
+  }
+}
+
+// Runs with the given budget and breakpoint, which never reaches NO_BUDGET
+// so the instructions executed can always be counted
+static gisc_status runFor(gisc_vm *vm, uint64_t budget, int32_t breakpoint,
+                          uint64_t *executed) {
+  VM *cpu = &vm->vm;
+
+  if (executed) {
+    *executed = 0;
+  }
+
+  if (cpu->_state == STATUS_HALTED || cpu->_state == STATUS_FAULTED) {
+    return toStatus(cpu->_state);
+  }
+
+  cpu->_breakpoint = breakpoint;
+
+  enum VMStatus state = run(cpu, budget);
+
+  if (executed) {
+    *executed = budget - cpu->_budget;
+  }
+
+  cpu->_breakpoint = NO_BREAKPOINT;
+  return toStatus(state);
+}
+
+gisc_status gisc_vm_step(gisc_vm *vm, uint64_t count, uint64_t *executed) {
+  if (count == NO_BUDGET) {
+    count--;
+  }
+
+  return runFor(vm, count, NO_BREAKPOINT, executed);
+}
+
+gisc_status gisc_vm_run_until(gisc_vm *vm, uint16_t address, uint64_t limit,
+                              uint64_t *executed) {
+  if (limit == 0 || limit == NO_BUDGET) {
+    limit = NO_BUDGET - 1;
+  }
+
+  return runFor(vm, limit, address, executed);
+}
+
+gisc_status gisc_vm_run(gisc_vm *vm) {
+  if (vm->vm._state == STATUS_HALTED || vm->vm._state == STATUS_FAULTED) {
+    return toStatus(vm->vm._state);
+  }
+
+  return toStatus(run(&vm->vm, NO_BUDGET));
+}
+
+gisc_fault gisc_vm_fault(const gisc_vm *vm) {
+  const VM *cpu = &vm->vm;
+  bool ended = cpu->_state == STATUS_HALTED || cpu->_state == STATUS_FAULTED;
+
+  // gisc_fault_kind lists the faults in the same order as enum Fault
+  return (gisc_fault){(gisc_fault_kind)cpu->_fault, cpu->_faultPc,
+                      cpu->_faultValue, ended ? cpu->_message : ""};
+}
+
+uint16_t gisc_vm_pc(const gisc_vm *vm) { return vm->vm._programCounter; }
+
+int gisc_vm_register(const gisc_vm *vm, uint8_t code) {
+  const VM *cpu = &vm->vm;
+
+  if (code == R_PC) {
+    return cpu->_programCounter;
+  }
+
+  if (code < R_SR || code >= R_G10) {
+    return -1;
+  }
+
+  return cpu->_registers[code];
+}
+
+void gisc_vm_read(const gisc_vm *vm, uint16_t address, void *buf,
+                  size_t len) {
+  uint8_t *bytes = buf;
+
+  for (size_t i = 0; i < len; i++) {
+    bytes[i] = readByte(&vm->vm, address + i);
+  }
+}
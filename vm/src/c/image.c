@@ -0,0 +1,102 @@
+#include "image.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vm.h"
+
+// Maps the regular file fd over the start of memory. Bytes past its end up to
+// the page boundary read as zero, as do the anonymous pages after it.
+static bool mapFile(uint8_t *memory, int fd, size_t len) {
+  if (len == 0) {
+    return true;
+  }
+
+  return mmap(memory, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) !=
+         MAP_FAILED;
+}
+
+// Reads a pipe or terminal into memory, which takes at most MEMORY_SIZE
+// bytes. Returns -1 on a read error and MEMORY_SIZE + 1 if there is more.
+static ssize_t readStream(uint8_t *memory, int fd) {
+  size_t len = 0;
+
+  while (len < MEMORY_SIZE) {
+    ssize_t n = read(fd, memory + len, MEMORY_SIZE - len);
+
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      return len;
+    }
+
+    len += n;
+  }
+
+  uint8_t extra;
+  return read(fd, &extra, 1) > 0 ? MEMORY_SIZE + 1 : MEMORY_SIZE;
+}
+
+enum ImageStatus loadImage(Image *image, const char *path) {
+  bool console = strcmp(path, "-") == 0;
+  int fd = console ? STDIN_FILENO : open(path, O_RDONLY);
+
+  if (fd < 0) {
+    return IMAGE_UNREADABLE;
+  }
+
+  // Zero pages cost nothing until read, the file is laid over the start
+  uint8_t *memory = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  enum ImageStatus status = IMAGE_LOADED;
+  struct stat st;
+
+  if (memory == MAP_FAILED) {
+    memory = NULL;
+    status = IMAGE_UNREADABLE;
+  } else if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    image->len = st.st_size;
+
+    if (st.st_size > MEMORY_SIZE) {
+      status = IMAGE_TOO_LARGE;
+    } else if (!mapFile(memory, fd, image->len)) {
+      status = IMAGE_UNREADABLE;
+    }
+  } else {
+    ssize_t len = readStream(memory, fd);
+
+    image->len = len;
+    status = len < 0              ? IMAGE_UNREADABLE
+             : len > MEMORY_SIZE ? IMAGE_TOO_LARGE
+                                  : IMAGE_LOADED;
+  }
+
+  if (!console) {
+    close(fd);
+  }
+
+  if (status != IMAGE_LOADED && memory) {
+    munmap(memory, MEMORY_SIZE);
+    memory = NULL;
+  }
+
+  // VMs copy a page before writing it, so the image itself never changes
+  if (memory) {
+    mprotect(memory, MEMORY_SIZE, PROT_READ);
+  }
+
+  image->bytes = memory;
+  return status;
+}
+
+void freeImage(Image *image) {
+  if (image->bytes) {
+    munmap((void *)image->bytes, MEMORY_SIZE);
+    image->bytes = NULL;
+  }
+}
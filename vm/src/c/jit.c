@@ -0,0 +1,942 @@
+#include "jit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+// Compiled blocks run with the guest registers below held in host registers.
+// rbx points at the VM, r13 at the guest page holding the stack and r12 at
+// the JitPage table; rax and rcx are scratch. Other guest pages are reached
+// through the VM's page table, and native code only stores to pages the VM
+// already owns, so page pointers cannot change under a running block. The
+// remaining guest registers stay in the VM struct and are addressed through
+// rbx.
+//
+// Blocks are entered through the enter stub, which loads the mapped registers,
+// and left through the exit stub, which writes them back. Jumps between blocks
+// go straight from one block to the next with the registers still live. copy
+// and fill run in C through the call stub, which writes the registers back
+// around the call.
+//
+// Each block starts by checking the VM's budget covers every instruction it
+// could run and leaves to the interpreter if not, so the budget never goes
+// below zero. The instructions actually run are taken off on the way out.
+// Blocks compiled for a machine core check its _interrupt flag as well.
+
+enum {
+  RAX,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15
+};
+
+static const struct {
+  uint8_t code;
+  uint8_t reg;
+} Mapped[] = {
+    {R_SR, RDX}, {R_SP, RSI}, {R_G0, RDI}, {R_G1, R8},  {R_G2, R9},
+    {R_G3, R10}, {R_G4, R11}, {R_G5, RBP}, {R_G6, R14}, {R_G7, R15},
+};
+
+#define MAPPED_COUNT (int)(sizeof(Mapped) / sizeof(Mapped[0]))
+
+// Worst case bytes emitted for one guest instruction, a block is only started
+// when there is room for JIT_MAX_BLOCK of them
+#define MAX_INSTRUCTION_BYTES 192
+
+// x86 opcodes used by the code generator
+#define X_ADD_RM_R 0x00
+#define X_OR_RM_R 0x08
+#define X_AND_RM_R 0x20
+#define X_AND_R_RM 0x22
+#define X_SUB_RM_R 0x28
+#define X_XOR_RM_R 0x30
+#define X_GRP1_RM_IMM8 0x80
+#define X_GRP1_RM_IMM32 0x81
+#define X_GRP1_RM_SIMM8 0x83
+#define X_MOV_RM_R 0x88
+#define X_MOV_R_RM 0x8A
+#define X_MOV_R_RM64 0x8B
+#define X_MOV_RM_IMM 0xC6
+#define X_MOV_RM_IMM32 0xC7
+#define X_GRP3_RM 0xF6
+#define X_MOVZX 0x0FB6
+
+#define X_JAE_SHORT 0x73
+#define X_JE_SHORT 0x74
+#define X_JNE_SHORT 0x75
+#define X_JBE_SHORT 0x76
+#define X_JE_NEAR 0x0F84
+#define X_JNE_NEAR 0x0F85
+#define X_JMP_NEAR 0xE9
+#define X_CALL_NEAR 0xE8
+
+enum LocKind { LOC_REG, LOC_VM, LOC_MEM, LOC_STACK };
+
+// An x86 operand, a register or one of the memory forms the JIT uses
+struct Loc {
+  enum LocKind kind;
+  int reg;
+  int32_t disp;
+};
+
+typedef struct Loc Loc;
+
+static Loc hostReg(int reg) { return (Loc){LOC_REG, reg, 0}; }
+
+// [rbx + offset], a field of the VM
+static Loc vmAt(int32_t offset) { return (Loc){LOC_VM, RBX, offset}; }
+
+// [rcx + offset], a byte of the guest page loaded by emitLoadPage
+static Loc pageAt(uint16_t address) {
+  return (Loc){LOC_MEM, RCX, address & 0xFF};
+}
+
+// [r13 + rcx + offset], the stack page indexed by the stack pointer in rcx
+static Loc stackAt(int32_t offset) { return (Loc){LOC_STACK, R13, offset}; }
+
+// The VM's copy of a guest register
+static Loc registerAt(uint8_t code) {
+  return vmAt(offsetof(VM, _registers) + code);
+}
+
+static Loc guestLoc(uint8_t code) {
+  for (int i = 0; i < MAPPED_COUNT; i++) {
+    if (Mapped[i].code == code) {
+      return hostReg(Mapped[i].reg);
+    }
+  }
+
+  return registerAt(code);
+}
+
+static void emit8(Jit *jit, uint8_t b) { jit->code[jit->used++] = b; }
+
+static void emit16(Jit *jit, uint16_t v) {
+  memcpy(jit->code + jit->used, &v, 2);
+  jit->used += 2;
+}
+
+static void emit32(Jit *jit, uint32_t v) {
+  memcpy(jit->code + jit->used, &v, 4);
+  jit->used += 4;
+}
+
+static void emitBytes(Jit *jit, const uint8_t *bytes, int len) {
+  memcpy(jit->code + jit->used, bytes, len);
+  jit->used += len;
+}
+
+// Emits opcode with a ModRM operand. A REX prefix is always written so the
+// byte registers spl..dil and r8b..r15b can be named.
+static void emitInsn(Jit *jit, bool wide, int opcode, int reg, Loc rm) {
+  int index = rm.kind == LOC_STACK ? RCX : 0;
+
+  emit8(jit, 0x40 | (wide << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) |
+                 (rm.reg >> 3));
+
+  if (opcode > 0xFF) {
+    emit8(jit, opcode >> 8);
+  }
+  emit8(jit, opcode & 0xFF);
+
+  switch (rm.kind) {
+  case LOC_REG:
+    emit8(jit, 0xC0 | ((reg & 7) << 3) | (rm.reg & 7));
+    break;
+  case LOC_STACK:
+    emit8(jit, 0x80 | ((reg & 7) << 3) | 4);
+    emit8(jit, ((index & 7) << 3) | (rm.reg & 7));
+    emit32(jit, rm.disp);
+    break;
+  default:
+    emit8(jit, 0x80 | ((reg & 7) << 3) | (rm.reg & 7));
+    emit32(jit, rm.disp);
+    break;
+  }
+}
+
+static void patchRel32(Jit *jit, uint32_t site, const uint8_t *target) {
+  int32_t rel = target - (jit->code + site + 4);
+  memcpy(jit->code + site, &rel, 4);
+}
+
+// Emits a near jump, jcc or call with a zero displacement and returns where
+// the displacement lives
+static uint32_t emitJump(Jit *jit, int opcode) {
+  if (opcode > 0xFF) {
+    emit8(jit, opcode >> 8);
+  }
+  emit8(jit, opcode & 0xFF);
+
+  uint32_t site = jit->used;
+  emit32(jit, 0);
+  return site;
+}
+
+static void emitSetPc(Jit *jit, uint16_t pc) {
+  emit8(jit, 0x66);
+  emitInsn(jit, false, X_MOV_RM_IMM32, 0, vmAt(offsetof(VM, _programCounter)));
+  emit16(jit, pc);
+}
+
+// Takes count instructions off the budget
+static void emitCharge(Jit *jit, uint32_t count) {
+  if (count > 0) {
+    emitInsn(jit, true, X_GRP1_RM_IMM32, 5, vmAt(offsetof(VM, _budget)));
+    emit32(jit, count);
+  }
+}
+
+// Leaves compiled code so the interpreter resumes at pc, which has not run
+static void emitExit(Jit *jit, uint16_t pc) {
+  emitSetPc(jit, pc);
+  emitCharge(jit, jit->done);
+  patchRel32(jit, emitJump(jit, X_JMP_NEAR), jit->exit);
+}
+
+// Leaves compiled code at pc unless the flags satisfy the short jcc given
+static void emitExitUnless(Jit *jit, uint8_t jcc, uint16_t pc) {
+  emit8(jit, jcc);
+  uint32_t at = jit->used;
+  emit8(jit, 0);
+
+  emitExit(jit, pc);
+  jit->code[at] = jit->used - at - 1;
+}
+
+// Leaves compiled code at next, the instruction after the one being emitted,
+// if the call that instruction made flushed the JIT. The block itself may
+// have been overwritten then.
+static void emitFlushCheck(Jit *jit, uint16_t next) {
+  emitBytes(jit, (uint8_t[]){0x84, 0xC0}, 2); // test al, al
+  emit8(jit, X_JNE_SHORT);
+  uint32_t at = jit->used;
+  emit8(jit, 0);
+
+  emitSetPc(jit, next);
+  emitCharge(jit, jit->done + jit->current);
+  patchRel32(jit, emitJump(jit, X_JMP_NEAR), jit->exit);
+  jit->code[at] = jit->used - at - 1;
+}
+
+// Leaves compiled code at pc if a record has been decoded in the page holding
+// address, where a native store would leave it stale
+static void emitCodeCheck(Jit *jit, uint16_t address, uint16_t pc) {
+  uint8_t first = (uint16_t)(address - MAX_RECORD_LEN + 1) >> 8;
+  uint8_t last = address >> 8;
+
+  for (int page = first;; page = (page + 1) & 0xFF) {
+    emitInsn(jit, true, X_GRP1_RM_SIMM8, 7,
+             vmAt(offsetof(VM, _decode.pages) + page * sizeof(MicroOp *)));
+    emit8(jit, 0);
+    emitExitUnless(jit, X_JE_SHORT, pc);
+
+    if (page == last) {
+      break;
+    }
+  }
+}
+
+// Loads the pointer to the guest page holding address into rcx
+static void emitLoadPage(Jit *jit, uint16_t address) {
+  emitInsn(jit, true, X_MOV_R_RM64, RCX,
+           vmAt(offsetof(VM, _pages) + (address >> 8) * sizeof(uint8_t *)));
+}
+
+// Leaves compiled code at pc unless the VM owns the page holding address. The
+// interpreter copies the page on its write, after which this check passes.
+static void emitOwnedCheck(Jit *jit, uint16_t address, uint16_t pc) {
+  emitInsn(jit, false, X_GRP1_RM_IMM8, 7,
+           vmAt(offsetof(VM, _owned) + (address >> 8)));
+  emit8(jit, 0);
+  emitExitUnless(jit, X_JNE_SHORT, pc);
+}
+
+// Checks and loads the page for a native store to address
+static void emitStorePage(Jit *jit, uint16_t address, uint16_t pc) {
+  emitCodeCheck(jit, address, pc);
+  emitOwnedCheck(jit, address, pc);
+  emitLoadPage(jit, address);
+}
+
+static void *blockAt(Jit *jit, uint16_t pc) {
+  JitPage *page = jit->pages[pc >> 8];
+
+  return page ? page->entry[pc & 0xFF] : NULL;
+}
+
+// Continues at a statically known guest address, jumping straight into its
+// block or leaving through the exit stub until that block is compiled
+static void emitChain(Jit *jit, uint16_t target) {
+  emitSetPc(jit, target);
+  emitCharge(jit, jit->done + jit->current);
+
+  uint32_t site = emitJump(jit, X_JMP_NEAR);
+  uint8_t *block = blockAt(jit, target);
+
+  if (block) {
+    patchRel32(jit, site, block);
+    return;
+  }
+
+  patchRel32(jit, site, jit->exit);
+
+  if (jit->pendingCount < JIT_MAX_PENDING) {
+    jit->pending[jit->pendingCount++] = (JitPending){site, target};
+  }
+}
+
+// Uses a register operand as the source of an x86 instruction, loading it
+// into al first when the guest register lives in memory
+static int sourceReg(Jit *jit, uint8_t code) {
+  Loc loc = guestLoc(code);
+
+  if (loc.kind == LOC_REG) {
+    return loc.reg;
+  }
+
+  emitInsn(jit, false, X_MOV_R_RM, RAX, loc);
+  return RAX;
+}
+
+// Pushes the return address the way OP_JMP and the conditional jumps do.
+// Anything the interpreter would fault on, or a push into decoded code, is
+// left to the interpreter by exiting at the jump itself.
+static void emitPushLink(Jit *jit, uint16_t pc, uint16_t next) {
+  Loc sp = guestLoc(R_SP);
+
+  emitInsn(jit, false, X_GRP1_RM_IMM8, 7, sp);
+  emit8(jit, 253);
+  emitExitUnless(jit, X_JBE_SHORT, pc);
+
+  emitCodeCheck(jit, 0xF000, pc);
+  emitOwnedCheck(jit, 0xF000, pc);
+
+  emitInsn(jit, false, X_MOVZX, RCX, sp);
+  emitInsn(jit, false, X_MOV_RM_IMM, 0, stackAt(0));
+  emit8(jit, next);
+  emitInsn(jit, false, X_MOV_RM_IMM, 0, stackAt(1));
+  emit8(jit, next >> 8);
+
+  emitInsn(jit, false, X_GRP1_RM_IMM8, 0, sp);
+  emit8(jit, 2);
+}
+
+static void emitReturn(Jit *jit, uint16_t pc) {
+  Loc sp = guestLoc(R_SP);
+
+  emitInsn(jit, false, X_GRP1_RM_IMM8, 7, sp);
+  emit8(jit, 2);
+  emitExitUnless(jit, X_JAE_SHORT, pc);
+
+  // eax = hi << 8 | lo, then look the target up through the dynamic stub
+  emitInsn(jit, false, X_MOVZX, RCX, sp);
+  emitInsn(jit, false, X_MOVZX, RAX, stackAt(-1));
+  emitBytes(jit, (uint8_t[]){0xC1, 0xE0, 0x08}, 3);
+  emitInsn(jit, false, X_MOV_R_RM, RAX, stackAt(-2));
+
+  emitInsn(jit, false, X_GRP1_RM_IMM8, 5, sp);
+  emit8(jit, 2);
+
+  emitCharge(jit, jit->done + jit->current);
+  patchRel32(jit, emitJump(jit, X_JMP_NEAR), jit->dynamic);
+}
+
+// Conditional jump op to target, where pc is the record holding it and next
+// the address after it. The taken path pushes the return address if link is
+// set, as the OP_J* jumps do.
+static void emitBranch(Jit *jit, uint8_t op, uint16_t target, uint16_t pc,
+                       uint16_t next, bool link) {
+  Loc sr = guestLoc(R_SR);
+
+  // Status register value the branch is taken on, or not taken for OP_JNE
+  uint8_t value = op == OP_JG ? 0 : op == OP_JL ? 2 : 1;
+
+  emitInsn(jit, false, X_GRP1_RM_IMM8, 7, sr);
+  emit8(jit, value);
+
+  uint32_t skip = emitJump(jit, op == OP_JNE ? X_JE_NEAR : X_JNE_NEAR);
+
+  if (link) {
+    emitPushLink(jit, pc, next);
+  }
+  emitChain(jit, target);
+
+  patchRel32(jit, skip, jit->code + jit->used);
+  emitChain(jit, next);
+}
+
+// The C side of copy and fill, called through the call stub with operands
+// packed as address | size << 16 | source or register << 32. Each returns
+// false if its write flushed the JIT.
+static bool callCopy(VM *vm, uint64_t operands) {
+  copyMemory(vm, operands & 0xFFFF, operands >> 32, (operands >> 16) & 0xFFFF);
+  return vm->_jit->anyCovered;
+}
+
+static bool callFill(VM *vm, uint64_t operands) {
+  fillMemory(vm, operands & 0xFFFF, vm->_registers[operands >> 32],
+             (operands >> 16) & 0xFFFF);
+  return vm->_jit->anyCovered;
+}
+
+// Calls fn with the operands given through the call stub
+static void emitCall(Jit *jit, bool (*fn)(VM *, uint64_t), uint64_t operands) {
+  uint64_t address = (uintptr_t)fn;
+
+  emitBytes(jit, (uint8_t[]){0x48, 0xB8}, 2); // mov rax, fn
+  emit32(jit, address);
+  emit32(jit, address >> 32);
+  emitBytes(jit, (uint8_t[]){0x48, 0xB9}, 2); // mov rcx, operands
+  emit32(jit, operands);
+  emit32(jit, operands >> 32);
+  patchRel32(jit, emitJump(jit, X_CALL_NEAR), jit->call);
+}
+
+// Translates the instruction, returning false if the block ends with it
+static bool compileInstruction(Jit *jit, const MicroOp *u, uint16_t pc) {
+  switch (u->op) {
+  case OP_ADD:
+  case OP_SUB:
+    emitInsn(jit, false, X_GRP1_RM_IMM8, u->op == OP_ADD ? 0 : 5,
+             guestLoc(u->a));
+    emit8(jit, u->b);
+    return true;
+  case OP_LD: {
+    Loc dest = guestLoc(u->a);
+
+    emitLoadPage(jit, u->address);
+
+    if (dest.kind == LOC_REG) {
+      emitInsn(jit, false, X_MOV_R_RM, dest.reg, pageAt(u->address));
+    } else {
+      emitInsn(jit, false, X_MOV_R_RM, RAX, pageAt(u->address));
+      emitInsn(jit, false, X_MOV_RM_R, RAX, dest);
+    }
+    return true;
+  }
+  case OP_ST:
+    emitStorePage(jit, u->address, pc);
+    emitInsn(jit, false, X_MOV_RM_R, sourceReg(jit, u->a), pageAt(u->address));
+    return true;
+  case OP_MV:
+    emitInsn(jit, false, X_MOV_RM_R, sourceReg(jit, u->a), guestLoc(u->b));
+    return true;
+  case OP_ADDR:
+  case OP_SUBR:
+  case OP_XOR:
+  case OP_AND:
+  case OP_OR: {
+    int opcode = u->op == OP_ADDR  ? X_ADD_RM_R
+                 : u->op == OP_SUBR ? X_SUB_RM_R
+                 : u->op == OP_XOR  ? X_XOR_RM_R
+                 : u->op == OP_AND  ? X_AND_RM_R
+                                    : X_OR_RM_R;
+
+    emitInsn(jit, false, opcode, sourceReg(jit, u->b), guestLoc(u->a));
+    return true;
+  }
+  case OP_NAND:
+    emitInsn(jit, false, X_MOV_R_RM, RAX, guestLoc(u->b));
+    emitInsn(jit, false, X_AND_R_RM, RAX, guestLoc(u->a));
+    emitInsn(jit, false, X_GRP3_RM, 2, hostReg(RAX));
+    emitInsn(jit, false, X_MOV_RM_R, RAX, guestLoc(u->a));
+    return true;
+  case OP_NOT:
+    emitInsn(jit, false, X_GRP3_RM, 2, guestLoc(u->a));
+    return true;
+  case OP_CMP: {
+    // Compares the operand bytes themselves, so the result is a constant
+    uint8_t status = u->b > u->a ? 2 : u->b == u->a ? 1 : 0;
+
+    emitInsn(jit, false, X_MOV_RM_IMM, 0,
+             guestLoc(R_SR));
+    emit8(jit, status);
+    return true;
+  }
+  case OP_JMP:
+  case OP_JSR:
+    emitPushLink(jit, pc, pc + u->len);
+    emitChain(jit, u->address);
+    return false;
+  case OP_JE:
+  case OP_JNE:
+  case OP_JG:
+  case OP_JL:
+    emitBranch(jit, u->op, u->address, pc, pc + u->len, true);
+    return false;
+  case OP_BR:
+  case OP_BRS:
+    emitChain(jit, u->address);
+    return false;
+  case OP_BRE:
+  case OP_BRNE:
+  case OP_BRG:
+  case OP_BRL:
+  case OP_BRES:
+  case OP_BRNES:
+  case OP_BRGS:
+  case OP_BRLS:
+    emitBranch(jit, u->b, u->address, pc, pc + u->len, false);
+    return false;
+  case OP_RET:
+    emitReturn(jit, pc);
+    return false;
+  case OP_COPY:
+  case OP_FILL: {
+    uint64_t from = u->op == OP_COPY ? u->source : u->a;
+
+    emitCall(jit, u->op == OP_COPY ? callCopy : callFill,
+             from << 32 | (uint64_t)u->size << 16 | u->address);
+    emitFlushCheck(jit, pc + u->len);
+    return true;
+  }
+  case UOP_STORE_IMM: {
+    Loc reg = guestLoc(u->a);
+
+    emitStorePage(jit, u->address, pc);
+    emitInsn(jit, false, X_MOV_R_RM, RAX, reg);
+    emitInsn(jit, false, X_GRP1_RM_IMM8, 0, hostReg(RAX));
+    emit8(jit, u->b);
+    emitInsn(jit, false, X_MOV_RM_R, RAX, pageAt(u->address));
+    emitInsn(jit, false, X_MOV_RM_IMM, 0, reg);
+    emit8(jit, 0);
+    return true;
+  }
+  case UOP_CMP_JUMP:
+    // Setting the status register again is harmless if the push exits back
+    // to this record
+    emitInsn(jit, false, X_MOV_RM_IMM, 0,
+             guestLoc(R_SR));
+    emit8(jit, u->a);
+
+    if (!u->b) {
+      return true;
+    }
+
+    emitPushLink(jit, pc, pc + u->len);
+    emitChain(jit, u->address);
+    return false;
+  case UOP_TEST_JUMP:
+  case UOP_TEST_BRANCH:
+    emitInsn(jit, false, X_MOV_RM_R, sourceReg(jit, u->a),
+             guestLoc(R_SR));
+    emitBranch(jit, u->b, u->address, pc, pc + u->len,
+               u->op == UOP_TEST_JUMP);
+    return false;
+  default:
+    // Left to the interpreter
+    emitExit(jit, pc);
+    return false;
+  }
+}
+
+static bool supported(uint8_t op) {
+  switch (op) {
+  case OP_ADD:
+  case OP_SUB:
+  case OP_LD:
+  case OP_ST:
+  case OP_MV:
+  case OP_ADDR:
+  case OP_SUBR:
+  case OP_XOR:
+  case OP_AND:
+  case OP_OR:
+  case OP_NAND:
+  case OP_NOT:
+  case OP_CMP:
+  case OP_JMP:
+  case OP_JE:
+  case OP_JNE:
+  case OP_JG:
+  case OP_JL:
+  case OP_RET:
+  case OP_BR:
+  case OP_BRE:
+  case OP_BRNE:
+  case OP_BRG:
+  case OP_BRL:
+  case OP_BRS:
+  case OP_BRES:
+  case OP_BRNES:
+  case OP_BRGS:
+  case OP_BRLS:
+  case OP_JSR:
+  case OP_COPY:
+  case OP_FILL:
+  case UOP_STORE_IMM:
+  case UOP_CMP_JUMP:
+  case UOP_TEST_JUMP:
+  case UOP_TEST_BRANCH:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void emitStubs(Jit *jit) {
+  // enter(vm, block, stackPage, pages)
+  jit->enter = jit->code + jit->used;
+  emitBytes(jit,
+            (uint8_t[]){
+                0x53,             // push rbx
+                0x55,             // push rbp
+                0x41, 0x54,       // push r12
+                0x41, 0x55,       // push r13
+                0x41, 0x56,       // push r14
+                0x41, 0x57,       // push r15
+                0x48, 0x89, 0xFB, // mov rbx, rdi
+                0x49, 0x89, 0xD5, // mov r13, rdx
+                0x49, 0x89, 0xCC, // mov r12, rcx
+                0x48, 0x89, 0xF0, // mov rax, rsi
+            },
+            22);
+  for (int i = 0; i < MAPPED_COUNT; i++) {
+    emitInsn(jit, false, X_MOV_R_RM, Mapped[i].reg,
+             registerAt(Mapped[i].code));
+  }
+  emitBytes(jit, (uint8_t[]){0xFF, 0xE0}, 2); // jmp rax
+
+  jit->exit = jit->code + jit->used;
+  for (int i = 0; i < MAPPED_COUNT; i++) {
+    emitInsn(jit, false, X_MOV_RM_R, Mapped[i].reg,
+             registerAt(Mapped[i].code));
+  }
+  emitBytes(jit,
+            (uint8_t[]){
+                0x41, 0x5F, // pop r15
+                0x41, 0x5E, // pop r14
+                0x41, 0x5D, // pop r13
+                0x41, 0x5C, // pop r12
+                0x5D,       // pop rbp
+                0x5B,       // pop rbx
+                0xC3,       // ret
+            },
+            11);
+
+  // Jumps to the block for the guest address in ax, or exits when there is
+  // none yet
+  jit->dynamic = jit->code + jit->used;
+  emit8(jit, 0x66);
+  emitInsn(jit, false, X_MOV_RM_R + 1, RAX, vmAt(offsetof(VM, _programCounter)));
+  emitBytes(jit,
+            (uint8_t[]){
+                0x89, 0xC1,             // mov ecx, eax
+                0xC1, 0xE9, 0x08,       // shr ecx, 8
+                0x49, 0x8B, 0x0C, 0xCC, // mov rcx, [r12 + rcx * 8]
+                0x48, 0x85, 0xC9,       // test rcx, rcx
+            },
+            12);
+  patchRel32(jit, emitJump(jit, X_JE_NEAR), jit->exit);
+  emitBytes(jit,
+            (uint8_t[]){
+                0x0F, 0xB6, 0xC0,       // movzx eax, al
+                0x48, 0x8B, 0x04, 0xC1, // mov rax, [rcx + rax * 8]
+                0x48, 0x85, 0xC0,       // test rax, rax
+            },
+            10);
+  patchRel32(jit, emitJump(jit, X_JE_NEAR), jit->exit);
+  emitBytes(jit, (uint8_t[]){0xFF, 0xE0}, 2); // jmp rax
+
+  // Calls the C function in rax with the VM and the operands in rcx. The
+  // function may copy the stack page on a write to it, so r13 is reloaded.
+  // Blocks run with rsp 8 off a 16 byte boundary, which the return address
+  // pushed by the call realigns.
+  jit->call = jit->code + jit->used;
+  for (int i = 0; i < MAPPED_COUNT; i++) {
+    emitInsn(jit, false, X_MOV_RM_R, Mapped[i].reg,
+             registerAt(Mapped[i].code));
+  }
+  emitBytes(jit,
+            (uint8_t[]){
+                0x48, 0x89, 0xDF, // mov rdi, rbx
+                0x48, 0x89, 0xCE, // mov rsi, rcx
+                0xFF, 0xD0,       // call rax
+            },
+            8);
+  for (int i = 0; i < MAPPED_COUNT; i++) {
+    emitInsn(jit, false, X_MOV_R_RM, Mapped[i].reg,
+             registerAt(Mapped[i].code));
+  }
+  emitInsn(jit, true, X_MOV_R_RM64, R13,
+           vmAt(offsetof(VM, _pages) + 0xF0 * sizeof(uint8_t *)));
+  emit8(jit, 0xC3); // ret
+
+  jit->stubsEnd = jit->used;
+}
+
+static void flushJit(Jit *jit) {
+  for (int i = 0; i < 256; i++) {
+    if (jit->pages[i]) {
+      memset(jit->pages[i], 0, sizeof(JitPage));
+    }
+  }
+
+  memset(jit->covered, 0, sizeof(jit->covered));
+  jit->anyCovered = false;
+
+  jit->pendingCount = 0;
+  jit->used = jit->stubsEnd;
+}
+
+static void cover(Jit *jit, uint16_t pc, int len) {
+  for (int i = 0; i < len; i++) {
+    uint16_t address = pc + i;
+    jit->covered[address >> 8][(address & 0xFF) >> 3] |= 1 << (address & 7);
+  }
+
+  jit->anyCovered = true;
+}
+
+static const MicroOp *decoded(VM *vm, uint16_t pc) {
+  MicroOp *page = vm->_decode.pages[pc >> 8];
+
+  if (page && page[pc & 0xFF].op) {
+    return &page[pc & 0xFF];
+  }
+
+  return decode(vm, pc);
+}
+
+// Returns whether compiled code leaves the block after the record, for
+// somewhere that may be compiled too
+static bool endsBlock(const MicroOp *u) {
+  switch (u->op) {
+  case OP_RET:
+  case UOP_TEST_JUMP:
+  case UOP_TEST_BRANCH:
+    return true;
+  case UOP_CMP_JUMP:
+    return u->b;
+  default:
+    return jumps(u->op);
+  }
+}
+
+// Returns whether a block starting at start would be left for the interpreter
+// within JIT_MIN_BLOCK instructions
+static bool exitsEarly(VM *vm, uint16_t start) {
+  uint16_t pc = start;
+
+  for (int count = 0; count < JIT_MIN_BLOCK;) {
+    const MicroOp *u = decoded(vm, pc);
+
+    if (!supported(u->op)) {
+      return true;
+    }
+
+    if (endsBlock(u)) {
+      return false;
+    }
+
+    count += u->count;
+    pc += u->len;
+  }
+
+  return false;
+}
+
+// Compiles the block starting at start, returning NULL if it would run too
+// few instructions before leaving for the interpreter to be worth entering
+static void *compileBlock(VM *vm, uint16_t start) {
+  Jit *jit = vm->_jit;
+
+  if (exitsEarly(vm, start)) {
+    return NULL;
+  }
+
+  if (jit->used + JIT_MAX_BLOCK * MAX_INSTRUCTION_BYTES > JIT_CODE_SIZE) {
+    flushJit(jit);
+  }
+
+  uint8_t *block = jit->code + jit->used;
+  uint16_t pc = start;
+
+  jit->done = 0;
+  jit->current = 0;
+
+  // cmp qword [rbx + _budget], most, patched once the block is compiled
+  emitInsn(jit, true, X_GRP1_RM_IMM32, 7, vmAt(offsetof(VM, _budget)));
+  uint32_t most = jit->used;
+  emit32(jit, 0);
+  emitExitUnless(jit, X_JAE_SHORT, start);
+
+  // A machine core's blocks also leave once the machine stops the core, the
+  // interpreter pausing at its next branch
+  if (vm->_machine) {
+    emitInsn(jit, false, X_GRP1_RM_IMM8, 7, vmAt(offsetof(VM, _interrupt)));
+    emit8(jit, 0);
+    emitExitUnless(jit, X_JE_SHORT, start);
+  }
+
+  for (int i = 0;; i++) {
+    const MicroOp *u = decoded(vm, pc);
+
+    if (i == JIT_MAX_BLOCK) {
+      emitChain(jit, pc);
+      break;
+    }
+
+    if (!supported(u->op)) {
+      emitExit(jit, pc);
+      break;
+    }
+
+    cover(jit, pc, u->len);
+    jit->current = u->count;
+
+    if (!compileInstruction(jit, u, pc)) {
+      break;
+    }
+
+    jit->done += u->count;
+    jit->current = 0;
+    pc += u->len;
+  }
+
+  // Exits further along charge more, the last one the most
+  uint32_t charge = jit->done + jit->current;
+  memcpy(jit->code + most, &charge, 4);
+
+  JitPage **page = &jit->pages[start >> 8];
+
+  if (!*page) {
+    *page = calloc(1, sizeof(JitPage));
+  }
+  (*page)->entry[start & 0xFF] = block;
+
+  // Blocks compiled earlier that exit to this one now jump straight in
+  for (int i = 0; i < jit->pendingCount;) {
+    if (jit->pending[i].target == start) {
+      patchRel32(jit, jit->pending[i].site, block);
+      jit->pending[i] = jit->pending[--jit->pendingCount];
+    } else {
+      i++;
+    }
+  }
+
+  return block;
+}
+
+typedef void (*EnterFn)(VM *vm, void *block, uint8_t *stackPage,
+                        JitPage **pages);
+
+bool initJit(Jit *jit) {
+  jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (jit->code == MAP_FAILED) {
+    jit->code = NULL;
+    return false;
+  }
+
+  jit->used = 0;
+  memset(jit->pages, 0, sizeof(jit->pages));
+  memset(jit->covered, 0, sizeof(jit->covered));
+  jit->anyCovered = false;
+  jit->pendingCount = 0;
+
+  emitStubs(jit);
+  return true;
+}
+
+void resetJit(Jit *jit) { flushJit(jit); }
+
+void freeJit(Jit *jit) {
+  if (jit->code) {
+    munmap(jit->code, JIT_CODE_SIZE);
+  }
+
+  for (int i = 0; i < 256; i++) {
+    free(jit->pages[i]);
+  }
+}
+
+void jitBranch(VM *vm) {
+  Jit *jit = vm->_jit;
+  uint16_t pc = vm->_programCounter;
+  JitPage *page = jit->pages[pc >> 8];
+
+  if (!page) {
+    page = jit->pages[pc >> 8] = calloc(1, sizeof(JitPage));
+  }
+
+  void *block = page->entry[pc & 0xFF];
+
+  if (!block) {
+    uint16_t *counter = &page->counter[pc & 0xFF];
+
+    // UINT16_MAX marks a target not worth compiling
+    if (*counter == UINT16_MAX || ++*counter < JIT_THRESHOLD) {
+      return;
+    }
+
+    if (!(block = compileBlock(vm, pc))) {
+      *counter = UINT16_MAX;
+      return;
+    }
+  }
+
+  ((EnterFn)jit->enter)(vm, block, vm->_pages[0xF0], jit->pages);
+}
+
+void jitInvalidate(Jit *jit, uint16_t address, int len) {
+  if (!jit->anyCovered) {
+    return;
+  }
+
+  for (int i = 0; i < len;) {
+    uint16_t a = address + i;
+    uint8_t bits = jit->covered[a >> 8][(a & 0xFF) >> 3];
+
+    // A whole byte of the bitmap at a time where the range spans it
+    uint8_t mask = (a & 7) == 0 && len - i >= 8 ? 0xFF : 1 << (a & 7);
+
+    if (bits & mask) {
+      flushJit(jit);
+      return;
+    }
+
+    i += mask == 0xFF ? 8 : 1;
+  }
+}
+
+#else
+
+bool initJit(Jit *jit) {
+  (void)jit;
+  return false;
+}
+
+void resetJit(Jit *jit) { (void)jit; }
+
+void freeJit(Jit *jit) { (void)jit; }
+
+void jitBranch(struct VM *vm) { (void)vm; }
+
+void jitInvalidate(Jit *jit, uint16_t address, int len) {
+  (void)jit;
+  (void)address;
+  (void)len;
+}
+
+#endif
@@ -0,0 +1,132 @@
+#include "machine.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void initMachine(Machine *machine, const uint8_t *instructions, int count) {
+  machine->cores = malloc(count * sizeof(VM));
+  machine->count = count;
+  machine->jits = NULL;
+
+  machine->memory = malloc(MEMORY_SIZE);
+  memcpy(machine->memory, instructions, MEMORY_SIZE);
+
+  machine->finished = calloc(count, sizeof(bool));
+  machine->stopping = false;
+
+  pthread_mutex_init(&machine->lock, NULL);
+  pthread_cond_init(&machine->changed, NULL);
+
+  for (int i = 0; i < count; i++) {
+    initCpu(&machine->cores[i], machine->memory);
+    attachCore(&machine->cores[i], machine, i);
+  }
+}
+
+bool jitMachine(Machine *machine) {
+  machine->jits = malloc(machine->count * sizeof(Jit));
+
+  for (int i = 0; i < machine->count; i++) {
+    if (!initJit(&machine->jits[i])) {
+      for (int j = 0; j < i; j++) {
+        freeJit(&machine->jits[j]);
+        machine->cores[j]._jit = NULL;
+      }
+
+      free(machine->jits);
+      machine->jits = NULL;
+      return false;
+    }
+
+    machine->cores[i]._jit = &machine->jits[i];
+  }
+
+  return true;
+}
+
+// Records that core is done, ending the machine if it was core 0 or it
+// faulted
+static void finish(Machine *machine, VM *vm) {
+  pthread_mutex_lock(&machine->lock);
+
+  __atomic_store_n(&machine->finished[vm->_core], true, __ATOMIC_RELEASE);
+
+  if (vm->_core == 0 || vm->_state == STATUS_FAULTED) {
+    __atomic_store_n(&machine->stopping, true, __ATOMIC_RELEASE);
+
+    // The other cores pause at their next branch and see stopping
+    for (int i = 0; i < machine->count; i++) {
+      __atomic_store_n(&machine->cores[i]._interrupt, true, __ATOMIC_RELEASE);
+    }
+  }
+
+  pthread_cond_broadcast(&machine->changed);
+  pthread_mutex_unlock(&machine->lock);
+}
+
+// Blocks until core finished or the machine ended. Both only change with the
+// lock held, so the wake up cannot be missed.
+static void waitFor(Machine *machine, uint8_t core) {
+  pthread_mutex_lock(&machine->lock);
+
+  while (!machine->finished[core] && !machine->stopping) {
+    pthread_cond_wait(&machine->changed, &machine->lock);
+  }
+
+  pthread_mutex_unlock(&machine->lock);
+}
+
+static void *runCore(void *arg) {
+  VM *vm = arg;
+  Machine *machine = vm->_machine;
+
+  while (!__atomic_load_n(&machine->stopping, __ATOMIC_ACQUIRE)) {
+    enum VMStatus state = run(vm, NO_BUDGET);
+
+    if (state == STATUS_WAITING) {
+      // Still in G0, CALL_JOIN left it alone
+      waitFor(machine, vm->_registers[R_G0]);
+    } else if (state != STATUS_PAUSED) {
+      break;
+    }
+  }
+
+  if (vm->_state != STATUS_HALTED && vm->_state != STATUS_FAULTED) {
+    killCpu(vm, "Machine stopped.\n");
+  }
+
+  finish(machine, vm);
+  return NULL;
+}
+
+void runMachine(Machine *machine) {
+  pthread_t *threads = malloc(machine->count * sizeof(pthread_t));
+
+  for (int i = 0; i < machine->count; i++) {
+    pthread_create(&threads[i], NULL, runCore, &machine->cores[i]);
+  }
+
+  for (int i = 0; i < machine->count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+}
+
+void freeMachine(Machine *machine) {
+  for (int i = 0; i < machine->count; i++) {
+    freeCpu(&machine->cores[i]);
+
+    if (machine->jits) {
+      freeJit(&machine->jits[i]);
+    }
+  }
+
+  pthread_mutex_destroy(&machine->lock);
+  pthread_cond_destroy(&machine->changed);
+
+  free(machine->jits);
+  free(machine->finished);
+  free(machine->memory);
+  free(machine->cores);
+}
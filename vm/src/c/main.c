@@ -1,48 +1,475 @@
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
+#include "batch.h"
+#include "image.h"
+#include "jit.h"
+#include "machine.h"
+#include "profile.h"
+#include "record.h"
+#include "sched.h"
+#include "trace.h"
 #include "vm.h"
 
-void readFile(char *filename, uint8_t buf[MEMORY_SIZE]) {
-  FILE *fptr;
+static void usage(void) {
+  printf("Usage: prog [options] file\n"
+         "  file                 Image of at most 64 KB, '-' reads it from "
+         "stdin\n"
+         "  --jit                Compile hot code to native code\n"
+         "  --trace              Trace every instruction to stdout\n"
+         "  --trace-ops=LIST     Only trace these mnemonics, e.g. add,st,jmp\n"
+         "  --trace-pc=START:END Only trace instructions in this address "
+         "range\n"
+         "  --trace-first=N      Stop tracing after N instructions\n"
+         "  --trace-last=N       Only write out the last N instructions\n"
+         "  --trace-file=PATH    Write the trace to PATH instead of stdout\n"
+         "  --profile[=PATH]     Count instructions per opcode, label and "
+         "address,\n"
+         "                       reported to PATH or stdout\n"
+         "  --profile-stacks=PATH\n"
+         "                       Write instruction counts per call stack to "
+         "PATH in\n"
+         "                       the collapsed flame graph format\n"
+         "  --cycles[=PATH]      Model the cycles the program takes, reported "
+         "per\n"
+         "                       opcode and subroutine to PATH or stdout\n"
+         "  --costs=PATH         Read the cycle costs from PATH, one "
+         "'NAME CYCLES'\n"
+         "                       line per mnemonic, memory, branch or "
+         "syscall\n"
+         "  --symbols=PATH       Name addresses after the labels in the "
+         "assembler's\n"
+         "                       symbol map\n"
+         "  --batch=LIST         Run the file once per input file listed in "
+         "LIST\n"
+         "  --threads=N          Batch worker threads, defaults to one per "
+         "core\n"
+         "  --batch-out=DIR      Write the output of batch instance i to "
+         "DIR/i.out\n"
+         "  --slice=N            Time-slice the batch on one thread, N "
+         "instructions\n"
+         "                       at a time\n"
+         "  --record=PATH        Log what every console and file syscall did "
+         "to PATH\n"
+         "  --replay=PATH        Replay the syscalls logged in PATH instead of "
+         "using\n"
+         "                       the console and files\n"
+         "  --cores=N            Run the file on N cores sharing its "
+         "memory, each on\n"
+         "                       its own thread\n"
+         "  --max-instructions=N Kill the program after N instructions\n"
+         "  --timeout=SECONDS    Kill the program after running this long\n");
+}
+
+// Returns the value of a '--name=value' argument, or NULL if arg is not name
+static char *option(char *arg, const char *name) {
+  int len = strlen(name);
+
+  if (strncmp(arg, name, len) != 0) {
+    return NULL;
+  }
 
-  fptr = fopen(filename, "r");
+  if (arg[len] == '=') {
+    return arg + len + 1;
+  }
+
+  return arg[len] == '\0' ? "" : NULL;
+}
 
-  if (!fptr) {
-    printf("Cannot open file '%s'.", filename);
+static uint64_t number(const char *str, const char *name) {
+  char *end;
+  uint64_t n = strtoull(str, &end, 0);
+
+  if (*str == '\0' || *end != '\0') {
+    printf("Expected number for '%s'.\n", name);
     exit(-1);
   }
 
-  fseek(fptr, 0, SEEK_END);
+  return n;
+}
+
+// Writes one of the profile's reports to path, or stdout when there is none
+static void writeReport(Profile *profile, const char *path,
+                        void (*write)(Profile *, FILE *)) {
+  FILE *out;
 
-  if (ftell(fptr) != MEMORY_SIZE) {
-    printf("File must be of size 0xFFFF.\n");
+  if (!(out = path ? fopen(path, "w") : stdout)) {
+    printf("Cannot open file '%s'.\n", path);
     exit(-1);
   }
 
-  rewind(fptr);
+  write(profile, out);
+
+  if (out != stdout) {
+    fclose(out);
+  }
+}
+
+static int runBatchMode(const uint8_t *image, char *list, char *out,
+                        int threads, uint64_t slice, bool jitting,
+                        Scheduler *watchdog) {
+  Batch batch;
+
+  if (!loadBatch(&batch, list, image)) {
+    printf("Cannot open file '%s'.\n", list);
+    exit(-1);
+  }
+
+  batch.jit = jitting;
+  batch.maxInstructions = watchdog->maxInstructions;
+  batch.timeout = watchdog->timeout;
+
+  if (slice) {
+    runBatchSliced(&batch, slice);
+  } else {
+    runBatch(&batch, threads);
+  }
+
+  if (out && !writeBatchOutput(&batch, out)) {
+    printf("Could not write batch output to '%s'.\n", out);
+    exit(-1);
+  }
+
+  printBatchSummary(&batch, stdout);
+
+  int failed = 0;
+  for (int i = 0; i < batch.count; i++) {
+    failed += batch.instances[i].status != 0;
+  }
+
+  freeBatch(&batch);
+  return failed ? -1 : 0;
+}
+
+// Prints the message of core 0 and of every core that faulted by itself
+static int runMachineMode(const uint8_t *image, int cores, bool jitting) {
+  Machine machine;
+  int status = 0;
+
+  initMachine(&machine, image, cores);
+
+  if (jitting && !jitMachine(&machine)) {
+    printf("JIT unavailable on this host, interpreting.\n");
+  }
 
-  fread(buf, sizeof(char), 0xFFFF, fptr);
+  runMachine(&machine);
+
+  for (int i = 0; i < cores; i++) {
+    VM *core = &machine.cores[i];
+
+    if (i == 0) {
+      fputs(core->_message, core->_output);
+    } else if (core->_fault != FAULT_NONE && core->_fault != FAULT_KILLED) {
+      fprintf(core->_output, "Core %d: %s", i, core->_message);
+    }
+
+    if (core->_fault != FAULT_NONE && core->_fault != FAULT_KILLED) {
+      status = -1;
+    }
+  }
+
+  if (machine.cores[0]._state != STATUS_HALTED) {
+    status = -1;
+  }
 
-  fclose(fptr);
+  freeMachine(&machine);
+  return status;
 }
 
 int main(int count, char **args) {
   VM vm;
 
-  uint8_t arr[MEMORY_SIZE];
+  Image image;
+
+  char *filename = NULL;
+
+  bool jitting = false;
+  Jit jit;
+
+  char *batchList = NULL;
+  char *batchOut = NULL;
+  int threads = 0;
+  uint64_t slice = 0;
+  int cores = 0;
+
+  // Only holds the watchdog limits until the program runs
+  Scheduler sched;
+  initScheduler(&sched, SCHED_SLICE);
+
+  bool tracing = false;
+  char *traceFile = NULL;
+  Trace trace;
+  initTrace(&trace, stdout);
+
+  bool profiling = false;
+  bool reporting = false;
+  char *profileFile = NULL;
+  char *stacksFile = NULL;
+  char *symbolsFile = NULL;
+
+  bool costing = false;
+  char *cyclesFile = NULL;
+  CostModel costs;
+  initCostModel(&costs);
+
+  char *recordFile = NULL;
+  char *replayFile = NULL;
+  Recording recording;
+
+  for (int i = 1; i < count; i++) {
+    char *arg = args[i];
+    char *val;
+
+    if (arg[0] != '-' || arg[1] == '\0') {
+      if (filename) {
+        printf("Too many args.\n");
+        exit(-1);
+      }
+      filename = arg;
+    } else if ((val = option(arg, "--jit"))) {
+      jitting = true;
+    } else if ((val = option(arg, "--trace-ops"))) {
+      if (!traceOps(&trace, val)) {
+        printf("Unkown mnemonic in '%s'.\n", val);
+        exit(-1);
+      }
+      tracing = true;
+    } else if ((val = option(arg, "--trace-pc"))) {
+      char *split = strchr(val, ':');
+
+      if (!split) {
+        printf("Expected START:END for '--trace-pc'.\n");
+        exit(-1);
+      }
+
+      *split = '\0';
+      trace.pcStart = number(val, "--trace-pc");
+      trace.pcEnd = number(split + 1, "--trace-pc");
+      tracing = true;
+    } else if ((val = option(arg, "--trace-first"))) {
+      trace.first = number(val, "--trace-first");
+      tracing = true;
+    } else if ((val = option(arg, "--trace-last"))) {
+      trace.last = number(val, "--trace-last");
 
-  if (count < 2) {
+      if (trace.last > TRACE_MAX_LAST) {
+        printf("Expected at most %d for '--trace-last'.\n", TRACE_MAX_LAST);
+        exit(-1);
+      }
+      tracing = true;
+    } else if ((val = option(arg, "--trace-file"))) {
+      traceFile = val;
+      tracing = true;
+    } else if ((val = option(arg, "--trace"))) {
+      tracing = true;
+    } else if ((val = option(arg, "--profile-stacks"))) {
+      stacksFile = val;
+      profiling = true;
+    } else if ((val = option(arg, "--profile"))) {
+      profileFile = *val ? val : NULL;
+      reporting = true;
+      profiling = true;
+    } else if ((val = option(arg, "--cycles"))) {
+      cyclesFile = *val ? val : NULL;
+      costing = true;
+      profiling = true;
+    } else if ((val = option(arg, "--costs"))) {
+      if (!loadCostModel(&costs, val)) {
+        exit(-1);
+      }
+      costing = true;
+      profiling = true;
+    } else if ((val = option(arg, "--symbols"))) {
+      symbolsFile = val;
+    } else if ((val = option(arg, "--batch-out"))) {
+      batchOut = val;
+    } else if ((val = option(arg, "--batch"))) {
+      batchList = val;
+    } else if ((val = option(arg, "--threads"))) {
+      threads = number(val, "--threads");
+    } else if ((val = option(arg, "--slice"))) {
+      slice = number(val, "--slice");
+    } else if ((val = option(arg, "--record"))) {
+      recordFile = val;
+    } else if ((val = option(arg, "--replay"))) {
+      replayFile = val;
+    } else if ((val = option(arg, "--cores"))) {
+      uint64_t n = number(val, "--cores");
+
+      if (n < 1 || n > MACHINE_MAX_CORES) {
+        printf("Expected 1 to %d cores.\n", MACHINE_MAX_CORES);
+        exit(-1);
+      }
+      cores = n;
+    } else if ((val = option(arg, "--max-instructions"))) {
+      sched.maxInstructions = number(val, "--max-instructions");
+    } else if ((val = option(arg, "--timeout"))) {
+      char *end;
+      sched.timeout = strtod(val, &end);
+
+      if (*val == '\0' || *end != '\0' || sched.timeout < 0) {
+        printf("Expected seconds for '--timeout'.\n");
+        exit(-1);
+      }
+    } else {
+      usage();
+      exit(-1);
+    }
+  }
+
+  if (!filename) {
     printf("Expected file to be read.\n");
-  } else if (count > 2) {
-    printf("Too many args.\n");
+    usage();
+    exit(-1);
+  }
+
+  switch (loadImage(&image, filename)) {
+  case IMAGE_UNREADABLE:
+    printf("Cannot open file '%s'.\n", filename);
+    exit(-1);
+  case IMAGE_TOO_LARGE:
+    printf("Image must be at most 64 KB.\n");
+    exit(-1);
+  default:
+    break;
+  }
+
+  if ((recordFile || replayFile) && (batchList || cores)) {
+    printf("Cannot record or replay a batch or several cores.\n");
+    exit(-1);
+  }
+
+  if (recordFile && replayFile) {
+    printf("Cannot record and replay at once.\n");
+    exit(-1);
+  }
+
+  if (batchList) {
+    if (tracing) {
+      printf("Cannot trace a batch.\n");
+      exit(-1);
+    }
+
+    if (profiling) {
+      printf("Cannot profile a batch.\n");
+      exit(-1);
+    }
+
+    if (cores) {
+      printf("Cannot run a batch on several cores.\n");
+      exit(-1);
+    }
+
+    if (slice && jitting) {
+      printf("Cannot JIT a time-sliced batch.\n");
+      exit(-1);
+    }
+
+    return runBatchMode(image.bytes, batchList, batchOut, threads, slice,
+                        jitting, &sched);
+  }
+
+  if (cores) {
+    if (tracing || profiling) {
+      printf("Cannot trace or profile several cores.\n");
+      exit(-1);
+    }
+
+    if (sched.maxInstructions || sched.timeout) {
+      printf("Cannot watch several cores.\n");
+      exit(-1);
+    }
+
+    return runMachineMode(image.bytes, cores, jitting);
   }
 
-  readFile(args[1], arr);
+  initCpu(&vm, image.bytes);
 
-  initCpu(&vm, arr);
+  if (tracing) {
+    if (traceFile && !(trace.out = fopen(traceFile, "w"))) {
+      printf("Cannot open file '%s'.\n", traceFile);
+      exit(-1);
+    }
+
+    vm._trace = &trace;
+  }
+
+  // Large enough to not belong on the stack
+  Profile *profile = NULL;
+
+  if (profiling) {
+    profile = malloc(sizeof(Profile));
+    initProfile(profile);
+
+    if (symbolsFile && !loadSymbols(profile, symbolsFile)) {
+      printf("Cannot open file '%s'.\n", symbolsFile);
+      exit(-1);
+    }
+
+    if (costing) {
+      profile->costs = &costs;
+    }
+
+    vm._profile = profile;
+  }
+
+  if (recordFile || replayFile) {
+    char *path = replayFile ? replayFile : recordFile;
+
+    if (!openRecording(&recording, path, replayFile != NULL)) {
+      printf("Cannot open syscall log '%s'.\n", path);
+      exit(-1);
+    }
+
+    vm._recording = &recording;
+  }
+
+  if (jitting) {
+    if (initJit(&jit)) {
+      vm._jit = &jit;
+    } else {
+      printf("JIT unavailable on this host, interpreting.\n");
+    }
+  }
+
+  // Without a watchdog the program runs unsliced, on the fastest loop
+  if (sched.maxInstructions || sched.timeout) {
+    if (slice) {
+      sched.slice = slice;
+    }
+
+    scheduleVm(&sched, &vm);
+    runScheduler(&sched);
+  } else {
+    run(&vm, NO_BUDGET);
+  }
+  freeScheduler(&sched);
+
+  fputs(vm._message, vm._output);
+
+  if (vm._recording) {
+    closeRecording(&recording);
+  }
+
+  if (profile) {
+    if (reporting) {
+      writeReport(profile, profileFile, writeProfileReport);
+    }
+
+    if (stacksFile) {
+      writeReport(profile, stacksFile, writeCollapsedStacks);
+    }
+
+    if (costing) {
+      writeReport(profile, cyclesFile, writeCycleReport);
+    }
+
+    freeProfile(profile);
+    free(profile);
+  }
 
-  run(&vm);
+  return vm._state == STATUS_HALTED ? 0 : -1;
 }
@@ -0,0 +1,131 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Tasks still queued on one worker, the owner takes from begin and thieves
+// take the upper half
+struct Worker {
+  pthread_mutex_t lock;
+  int begin;
+  int end;
+
+  int id;
+  struct Pool *pool;
+  pthread_t thread;
+};
+
+typedef struct Worker Worker;
+
+struct Pool {
+  Worker *workers;
+  int count;
+
+  PoolTask fn;
+  void *ctx;
+};
+
+typedef struct Pool Pool;
+
+// Takes the next task queued on worker, or returns -1 if it has none
+static int take(Worker *worker) {
+  int task = -1;
+
+  pthread_mutex_lock(&worker->lock);
+  if (worker->begin < worker->end) {
+    task = worker->begin++;
+  }
+  pthread_mutex_unlock(&worker->lock);
+
+  return task;
+}
+
+// Moves half of the tasks left on some other worker to thief and returns the
+// first of them, or -1 if every queue is empty
+static int steal(Worker *thief) {
+  Pool *pool = thief->pool;
+
+  for (int i = 1; i < pool->count; i++) {
+    Worker *victim = &pool->workers[(thief->id + i) % pool->count];
+    int begin = -1;
+    int end = -1;
+
+    pthread_mutex_lock(&victim->lock);
+    int left = victim->end - victim->begin;
+    if (left > 0) {
+      end = victim->end;
+      begin = victim->end -= (left + 1) / 2;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if (begin >= 0) {
+      pthread_mutex_lock(&thief->lock);
+      thief->begin = begin + 1;
+      thief->end = end;
+      pthread_mutex_unlock(&thief->lock);
+      return begin;
+    }
+  }
+
+  // Tasks never create tasks, so once every queue is empty the work is done
+  return -1;
+}
+
+static void *work(void *arg) {
+  Worker *worker = arg;
+  Pool *pool = worker->pool;
+
+  while (true) {
+    int task = take(worker);
+
+    if (task < 0 && (task = steal(worker)) < 0) {
+      return NULL;
+    }
+
+    pool->fn(pool->ctx, task, worker->id);
+  }
+}
+
+void runPool(int threads, int count, PoolTask fn, void *ctx) {
+  if (threads < 1) {
+    threads = 1;
+  }
+  if (threads > count) {
+    threads = count > 0 ? count : 1;
+  }
+
+  Pool pool = {calloc(threads, sizeof(Worker)), threads, fn, ctx};
+
+  for (int i = 0; i < threads; i++) {
+    Worker *worker = &pool.workers[i];
+
+    pthread_mutex_init(&worker->lock, NULL);
+    worker->begin = (long)count * i / threads;
+    worker->end = (long)count * (i + 1) / threads;
+    worker->id = i;
+    worker->pool = &pool;
+  }
+
+  // The calling thread works as worker 0
+  for (int i = 1; i < threads; i++) {
+    pthread_create(&pool.workers[i].thread, NULL, work, &pool.workers[i]);
+  }
+  work(&pool.workers[0]);
+
+  for (int i = 1; i < threads; i++) {
+    pthread_join(pool.workers[i].thread, NULL);
+  }
+
+  for (int i = 0; i < threads; i++) {
+    pthread_mutex_destroy(&pool.workers[i].lock);
+  }
+  free(pool.workers);
+}
+
+int processorCount(void) {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return count > 0 ? count : 1;
+}
@@ -0,0 +1,489 @@
+#include "profile.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+// Longest frame or address name
+#define MAX_NAME 96
+
+static int addNode(Profile *profile, uint16_t entry, int parent) {
+  if (profile->nodeCount == profile->nodeCapacity) {
+    profile->nodeCapacity = profile->nodeCapacity * 2;
+    profile->nodes =
+        realloc(profile->nodes, profile->nodeCapacity * sizeof(StackNode));
+  }
+
+  int node = profile->nodeCount++;
+  profile->nodes[node] = (StackNode){entry, parent, -1, -1, 0, 0};
+
+  if (parent >= 0) {
+    profile->nodes[node].sibling = profile->nodes[parent].child;
+    profile->nodes[parent].child = node;
+  }
+
+  return node;
+}
+
+void initProfile(Profile *profile) {
+  memset(profile->ops, 0, sizeof(profile->ops));
+  memset(profile->pcs, 0, sizeof(profile->pcs));
+  profile->total = 0;
+
+  profile->costs = NULL;
+  memset(profile->opCycles, 0, sizeof(profile->opCycles));
+  profile->cycles = 0;
+
+  profile->nodeCount = 0;
+  profile->nodeCapacity = 64;
+  profile->nodes = malloc(profile->nodeCapacity * sizeof(StackNode));
+  addNode(profile, 0, -1);
+
+  profile->depth = 0;
+  profile->pending = false;
+
+  profile->symbols = NULL;
+  profile->symbolCount = 0;
+}
+
+static int compareSymbols(const void *a, const void *b) {
+  return ((const Symbol *)a)->address - ((const Symbol *)b)->address;
+}
+
+bool loadSymbols(Profile *profile, const char *path) {
+  FILE *fptr = fopen(path, "r");
+
+  if (!fptr) {
+    return false;
+  }
+
+  int capacity = 0;
+  unsigned address;
+  char name[MAX_NAME];
+
+  while (fscanf(fptr, "%x %95s", &address, name) == 2) {
+    if (profile->symbolCount == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      profile->symbols =
+          realloc(profile->symbols, capacity * sizeof(Symbol));
+    }
+
+    profile->symbols[profile->symbolCount++] =
+        (Symbol){address, strdup(name)};
+  }
+
+  fclose(fptr);
+
+  qsort(profile->symbols, profile->symbolCount, sizeof(Symbol),
+        compareSymbols);
+  return true;
+}
+
+// Returns the label at or closest below address, NULL if there is none
+static const Symbol *symbolAt(const Profile *profile, uint16_t address) {
+  int lo = 0;
+  int hi = profile->symbolCount - 1;
+  const Symbol *found = NULL;
+
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+
+    if (profile->symbols[mid].address <= address) {
+      found = &profile->symbols[mid];
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  return found;
+}
+
+// Names address after its label, 'label+0x4' when it lies past it
+static const char *addressName(const Profile *profile, uint16_t address,
+                               char name[MAX_NAME]) {
+  const Symbol *symbol = symbolAt(profile, address);
+
+  if (!symbol) {
+    snprintf(name, MAX_NAME, "0x%04X", address);
+  } else if (symbol->address == address) {
+    snprintf(name, MAX_NAME, "%s", symbol->name);
+  } else {
+    snprintf(name, MAX_NAME, "%s+0x%X", symbol->name,
+             address - symbol->address);
+  }
+
+  return name;
+}
+
+static int currentNode(const Profile *profile) {
+  return profile->depth ? profile->frames[profile->depth - 1].node : 0;
+}
+
+// Drops the calls whose link is no longer on the stack
+static void unwind(Profile *profile, uint8_t sp) {
+  while (profile->depth > 0 &&
+         sp < profile->frames[profile->depth - 1].sp + 2) {
+    profile->depth--;
+  }
+}
+
+static void enter(Profile *profile, uint16_t entry, uint8_t sp) {
+  if (profile->depth == PROFILE_MAX_DEPTH) {
+    return;
+  }
+
+  int parent = currentNode(profile);
+  int node = profile->nodes[parent].child;
+
+  while (node >= 0 && profile->nodes[node].entry != entry) {
+    node = profile->nodes[node].sibling;
+  }
+
+  if (node < 0) {
+    node = addNode(profile, entry, parent);
+  }
+
+  profile->frames[profile->depth++] = (Frame){node, sp};
+}
+
+static bool linking(uint8_t op) {
+  return op == OP_JMP || op == OP_JE || op == OP_JNE || op == OP_JG ||
+         op == OP_JL || op == OP_JSR;
+}
+
+static bool branching(uint8_t op) {
+  return linking(op) || op == OP_RET || (op >= OP_BR && op <= OP_BRLS);
+}
+
+// Bytes of memory op reads or writes, links pushed by jumps aside
+static uint32_t memoryBytes(const MicroOp *u) {
+  switch (u->op) {
+  case OP_LD:
+  case OP_ST:
+  case OP_LDR:
+  case OP_STR:
+  case OP_LDX:
+  case OP_STX:
+  case OP_PUSH:
+  case OP_POP:
+    return 1;
+  case OP_RET:
+  case OP_XCHG:
+  case OP_XADD:
+  case OP_CAS:
+    return 2;
+  case OP_COPY:
+    return 2 * u->size;
+  case OP_FILL:
+    return u->size;
+  default:
+    return 0;
+  }
+}
+
+// Modeled cycles of the last instruction, which continued at pc
+static uint64_t lastCycles(const Profile *profile, uint16_t pc) {
+  const CostModel *costs = profile->costs;
+  uint8_t op = profile->lastOp;
+  uint64_t cycles =
+      costs->ops[op] + (uint64_t)costs->memory * profile->lastBytes;
+
+  if (branching(op) && pc != profile->lastNext) {
+    cycles += costs->branch;
+
+    if (linking(op)) {
+      cycles += 2 * costs->memory;
+    }
+  }
+
+  if (op == OP_CALL) {
+    cycles += costs->syscall;
+  }
+
+  return cycles;
+}
+
+// Counts the last instruction against node
+static void charge(Profile *profile, int node, uint16_t pc) {
+  profile->nodes[node].count++;
+
+  if (profile->costs) {
+    uint64_t cycles = lastCycles(profile, pc);
+
+    profile->nodes[node].cycles += cycles;
+    profile->opCycles[profile->lastOp] += cycles;
+    profile->cycles += cycles;
+  }
+}
+
+// Charges the last instruction to its stack now that pc and sp show what it
+// did. A return still belongs to the call it leaves, a jump to its caller.
+static void settle(Profile *profile, uint16_t pc, uint8_t sp) {
+  if (profile->lastOp == OP_RET) {
+    charge(profile, currentNode(profile), pc);
+    unwind(profile, sp);
+    return;
+  }
+
+  unwind(profile, sp);
+  charge(profile, currentNode(profile), pc);
+
+  if (linking(profile->lastOp) && pc != profile->lastNext &&
+      sp == profile->lastSp + 2) {
+    enter(profile, pc, profile->lastSp);
+  }
+}
+
+void profileInstruction(Profile *profile, uint16_t pc, const MicroOp *u,
+                        uint8_t sp) {
+  if (profile->pending) {
+    settle(profile, pc, sp);
+  }
+
+  profile->ops[u->op]++;
+  profile->pcs[pc]++;
+  profile->total++;
+
+  profile->pending = true;
+  profile->lastOp = u->op;
+  profile->lastNext = pc + u->len;
+  profile->lastSp = sp;
+  profile->lastBytes = memoryBytes(u);
+}
+
+// Charges the instruction the program stopped at to the stack it ran on
+static void settleLast(Profile *profile) {
+  if (profile->pending) {
+    charge(profile, currentNode(profile), profile->lastNext);
+    profile->pending = false;
+  }
+}
+
+static double percent(const Profile *profile, uint64_t count) {
+  return profile->total ? 100.0 * count / profile->total : 0;
+}
+
+// A count and what it belongs to, a label index or an address
+struct Tally {
+  uint64_t count;
+  int index;
+};
+
+typedef struct Tally Tally;
+
+// Largest count first
+static int compareTallies(const void *a, const void *b) {
+  uint64_t x = ((const Tally *)a)->count;
+  uint64_t y = ((const Tally *)b)->count;
+
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void writeTallyHeader(const char *title, FILE *out) {
+  fprintf(out, "\n%-24s %12s %8s\n", title, "count", "percent");
+}
+
+static void writeSymbolCounts(const Profile *profile, FILE *out) {
+  Tally *tallies = malloc(profile->symbolCount * sizeof(Tally));
+
+  for (int i = 0; i < profile->symbolCount; i++) {
+    tallies[i] = (Tally){0, i};
+  }
+
+  for (int pc = 0; pc < 0x10000; pc++) {
+    const Symbol *symbol = profile->pcs[pc] ? symbolAt(profile, pc) : NULL;
+
+    if (symbol) {
+      tallies[symbol - profile->symbols].count += profile->pcs[pc];
+    }
+  }
+
+  qsort(tallies, profile->symbolCount, sizeof(Tally), compareTallies);
+  writeTallyHeader("label", out);
+
+  for (int i = 0; i < profile->symbolCount && tallies[i].count; i++) {
+    fprintf(out, "%-24s %12llu %7.2f%%\n",
+            profile->symbols[tallies[i].index].name,
+            (unsigned long long)tallies[i].count,
+            percent(profile, tallies[i].count));
+  }
+
+  free(tallies);
+}
+
+static void writeTopPcs(const Profile *profile, FILE *out) {
+  Tally *tallies = malloc(0x10000 * sizeof(Tally));
+  int count = 0;
+
+  for (int pc = 0; pc < 0x10000; pc++) {
+    if (profile->pcs[pc]) {
+      tallies[count++] = (Tally){profile->pcs[pc], pc};
+    }
+  }
+
+  qsort(tallies, count, sizeof(Tally), compareTallies);
+  writeTallyHeader("address", out);
+
+  for (int i = 0; i < count && i < PROFILE_TOP_PCS; i++) {
+    char name[MAX_NAME] = "";
+
+    if (profile->symbolCount) {
+      addressName(profile, tallies[i].index, name);
+    }
+
+    fprintf(out, "0x%04X %-17s %12llu %7.2f%%\n", tallies[i].index, name,
+            (unsigned long long)tallies[i].count,
+            percent(profile, tallies[i].count));
+  }
+
+  free(tallies);
+}
+
+void writeProfileReport(Profile *profile, FILE *out) {
+  settleLast(profile);
+
+  fprintf(out, "%llu instructions\n", (unsigned long long)profile->total);
+  writeTallyHeader("opcode", out);
+
+  for (int op = 0; op < 256; op++) {
+    if (profile->ops[op]) {
+      const char *name = opInfo(op)->name;
+
+      fprintf(out, "%-24s %12llu %7.2f%%\n", name ? name : "BAD",
+              (unsigned long long)profile->ops[op],
+              percent(profile, profile->ops[op]));
+    }
+  }
+
+  if (profile->symbolCount) {
+    writeSymbolCounts(profile, out);
+  }
+
+  writeTopPcs(profile, out);
+}
+
+void writeCollapsedStacks(Profile *profile, FILE *out) {
+  settleLast(profile);
+
+  for (int i = 0; i < profile->nodeCount; i++) {
+    if (!profile->nodes[i].count) {
+      continue;
+    }
+
+    // Walk up to the root, then print the frames outermost first
+    int path[PROFILE_MAX_DEPTH + 1];
+    int len = 0;
+
+    for (int node = i; node >= 0; node = profile->nodes[node].parent) {
+      path[len++] = node;
+    }
+
+    for (int j = len - 1; j >= 0; j--) {
+      char name[MAX_NAME];
+
+      fprintf(out, "%s%s", addressName(profile, profile->nodes[path[j]].entry,
+                                       name),
+              j ? ";" : "");
+    }
+
+    fprintf(out, " %llu\n", (unsigned long long)profile->nodes[i].count);
+  }
+}
+
+// Instructions and cycles charged to one opcode or subroutine
+struct Cost {
+  uint64_t count;
+  uint64_t cycles;
+  int index;
+};
+
+typedef struct Cost Cost;
+
+// Most cycles first
+static int compareCosts(const void *a, const void *b) {
+  uint64_t x = ((const Cost *)a)->cycles;
+  uint64_t y = ((const Cost *)b)->cycles;
+
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static double cpi(uint64_t cycles, uint64_t count) {
+  return count ? (double)cycles / count : 0;
+}
+
+static void writeCostHeader(const char *title, FILE *out) {
+  fprintf(out, "\n%-24s %12s %14s %8s %8s\n", title, "count", "cycles", "CPI",
+          "percent");
+}
+
+static void writeCost(const Profile *profile, const char *name,
+                      const Cost *cost, FILE *out) {
+  fprintf(out, "%-24s %12llu %14llu %8.2f %7.2f%%\n", name,
+          (unsigned long long)cost->count, (unsigned long long)cost->cycles,
+          cpi(cost->cycles, cost->count),
+          profile->cycles ? 100.0 * cost->cycles / profile->cycles : 0);
+}
+
+void writeCycleReport(Profile *profile, FILE *out) {
+  settleLast(profile);
+
+  fprintf(out, "%llu cycles\n%llu instructions\n%.2f CPI\n",
+          (unsigned long long)profile->cycles,
+          (unsigned long long)profile->total,
+          cpi(profile->cycles, profile->total));
+
+  writeCostHeader("opcode", out);
+
+  for (int op = 0; op < 256; op++) {
+    if (profile->ops[op]) {
+      const char *name = opInfo(op)->name;
+      Cost cost = {profile->ops[op], profile->opCycles[op], op};
+
+      writeCost(profile, name ? name : "BAD", &cost, out);
+    }
+  }
+
+  // A subroutine is every stack it is the innermost frame of, so recursion
+  // and calls from different places add up under its entry
+  int *routine = malloc(0x10000 * sizeof(int));
+  Cost *routines = malloc(profile->nodeCount * sizeof(Cost));
+  int count = 0;
+
+  memset(routine, -1, 0x10000 * sizeof(int));
+
+  for (int i = 0; i < profile->nodeCount; i++) {
+    const StackNode *node = &profile->nodes[i];
+
+    if (routine[node->entry] < 0) {
+      routine[node->entry] = count;
+      routines[count++] = (Cost){0, 0, node->entry};
+    }
+
+    routines[routine[node->entry]].count += node->count;
+    routines[routine[node->entry]].cycles += node->cycles;
+  }
+
+  qsort(routines, count, sizeof(Cost), compareCosts);
+  writeCostHeader("subroutine", out);
+
+  for (int i = 0; i < count && routines[i].count; i++) {
+    char name[MAX_NAME];
+
+    writeCost(profile, addressName(profile, routines[i].index, name),
+              &routines[i], out);
+  }
+
+  free(routines);
+  free(routine);
+}
+
+void freeProfile(Profile *profile) {
+  for (int i = 0; i < profile->symbolCount; i++) {
+    free(profile->symbols[i].name);
+  }
+
+  free(profile->symbols);
+  free(profile->nodes);
+}
@@ -0,0 +1,114 @@
+#include "record.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Starts every log, the last byte being the format version
+static const char Magic[8] = {'G', 'I', 'S', 'C', 'L', 'O', 'G', 1};
+
+bool openRecording(Recording *recording, const char *path, bool replaying) {
+  char magic[sizeof(Magic)];
+
+  recording->replaying = replaying;
+  recording->inCall = false;
+
+  if (!(recording->file = fopen(path, replaying ? "rb" : "wb"))) {
+    return false;
+  }
+
+  if (replaying) {
+    if (fread(magic, 1, sizeof(magic), recording->file) != sizeof(magic) ||
+        memcmp(magic, Magic, sizeof(Magic)) != 0) {
+      fclose(recording->file);
+      return false;
+    }
+  } else {
+    fwrite(Magic, 1, sizeof(Magic), recording->file);
+  }
+
+  recording->record = malloc(sizeof(SyscallRecord));
+  return true;
+}
+
+// Numbers are written lowest byte first
+
+static void writeShort(FILE *file, uint16_t n) {
+  fputc(n & 0xFF, file);
+  fputc(n >> 8, file);
+}
+
+static bool readShort(FILE *file, uint16_t *n) {
+  uint8_t bytes[2];
+
+  if (fread(bytes, 1, 2, file) != 2) {
+    return false;
+  }
+
+  *n = bytes[0] | bytes[1] << 8;
+  return true;
+}
+
+// A record is the call and the fault, followed by the fault's value and
+// message if the call faulted, otherwise by the registers and the memory
+// written
+void writeRecord(Recording *recording, const SyscallRecord *record) {
+  FILE *file = recording->file;
+
+  fputc(record->call, file);
+  fputc(record->fault, file);
+
+  if (record->fault) {
+    uint8_t len = strlen(record->message);
+
+    fputc(record->value, file);
+    fputc(len, file);
+    fwrite(record->message, 1, len, file);
+    return;
+  }
+
+  fwrite(record->GP, 1, sizeof(record->GP), file);
+  writeShort(file, record->address);
+  writeShort(file, record->length);
+  writeShort(file, record->stored);
+  fwrite(record->bytes, 1, record->stored, file);
+}
+
+bool readRecord(Recording *recording, SyscallRecord *record) {
+  FILE *file = recording->file;
+  int call = fgetc(file);
+  int fault = fgetc(file);
+
+  if (call == EOF || fault == EOF) {
+    return false;
+  }
+
+  record->call = call;
+  record->fault = fault;
+
+  if (fault) {
+    int value = fgetc(file);
+    int len = fgetc(file);
+
+    if (value == EOF || len == EOF ||
+        fread(record->message, 1, len, file) != (size_t)len) {
+      return false;
+    }
+
+    record->value = value;
+    record->message[len] = '\0';
+    return true;
+  }
+
+  return fread(record->GP, 1, sizeof(record->GP), file) ==
+             sizeof(record->GP) &&
+         readShort(file, &record->address) &&
+         readShort(file, &record->length) &&
+         readShort(file, &record->stored) &&
+         record->stored <= record->length && record->length <= BUFFER_MAX &&
+         fread(record->bytes, 1, record->stored, file) == record->stored;
+}
+
+void closeRecording(Recording *recording) {
+  fclose(recording->file);
+  free(recording->record);
+}
@@ -0,0 +1,98 @@
+#include "sched.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void initScheduler(Scheduler *sched, uint64_t slice) {
+  sched->entries = NULL;
+  sched->count = 0;
+  sched->capacity = 0;
+
+  sched->slice = slice > 0 ? slice : SCHED_SLICE;
+  sched->maxInstructions = 0;
+  sched->timeout = 0;
+}
+
+int scheduleVm(Scheduler *sched, VM *vm) {
+  if (sched->count == sched->capacity) {
+    sched->capacity = sched->capacity ? sched->capacity * 2 : 16;
+    sched->entries =
+        realloc(sched->entries, sched->capacity * sizeof(SchedEntry));
+  }
+
+  sched->entries[sched->count] = (SchedEntry){vm, 0, 0};
+  return sched->count++;
+}
+
+// Gives the VM one slice, returns false once it no longer needs any
+static bool turn(Scheduler *sched, SchedEntry *entry) {
+  VM *vm = entry->vm;
+  uint64_t budget = sched->slice;
+
+  // The last slice before the instruction limit is cut short so the limit
+  // lands exactly
+  if (sched->maxInstructions) {
+    uint64_t left = sched->maxInstructions - entry->executed;
+
+    if (left < budget) {
+      budget = left;
+    }
+  }
+
+  double start = now();
+  enum VMStatus state = run(vm, budget);
+
+  entry->seconds += now() - start;
+  entry->executed += budget - vm->_budget;
+
+  if (state != STATUS_PAUSED) {
+    return false;
+  }
+
+  if (sched->maxInstructions && entry->executed >= sched->maxInstructions) {
+    killCpu(vm, "Instruction limit exceeded.\n");
+    return false;
+  }
+
+  if (sched->timeout && entry->seconds >= sched->timeout) {
+    killCpu(vm, "Timed out.\n");
+    return false;
+  }
+
+  return true;
+}
+
+void runScheduler(Scheduler *sched) {
+  // Indices of the VMs still running, in turn order
+  int *ready = malloc(sched->count * sizeof(int));
+  int live = 0;
+
+  for (int i = 0; i < sched->count; i++) {
+    if (sched->entries[i].vm->_state == STATUS_PAUSED) {
+      ready[live++] = i;
+    }
+  }
+
+  while (live > 0) {
+    int kept = 0;
+
+    for (int i = 0; i < live; i++) {
+      if (turn(sched, &sched->entries[ready[i]])) {
+        ready[kept++] = ready[i];
+      }
+    }
+
+    live = kept;
+  }
+
+  free(ready);
+}
+
+void freeScheduler(Scheduler *sched) { free(sched->entries); }
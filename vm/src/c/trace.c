@@ -0,0 +1,199 @@
+#include "trace.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "vm.h"
+
+// Longest line formatEntry can produce
+#define MAX_TRACE_LINE 128
+
+void initTrace(Trace *trace, FILE *out) {
+  memset(trace->ops, 0, sizeof(trace->ops));
+  trace->anyOp = false;
+
+  trace->pcStart = 0;
+  trace->pcEnd = 0xFFFF;
+
+  trace->first = 0;
+  trace->last = 0;
+  trace->count = 0;
+
+  trace->ring = NULL;
+
+  trace->buffer = NULL;
+  trace->bufferLen = 0;
+  trace->out = out;
+}
+
+bool traceOps(Trace *trace, const char *list) {
+  while (*list) {
+    const char *end = strchr(list, ',');
+    int len = end ? end - list : (int)strlen(list);
+    bool found = false;
+
+    for (int op = 0; op < 256; op++) {
+      const char *name = opInfo(op)->name;
+
+      if (name && (int)strlen(name) == len && strncasecmp(name, list, len) == 0) {
+        trace->ops[op] = true;
+        found = true;
+      }
+    }
+
+    if (!found) {
+      return false;
+    }
+
+    trace->anyOp = true;
+    list += len + (end ? 1 : 0);
+  }
+
+  return true;
+}
+
+static void writeOut(Trace *trace) {
+  if (trace->bufferLen > 0) {
+    fwrite(trace->buffer, sizeof(char), trace->bufferLen, trace->out);
+    trace->bufferLen = 0;
+  }
+}
+
+static void formatEntry(Trace *trace, const TraceEntry *e) {
+  if (!trace->buffer) {
+    trace->buffer = malloc(TRACE_BUFFER_SIZE);
+  }
+
+  if (trace->bufferLen > TRACE_BUFFER_SIZE - MAX_TRACE_LINE) {
+    writeOut(trace);
+  }
+
+  char *line = trace->buffer + trace->bufferLen;
+  const OpInfo *info = opInfo(e->op);
+  const char *name = info->name ? info->name : "???";
+  int len;
+
+  switch (info->format) {
+  case FORMAT_R:
+    len = sprintf(line, "0x%04X %-4s %s [%s=%d]\n", e->pc, name,
+                  registerName(e->a), registerName(e->a), e->valA);
+    break;
+  case FORMAT_RV:
+    len = sprintf(line, "0x%04X %-4s %s, %d [%s=%d]\n", e->pc, name,
+                  registerName(e->a), e->b, registerName(e->a), e->valA);
+    break;
+  case FORMAT_RR:
+    len = sprintf(line, "0x%04X %-4s %s, %s [%s=%d, %s=%d]\n", e->pc, name,
+                  registerName(e->a), registerName(e->b), registerName(e->a),
+                  e->valA, registerName(e->b), e->valB);
+    break;
+  case FORMAT_RA:
+    len = sprintf(line, "0x%04X %-4s %s, 0x%04X [%s=%d, MEM=%d]\n", e->pc,
+                  name, registerName(e->a), e->address, registerName(e->a),
+                  e->valA, e->mem);
+    break;
+  case FORMAT_A:
+    len = sprintf(line, "0x%04X %-4s 0x%04X [SR=%d, SP=%d]\n", e->pc, name,
+                  e->address, e->sr, e->sp);
+    break;
+  case FORMAT_V:
+    len = sprintf(line, "0x%04X %-4s %d [SP=%d]\n", e->pc, name, e->a, e->sp);
+    break;
+  case FORMAT_VV:
+    len = sprintf(line, "0x%04X %-4s %d, %d\n", e->pc, name, e->a, e->b);
+    break;
+  case FORMAT_AAW:
+    len = sprintf(line, "0x%04X %-4s 0x%04X, 0x%04X, %d\n", e->pc, name,
+                  e->address, e->source, e->size);
+    break;
+  case FORMAT_RAW:
+    len = sprintf(line, "0x%04X %-4s %s, 0x%04X, %d [%s=%d]\n", e->pc, name,
+                  registerName(e->a), e->address, e->size, registerName(e->a),
+                  e->valA);
+    break;
+  case FORMAT_RP:
+    len = sprintf(line,
+                  "0x%04X %-4s %s, %s [%s=%d, %s:%s=0x%04X, MEM=%d]\n", e->pc,
+                  name, registerName(e->a), registerName(e->b),
+                  registerName(e->a), e->valA, registerName(e->b + 1),
+                  registerName(e->b), e->address, e->mem);
+    break;
+  case FORMAT_RRA:
+    len = sprintf(line, "0x%04X %-4s %s, %s, 0x%04X [%s=%d, %s=%d, MEM=%d]\n",
+                  e->pc, name, registerName(e->a), registerName(e->b),
+                  e->address, registerName(e->a), e->valA, registerName(e->b),
+                  e->valB, e->mem);
+    break;
+  default:
+    len = sprintf(line, "0x%04X %-4s [SR=%d, SP=%d]\n", e->pc, name, e->sr,
+                  e->sp);
+    break;
+  }
+
+  trace->bufferLen += len;
+}
+
+void traceInstruction(Trace *trace, const uint8_t *regs, uint16_t pc,
+                      const MicroOp *uop, uint8_t mem) {
+  if (pc < trace->pcStart || pc > trace->pcEnd) {
+    return;
+  }
+
+  if (trace->anyOp && !trace->ops[uop->op]) {
+    return;
+  }
+
+  if (trace->first && trace->count >= trace->first) {
+    return;
+  }
+
+  const OpInfo *info = opInfo(uop->op);
+  bool regA = info->format == FORMAT_R || info->format == FORMAT_RV ||
+              info->format == FORMAT_RR || info->format == FORMAT_RA ||
+              info->format == FORMAT_RAW || info->format == FORMAT_RP ||
+              info->format == FORMAT_RRA;
+  bool regB = info->format == FORMAT_RR || info->format == FORMAT_RP ||
+              info->format == FORMAT_RRA;
+  // A pair stands in for the address
+  uint16_t address = info->format == FORMAT_RP
+                         ? (regs[uop->b + 1] << 8) | regs[uop->b]
+                         : uop->address;
+
+  TraceEntry e = {pc, address, uop->source, uop->size, uop->op, uop->a, uop->b,
+                  regA ? regs[uop->a] : 0,
+                  regB ? regs[uop->b] : 0, mem, regs[R_SR], regs[R_SP]};
+
+  if (trace->last) {
+    if (!trace->ring) {
+      trace->ring = malloc(trace->last * sizeof(TraceEntry));
+    }
+
+    trace->ring[trace->count % trace->last] = e;
+  } else {
+    formatEntry(trace, &e);
+  }
+
+  trace->count++;
+}
+
+void flushTrace(Trace *trace) {
+  writeOut(trace);
+  fflush(trace->out);
+}
+
+void freeTrace(Trace *trace) {
+  if (trace->ring) {
+    uint64_t kept = trace->count < trace->last ? trace->count : trace->last;
+
+    for (uint64_t i = trace->count - kept; i < trace->count; i++) {
+      formatEntry(trace, &trace->ring[i % trace->last]);
+    }
+  }
+
+  flushTrace(trace);
+
+  free(trace->ring);
+  free(trace->buffer);
+}
@@ -0,0 +1,67 @@
+#include "verify.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "decode.h"
+#include "vm.h"
+
+// Adds pc to the instructions still to walk unless it was reached before
+static void reach(bool *reached, uint16_t *pending, int *count, uint16_t pc) {
+  if (!reached[pc]) {
+    reached[pc] = true;
+    pending[(*count)++] = pc;
+  }
+}
+
+void verifyCode(VM *vm) {
+  bool *reached = calloc(MEMORY_SIZE, sizeof(bool));
+  uint16_t *pending = malloc(MEMORY_SIZE * sizeof(uint16_t));
+  uint16_t *verified = malloc(MEMORY_SIZE * sizeof(uint16_t));
+  int count = 0;
+  int verifiedCount = 0;
+
+  reach(reached, pending, &count, 0);
+  reach(reached, pending, &count, vm->_programCounter);
+
+  while (count > 0) {
+    uint16_t pc = pending[--count];
+    MicroOp **page = &vm->_decode.pages[pc >> 8];
+    MicroOp u;
+
+    if (!*page) {
+      *page = calloc(DECODE_PAGE_SIZE, sizeof(MicroOp));
+    }
+
+    decodeSingle(vm, pc, &u);
+
+    if (u.op == UOP_BAD_REGISTER || u.op == UOP_UNKNOWN) {
+      continue;
+    }
+
+    verified[verifiedCount++] = pc;
+
+    if (fallsThrough(u.op)) {
+      reach(reached, pending, &count, pc + u.len);
+    }
+
+    if (jumps(u.op)) {
+      reach(reached, pending, &count, u.address);
+    }
+  }
+
+  // Decoded once the walk is done, fused as usual. Every instruction a fused
+  // record stands for was verified too, since each one leads to the next.
+  for (int i = 0; i < verifiedCount; i++) {
+    MicroOp *record = decode(vm, verified[i]);
+
+    record->verifiedOp = record->op;
+  }
+
+  vm->_verified = true;
+
+  free(reached);
+  free(pending);
+  free(verified);
+}
@@ -1,479 +1,1058 @@
 #include "vm.h"
 
+#include <fcntl.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aot.h"
+#include "machine.h"
+#include "record.h"
+#include "verify.h"
+
+// Register named by a decoded register operand
+#define REG(code) (vm->_registers[code])
+
+// Initializes everything besides the registers and memory
+static void initHost(VM *vm) {
+  initDecodeCache(&vm->_decode);
+  vm->_verified = false;
+
+  vm->_trace = NULL;
+  vm->_profile = NULL;
+  vm->_jit = NULL;
+  vm->_translation = NULL;
+  vm->_recording = NULL;
+
+  vm->_machine = NULL;
+  vm->_core = 0;
+  vm->_interrupt = false;
+
+  vm->_input = stdin;
+  vm->_output = stdout;
+  vm->_outputBuffer = NULL;
+  vm->_outputLen = 0;
+  vm->_mapped.fd = -1;
+  initFiles(&vm->_files);
+
+  vm->_budget = NO_BUDGET;
+  vm->_breakpoint = NO_BREAKPOINT;
+  vm->_state = STATUS_PAUSED;
+  vm->_fault = FAULT_NONE;
+  vm->_faultPc = 0;
+  vm->_faultValue = 0;
+  vm->_message[0] = '\0';
+}
 
-const char *RegisterNames[] = {
-    [R_SR] = "SR", [R_SP] = "SP", [R_PC] = "PC", [R_SC] = "SC", [R_G0] = "G0",
-    [R_G1] = "G1", [R_G2] = "G2", [R_G3] = "G3", [R_G4] = "G4", [R_G5] = "G5",
-    [R_G6] = "G6", [R_G7] = "G7", [R_G8] = "G8", [R_G9] = "G9", [R_G10] = "G10",
-};
-
-void initCpu(VM *vm, uint8_t *instructions) {
-  vm->_statusRegister = 0;
+void initCpu(VM *vm, const uint8_t *instructions) {
+  memset(vm->_registers, 0, sizeof(vm->_registers));
 
   // Stack Pointer must be greater than zero to detect stack underflow
-  vm->_stackPointer = 1;
+  vm->_registers[R_SP] = 1;
 
   vm->_programCounter = 0;
 
-  vm->_syscall = 0;
+  // The image is never written through these, every write goes to a copy
+  for (int i = 0; i < MEMORY_PAGES; i++) {
+    vm->_pages[i] = (uint8_t *)instructions + i * MEMORY_PAGE_SIZE;
+  }
+  memset(vm->_owned, 0, sizeof(vm->_owned));
 
-  memset(vm->_GP, 0, 11);
-  memcpy(vm->_memory, instructions, MEMORY_SIZE * sizeof(uint8_t));
+  initHost(vm);
 }
 
-static uint8_t cycle(VM *vm) {
-  if (vm->_programCounter > MEMORY_SIZE) {
-    printf("Maximum Instruction Length Exceeded.\n");
-    exit(-1);
+void attachCore(VM *vm, Machine *machine, uint8_t core) {
+  uint8_t stack = 0xF000 >> 8;
+
+  for (int i = 0; i < MEMORY_PAGES; i++) {
+    if (vm->_owned[i]) {
+      free(vm->_pages[i]);
+    }
+
+    vm->_pages[i] = machine->memory + i * MEMORY_PAGE_SIZE;
+    vm->_owned[i] = true;
   }
 
-  uint8_t a = vm->_memory[vm->_programCounter];
+  vm->_pages[stack] = malloc(MEMORY_PAGE_SIZE);
+  memcpy(vm->_pages[stack], machine->memory + stack * MEMORY_PAGE_SIZE,
+         MEMORY_PAGE_SIZE);
 
-  return vm->_memory[vm->_programCounter++];
+  vm->_machine = machine;
+  vm->_core = core;
 }
 
-static uint8_t *getRegister(VM *vm, uint8_t code) {
-  switch (code) {
-  case R_SR:
-    return &(vm->_statusRegister);
-  case R_SP:
-    return &(vm->_stackPointer);
-  case R_SC:
-    return &(vm->_syscall);
-  case R_PC:
-    printf("Cannot edit Program Counter.\n");
-    exit(-1);
-    return 0;
-  default:
-    if (code >= R_G10) {
-      printf("Unkown Register '%d'.\n", code);
-      exit(-1);
-    }
+// Returns whether page points into the memory of the CPU's machine rather
+// than being the CPU's own
+static bool sharedPage(VM *vm, int page) {
+  return vm->_machine &&
+         vm->_pages[page] == vm->_machine->memory + page * MEMORY_PAGE_SIZE;
+}
+
+// Maps the file open in file->fd, returns false if it cannot be mapped
+static bool mapFile(MappedFile *file) {
+  struct stat st;
 
-    return &(vm->_GP[code - R_G0]);
+  file->data = NULL;
+  file->size = 0;
+
+  if (fstat(file->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return false;
   }
-}
 
-static void push(VM *vm, uint8_t val) {
-  if (vm->_stackPointer == 255) {
-    printf("Stack Overflow.\n");
-    exit(-1);
+  if (st.st_size == 0) {
+    return true;
   }
 
-  vm->_memory[0xF000 + vm->_stackPointer++] = val;
-}
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
 
-static uint8_t pop(VM *vm) {
-  if (vm->_stackPointer == 0) {
-    printf("Stack Underflow.\n");
-    exit(-1);
-    return 0;
+  if (data == MAP_FAILED) {
+    return false;
   }
 
-  return vm->_memory[0xF000 + --vm->_stackPointer];
+  file->data = data;
+  file->size = st.st_size;
+  return true;
 }
 
-void run(VM *vm) {
-  while (true) {
-    uint8_t op = cycle(vm);
+static void unmapFile(MappedFile *file) {
+  if (file->data) {
+    munmap((void *)file->data, file->size);
+    file->data = NULL;
+  }
 
-    switch (op) {
-    case OP_ADD: {
-      uint8_t *reg = getRegister(vm, cycle(vm));
-      uint8_t operand2 = cycle(vm);
+  if (file->fd >= 0) {
+    close(file->fd);
+    file->fd = -1;
+  }
+}
 
-#ifdef DEBUG
-      printf("ADD %d TO %s RESULT %d\n", operand2,
-             RegisterNames[vm->_memory[vm->_programCounter - 2]],
-             *reg + operand2);
-#endif
+// Points the mapping at the file called name, or returns false if it cannot
+// be mapped. The mapping is reused while the file keeps its size; one that
+// changed size is mapped again, so reads never reach past its end.
+static bool openMapped(MappedFile *file, const char *name) {
+  struct stat st;
 
-      *reg += operand2;
-      break;
+  if (file->fd >= 0 && strcmp(file->name, name) == 0) {
+    if (fstat(file->fd, &st) == 0 && (size_t)st.st_size == file->size) {
+      return true;
     }
-    case OP_SUB: {
-      uint8_t *reg = getRegister(vm, cycle(vm));
-      uint8_t operand2 = cycle(vm);
-
-#ifdef DEBUG
-      printf("SUB %d FROM %s RESULT %d\n", operand2,
-             RegisterNames[vm->_memory[vm->_programCounter - 2]],
-             *reg - operand2);
-#endif
 
-      *reg -= operand2;
-      break;
+    if (file->data) {
+      munmap((void *)file->data, file->size);
     }
-    case OP_LD: {
-      uint8_t *reg = getRegister(vm, cycle(vm));
+  } else {
+    unmapFile(file);
 
-      uint16_t address = cycle(vm);
-      address += cycle(vm) << 8;
+    if ((file->fd = open(name, O_RDONLY)) < 0) {
+      return false;
+    }
 
-#ifdef DEBUG
-      printf("LOAD %d FROM 0x%02X TO %s\n", vm->_memory[address], address,
-             RegisterNames[vm->_memory[vm->_programCounter - 3]]);
-#endif
+    snprintf(file->name, sizeof(file->name), "%s", name);
+  }
 
-      *reg = vm->_memory[address];
-      break;
-    }
-    case OP_MV: {
-      uint8_t val = *getRegister(vm, cycle(vm));
+  if (!mapFile(file)) {
+    unmapFile(file);
+    return false;
+  }
 
-      *getRegister(vm, cycle(vm)) = val;
+  return true;
+}
 
-#ifdef DEBUG
-      printf("LOAD %d FROM %s TO %s\n", val,
-             RegisterNames[vm->_programCounter - 2],
-             RegisterNames[vm->_programCounter - 1]);
-#endif
-      break;
+void freeCpu(VM *vm) {
+  for (int i = 0; i < MEMORY_PAGES; i++) {
+    if (vm->_owned[i] && !sharedPage(vm, i)) {
+      free(vm->_pages[i]);
     }
-    case OP_JMP: {
-      uint16_t address = cycle(vm) + (cycle(vm) << 8);
+  }
 
-      push(vm, vm->_programCounter);
-      push(vm, (vm->_programCounter) >> 8);
+  freeDecodeCache(&vm->_decode);
+  free(vm->_outputBuffer);
+  unmapFile(&vm->_mapped);
+  freeFiles(&vm->_files);
+}
 
-#ifdef DEBUG
-      printf("JMP FROM %d TO %d\n", vm->_programCounter, address);
-#endif
+// Returns the decoded instruction at the program counter, decoding it on the
+// first visit. The program counter is 16 bits wide, so it wraps instead of
+// running past the end of memory and no bounds check is needed here.
+static inline const MicroOp *fetch(VM *vm) {
+  uint16_t pc = vm->_programCounter;
+  MicroOp *page = vm->_decode.pages[pc >> 8];
 
-      vm->_programCounter = address;
-      break;
-    }
-    case OP_ADDR: {
-      uint8_t *dest = getRegister(vm, cycle(vm));
-      uint8_t *add = getRegister(vm, cycle(vm));
-
-#ifdef DEBUG
-      printf("ADD %d FROM %s TO %d FROM %s\n", *add,
-             RegisterNames[vm->_memory[vm->_programCounter - 1]], *dest,
-             RegisterNames[vm->_memory[vm->_programCounter - 2]]);
-#endif
+  if (page && page[pc & 0xFF].op) {
+    return &page[pc & 0xFF];
+  }
 
-      *dest += *add;
-      break;
-    }
-    case OP_SUBR: {
-      uint8_t *dest = getRegister(vm, cycle(vm));
-      uint8_t *sub = getRegister(vm, cycle(vm));
-
-#ifdef DEBUG
-      printf("SUB %d FROM %s TO %d FROM %s\n", *sub,
-             RegisterNames[vm->_memory[vm->_programCounter - 1]], *dest,
-             RegisterNames[vm->_memory[vm->_programCounter - 2]]);
-#endif
+  return decode(vm, pc);
+}
 
-      *dest -= *sub;
-      break;
-    }
-    case OP_XOR: {
-      uint8_t *dest = getRegister(vm, cycle(vm));
-      uint8_t * xor = getRegister(vm, cycle(vm));
-
-#ifdef DEBUG
-      printf("XOR %d FROM %s TO %d FROM %s\n", *xor,
-             RegisterNames[vm->_memory[vm->_programCounter - 1]], *dest,
-             RegisterNames[vm->_memory[vm->_programCounter - 2]]);
-#endif
+// Returns whether the record at pc is one the verifier decoded and nothing
+// rewrote since
+static inline bool verifiedAt(const VM *vm, uint16_t pc) {
+  const MicroOp *page = vm->_decode.pages[pc >> 8];
 
-      *dest ^= *xor;
-      break;
-    }
-    case OP_AND: {
-      uint8_t *dest = getRegister(vm, cycle(vm));
-      uint8_t *and = getRegister(vm, cycle(vm));
-
-#ifdef DEBUG
-      printf("AND %d FROM %s TO %d FROM %s\n", *and,
-             RegisterNames[vm->_memory[vm->_programCounter - 1]], *dest,
-             RegisterNames[vm->_memory[vm->_programCounter - 2]]);
-#endif
+  return page && page[pc & 0xFF].verifiedOp;
+}
 
-      *dest &= *and;
-      break;
-    }
-    case OP_OR: {
-      uint8_t *dest = getRegister(vm, cycle(vm));
-      uint8_t * or = getRegister(vm, cycle(vm));
-
-#ifdef DEBUG
-      printf("OR %d FROM %s TO %d FROM %s\n", * or,
-             RegisterNames[vm->_memory[vm->_programCounter - 1]], *dest,
-             RegisterNames[vm->_memory[vm->_programCounter - 2]]);
-#endif
+// Drops decoded and compiled code translated from the written bytes
+static void invalidateCode(VM *vm, uint16_t address, int len) {
+  invalidateDecode(&vm->_decode, address, len);
 
-      *dest |= * or ;
-      break;
-    }
-    case OP_NAND: {
-      uint8_t *dest = getRegister(vm, cycle(vm));
-      uint8_t *nand = getRegister(vm, cycle(vm));
-
-#ifdef DEBUG
-      printf("NAND %d FROM %s TO %d FROM %s\n", *nand,
-             RegisterNames[vm->_memory[vm->_programCounter - 1]], *dest,
-             RegisterNames[vm->_memory[vm->_programCounter - 2]]);
-#endif
+  if (vm->_jit) {
+    jitInvalidate(vm->_jit, address, len);
+  }
+
+  if (vm->_translation) {
+    translationWritten(vm, address, len);
+  }
+}
+
+// Returns the page holding address for writing, first copying it out of the
+// image if this VM does not have its own copy yet
+static uint8_t *writablePage(VM *vm, uint16_t address) {
+  uint8_t page = address >> 8;
+
+  if (!vm->_owned[page]) {
+    uint8_t *copy = malloc(MEMORY_PAGE_SIZE);
+
+    memcpy(copy, vm->_pages[page], MEMORY_PAGE_SIZE);
+    vm->_pages[page] = copy;
+    vm->_owned[page] = true;
+  }
+
+  return vm->_pages[page];
+}
+
+// Returns how many of the len bytes from address lie in its page
+static int pageChunk(uint16_t address, int len) {
+  int left = MEMORY_PAGE_SIZE - (address & 0xFF);
+
+  return len < left ? len : left;
+}
+
+// Every write to memory goes through here so stale decoded instructions are
+// dropped when a program rewrites its own code
+static inline void writeByte(VM *vm, uint16_t address, uint8_t val) {
+  uint8_t *page = vm->_pages[address >> 8];
+
+  if (!vm->_owned[address >> 8]) {
+    page = writablePage(vm, address);
+  }
+  page[address & 0xFF] = val;
+
+  if (vm->_decode.pages[address >> 8] ||
+      vm->_decode.pages[(uint16_t)(address - MAX_RECORD_LEN + 1) >> 8]) {
+    invalidateCode(vm, address, 1);
+  }
+}
+
+// Returns the byte at address for an atomic read-modify-write, which may
+// rewrite decoded code like any other write
+static inline uint8_t *atomicByte(VM *vm, uint16_t address) {
+  uint8_t *page = vm->_pages[address >> 8];
+
+  if (!vm->_owned[address >> 8]) {
+    page = writablePage(vm, address);
+  }
 
-      *dest = ~(*dest & *nand);
-      break;
+  if (vm->_decode.pages[address >> 8] ||
+      vm->_decode.pages[(uint16_t)(address - MAX_RECORD_LEN + 1) >> 8]) {
+    invalidateCode(vm, address, 1);
+  }
+
+  return page + (address & 0xFF);
+}
+
+void storeByte(VM *vm, uint16_t address, uint8_t val) {
+  writeByte(vm, address, val);
+}
+
+// Block transfers wrap around the end of memory like the program counter
+
+static void writeBlock(VM *vm, uint16_t address, const void *src, int len) {
+  const uint8_t *bytes = src;
+
+  for (int done = 0; done < len;) {
+    uint16_t at = address + done;
+    int chunk = pageChunk(at, len - done);
+
+    memcpy(writablePage(vm, at) + (at & 0xFF), bytes + done, chunk);
+    done += chunk;
+  }
+
+  invalidateCode(vm, address, len);
+}
+
+static void fillBlock(VM *vm, uint16_t address, uint8_t val, int len) {
+  for (int done = 0; done < len;) {
+    uint16_t at = address + done;
+    int chunk = pageChunk(at, len - done);
+
+    memset(writablePage(vm, at) + (at & 0xFF), val, chunk);
+    done += chunk;
+  }
+
+  invalidateCode(vm, address, len);
+}
+
+static void readBlock(VM *vm, uint16_t address, void *dest, int len) {
+  uint8_t *bytes = dest;
+
+  for (int done = 0; done < len;) {
+    uint16_t at = address + done;
+    int chunk = pageChunk(at, len - done);
+
+    memcpy(bytes + done, vm->_pages[at >> 8] + (at & 0xFF), chunk);
+    done += chunk;
+  }
+}
+
+// Copies with memmove semantics: the destination ends up holding what the
+// source held before the copy, however the two overlap. A page at a time
+// goes through a buffer, back to front when the destination starts inside
+// the source so no byte is overwritten before it is read.
+static void copyBlock(VM *vm, uint16_t dest, uint16_t src, int len) {
+  uint8_t buffer[MEMORY_PAGE_SIZE];
+  bool backwards = (uint16_t)(dest - src) < len;
+
+  if (dest == src) {
+    return;
+  }
+
+  for (int done = 0; done < len;) {
+    int chunk = len - done < MEMORY_PAGE_SIZE ? len - done : MEMORY_PAGE_SIZE;
+    int at = backwards ? len - done - chunk : done;
+
+    readBlock(vm, src + at, buffer, chunk);
+    writeBlock(vm, dest + at, buffer, chunk);
+    done += chunk;
+  }
+}
+
+void copyMemory(VM *vm, uint16_t dest, uint16_t src, int len) {
+  copyBlock(vm, dest, src, len);
+}
+
+void fillMemory(VM *vm, uint16_t address, uint8_t val, int len) {
+  fillBlock(vm, address, val, len);
+}
+
+static void flushOutput(VM *vm) {
+  if (vm->_outputLen > 0) {
+    fwrite(vm->_outputBuffer, sizeof(char), vm->_outputLen, vm->_output);
+    vm->_outputLen = 0;
+  }
+}
+
+// Appends at most OUTPUT_BUFFER_SIZE bytes of console output
+static void writeOutput(VM *vm, const void *bytes, size_t len) {
+  if (!vm->_outputBuffer) {
+    vm->_outputBuffer = malloc(OUTPUT_BUFFER_SIZE);
+  }
+
+  if (vm->_outputLen + len > OUTPUT_BUFFER_SIZE) {
+    flushOutput(vm);
+  }
+
+  memcpy(vm->_outputBuffer + vm->_outputLen, bytes, len);
+  vm->_outputLen += len;
+}
+
+// Prints the string at address straight from guest memory. It ends at its
+// terminator or after max bytes, whichever comes first.
+static void printString(VM *vm, uint16_t address, int max) {
+  for (int done = 0; done < max;) {
+    uint16_t at = address + done;
+    int chunk = pageChunk(at, max - done);
+    const uint8_t *bytes = vm->_pages[at >> 8] + (at & 0xFF);
+    const uint8_t *end = memchr(bytes, '\0', chunk);
+
+    writeOutput(vm, bytes, end ? end - bytes : chunk);
+
+    if (end) {
+      return;
     }
-    case OP_NOT: {
-      uint8_t *dest = getRegister(vm, cycle(vm));
 
-#ifdef DEBUG
-      printf("NOT %d FROM %s\n", *dest,
-             RegisterNames[vm->_memory[vm->_programCounter - 1]]);
-#endif
+    done += chunk;
+  }
+}
+
+static void loadRegisters(VM *vm, const Snapshot *snapshot) {
+  memcpy(vm->_registers, snapshot->registers, sizeof(vm->_registers));
+  vm->_programCounter = snapshot->programCounter;
+}
+
+void snapshotCpu(VM *vm, Snapshot *snapshot) {
+  memcpy(snapshot->registers, vm->_registers, sizeof(snapshot->registers));
+  snapshot->programCounter = vm->_programCounter;
 
-      *dest = ~*dest;
-      break;
+  memcpy(snapshot->pages, vm->_pages, sizeof(snapshot->pages));
+  memcpy(snapshot->owned, vm->_owned, sizeof(snapshot->owned));
+
+  // The next write to any page copies it, leaving the snapshot's intact
+  memset(vm->_owned, 0, sizeof(vm->_owned));
+}
+
+int restoreCpu(VM *vm, const Snapshot *snapshot) {
+  int dirty = 0;
+
+  loadRegisters(vm, snapshot);
+
+  // A page still shared with the snapshot cannot have been written since
+  for (int i = 0; i < MEMORY_PAGES; i++) {
+    if (vm->_pages[i] == snapshot->pages[i]) {
+      continue;
     }
-    case OP_SHFT: {
-      // Heads up, shift amount is offset by 8. so 0 shifts 8 to the right and
-      // 16 shifts 8 to the left
-      uint8_t *dest = getRegister(vm, cycle(vm));
-      uint8_t *amount = getRegister(vm, cycle(vm));
-
-#ifdef DEBUG
-      printf("SHIFT %d AT %s %d\n", *dest,
-             RegisterNames[vm->_memory[vm->_programCounter]], *amount);
-#endif
 
-      *dest <<= (int)*amount - 8;
-      break;
+    if (vm->_owned[i]) {
+      free(vm->_pages[i]);
     }
-    case OP_ST: {
-      uint8_t *reg = getRegister(vm, cycle(vm));
-      uint16_t address = cycle(vm) + (cycle(vm) << 8);
 
-#ifdef DEBUG
-      printf("STORE %d FROM %s TO ADDRESS 0x%04X\n", *reg,
-             RegisterNames[vm->_memory[vm->_programCounter - 3]], address);
-#endif
+    vm->_pages[i] = snapshot->pages[i];
+    vm->_owned[i] = false;
+    invalidateCode(vm, i * MEMORY_PAGE_SIZE, MEMORY_PAGE_SIZE);
+    dirty++;
+  }
 
-      vm->_memory[address] = *reg;
-      break;
-    }
-    case OP_RET: {
-      uint16_t address = (pop(vm) << 8) + pop(vm);
+  return dirty;
+}
 
-#ifdef DEBUG
-      printf("MOV TO ADDRESS 0x%04X\n", address);
-#endif
+void forkCpu(VM *vm, const Snapshot *snapshot) {
+  loadRegisters(vm, snapshot);
+
+  memcpy(vm->_pages, snapshot->pages, sizeof(vm->_pages));
+  memset(vm->_owned, 0, sizeof(vm->_owned));
+
+  initHost(vm);
+}
 
-      vm->_programCounter = address;
-      break;
+void freeSnapshot(Snapshot *snapshot) {
+  for (int i = 0; i < MEMORY_PAGES; i++) {
+    if (snapshot->owned[i]) {
+      free(snapshot->pages[i]);
     }
-    case OP_CMP: {
-      vm->_statusRegister = 0;
+  }
+}
+
+// Ends the program with fault, FAULT_NONE when it halted, raised by the
+// instruction at pc. The trace is written out and the final message kept for
+// the host, then run() returns.
+static void stop(VM *vm, enum Fault fault, uint16_t pc, uint8_t value,
+                 const char *fmt, ...) {
+  if (vm->_trace) {
+    freeTrace(vm->_trace);
+    vm->_trace = NULL;
+  }
 
-      // Status register is 8 bits. Bit 1 (LSB) Zero Flag, Bit 2 is Negative
-      // Flag
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(vm->_message, sizeof(vm->_message), fmt, args);
+  va_end(args);
+
+  // A recorded syscall that faults is logged with its fault
+  if (vm->_recording && vm->_recording->inCall) {
+    SyscallRecord *record = vm->_recording->record;
+
+    record->call = vm->_registers[R_SC];
+    record->fault = fault;
+    record->value = value;
+    memcpy(record->message, vm->_message, sizeof(record->message));
+    writeRecord(vm->_recording, record);
+    vm->_recording->inCall = false;
+  }
 
-      uint8_t operand1 = cycle(vm);
-      uint8_t operand2 = cycle(vm);
+  vm->_state = fault == FAULT_NONE ? STATUS_HALTED : STATUS_FAULTED;
+  vm->_fault = fault;
+  vm->_faultPc = pc;
+  vm->_faultValue = value;
+  longjmp(vm->_stopped, 1);
+}
 
-      if (operand2 > operand1) {
-        vm->_statusRegister |= 2;
-      } else if (operand2 == operand1) {
-        vm->_statusRegister |= 1;
-      }
+// Returns from run() before the instruction at the program counter, which is
+// where the next run() picks up
+static void suspend(VM *vm, enum VMStatus state) {
+  if (vm->_trace) {
+    flushTrace(vm->_trace);
+  }
 
-#ifdef DEBUG
-      printf("CMP, STATE %d\n", vm->_statusRegister);
-#endif
+  vm->_state = state;
+  longjmp(vm->_stopped, 1);
+}
 
-      break;
-    }
-    case OP_JE: {
-      uint16_t address = cycle(vm) + (cycle(vm) << 8);
+// Returns false on overflow
+static inline bool push(VM *vm, uint8_t val) {
+  if (vm->_registers[R_SP] == 255) {
+    return false;
+  }
 
-#ifdef DEBUG
-      printf("JUMP IF EQUAL, TO ADDRESS 0x%04X\n", address);
-#endif
-      // Means bit 1 is 1 so zero flag is set
-      if (vm->_statusRegister == 1) {
-        push(vm, vm->_programCounter);
-        push(vm, (vm->_programCounter) >> 8);
-        vm->_programCounter = address;
-      }
+  writeByte(vm, 0xF000 + vm->_registers[R_SP]++, val);
+  return true;
+}
+
+// Returns false on underflow
+static inline bool pop(VM *vm, uint8_t *val) {
+  if (vm->_registers[R_SP] == 0) {
+    return false;
+  }
+
+  *val = readByte(vm, 0xF000 + --vm->_registers[R_SP]);
+  return true;
+}
+
+// Pushes the return address the jumps leave behind, the program counter low
+// byte first
+static inline bool pushLink(VM *vm) {
+  return push(vm, vm->_programCounter) && push(vm, vm->_programCounter >> 8);
+}
+
+
+// Maps the file named in FILENAME_BUFFER for reading, stopping the program if
+// it cannot be
+static const MappedFile *mappedInput(VM *vm) {
+  char filename[0x100] = {'\0'};
+  readBlock(vm, FILENAME_BUFFER, filename, sizeof(filename) - 1);
+
+  if (!openMapped(&vm->_mapped, filename)) {
+    stop(vm, FAULT_FILE, vm->_programCounter - 1, 0,
+         "Cannot open file '%s'.\n", filename);
+  }
+
+  return &vm->_mapped;
+}
+
+// Syscall arguments passed in several registers, lowest byte first
+
+static uint32_t guestOffset(VM *vm) {
+  uint8_t *gp = vm->_registers + R_G0;
+
+  return gp[0] | gp[1] << 8 | gp[2] << 16 | (uint32_t)gp[3] << 24;
+}
+
+static void setGuestOffset(VM *vm, uint32_t offset) {
+  for (int i = 0; i < 4; i++) {
+    vm->_registers[R_G0 + i] = offset >> (8 * i);
+  }
+}
+
+// Returns the requested length, capped at BUFFER_MAX
+static int guestLength(VM *vm) {
+  int len = vm->_registers[R_G4] | vm->_registers[R_G5] << 8;
+
+  return len < BUFFER_MAX ? len : BUFFER_MAX;
+}
 
-      break;
+static void setGuestLength(VM *vm, int len) {
+  vm->_registers[R_G4] = len;
+  vm->_registers[R_G5] = len >> 8;
+}
+
+// Returns the handle in G6, stopping the program if no file is open under it
+static uint8_t guestHandle(VM *vm) {
+  uint8_t handle = vm->_registers[R_G6];
+
+  if (!validHandle(&vm->_files, handle)) {
+    stop(vm, FAULT_FILE, vm->_programCounter - 1, handle,
+         "Bad file handle %d.\n", handle);
+  }
+
+  return handle;
+}
+
+static void performCall(VM *vm) {
+  switch (vm->_registers[R_SC]) {
+  case CALL_PRINT: {
+    // Keep trace lines ahead of the program's own output, and its output
+    // ahead of the trace lines that follow
+    if (vm->_trace) {
+      flushTrace(vm->_trace);
     }
-    case OP_JNE: {
-      uint16_t address = cycle(vm) + (cycle(vm) << 8);
 
-#ifdef DEBUG
-      printf("JUMP IF NOT EQUAL, TO ADDRESS 0x%04X\n", address);
-#endif
-      // Means Zero flag is not set so cannot be equal
-      if (vm->_statusRegister != 1) {
-        push(vm, vm->_programCounter);
-        push(vm, (vm->_programCounter) >> 8);
-        vm->_programCounter = address;
-      }
+    printString(vm, PRINT_BUFFER, 0x1000);
 
-      break;
+    if (vm->_trace) {
+      flushOutput(vm);
     }
-    case OP_JG: {
-      uint16_t address = cycle(vm) + (cycle(vm) << 8);
+    break;
+  }
+  case CALL_PCLEAR: {
+    fillBlock(vm, PRINT_BUFFER, '\0', 0x1000);
+    break;
+  }
+  case CALL_FREAD: {
+    // The start of the file, the rest of the window cleared
+    const MappedFile *file = mappedInput(vm);
+    int len = file->size < BUFFER_MAX ? file->size : BUFFER_MAX;
+
+    writeBlock(vm, INPUT_BUFFER, file->data, len);
+    fillBlock(vm, INPUT_BUFFER + len, '\0', BUFFER_MAX - len);
+    break;
+  }
+  case CALL_FWRITE: {
+    char filename[0x100] = {'\0'};
+    readBlock(vm, FILENAME_BUFFER, filename, sizeof(filename) - 1);
 
-#ifdef DEBUG
-      printf("JUMP IF GREATER, TO ADDRESS 0x%04X\n", address);
-#endif
-      // Neither bit is set which means it isnt zero and isnt less
-      if (vm->_statusRegister == 0) {
-        push(vm, vm->_programCounter);
-        push(vm, (vm->_programCounter) >> 8);
-        vm->_programCounter = address;
-      }
+    FILE *fptr;
+
+    fptr = fopen(filename, "w");
 
-      break;
+    if (!fptr) {
+      stop(vm, FAULT_FILE, vm->_programCounter - 1, 0,
+           "Could not write to file '%s'.\n", filename);
     }
-    case OP_JL: {
-      uint16_t address = cycle(vm) + (cycle(vm) << 8);
 
-#ifdef DEBUG
-      printf("JUMP IF LESS, TO ADDRESS 0x%04X\n", address);
-#endif
-      // Means negative flag is set
-      if (vm->_statusRegister == 2) {
-        push(vm, vm->_programCounter);
-        push(vm, (vm->_programCounter) >> 8);
-        vm->_programCounter = address;
+    char buf[BUFFER_MAX] = {'\0'};
+
+    readBlock(vm, INPUT_BUFFER, buf, BUFFER_MAX);
+
+    fwrite(buf, sizeof(char), BUFFER_MAX, fptr);
+
+    fclose(fptr);
+    break;
+  }
+  case CALL_CREAD: {
+    char buf[BUFFER_MAX] = {'\0'};
+
+    // A prompt printed before reading must be visible
+    flushOutput(vm);
+
+    fscanf(vm->_input, "%4095s", buf);
+
+    writeBlock(vm, 0, buf, BUFFER_MAX);
+    break;
+  }
+  case CALL_ICLEAR: {
+    fillBlock(vm, 0, '\0', BUFFER_MAX);
+    break;
+  }
+  case CALL_FREADAT: {
+    const MappedFile *file = mappedInput(vm);
+    size_t offset = guestOffset(vm);
+    int len = guestLength(vm);
+
+    if (offset >= file->size) {
+      len = 0;
+    } else {
+      if ((size_t)len > file->size - offset) {
+        len = file->size - offset;
       }
 
-      break;
+      writeBlock(vm, INPUT_BUFFER, file->data + offset, len);
     }
-    case OP_PUSH: {
-      uint8_t val = cycle(vm);
-      push(vm, val);
 
-#ifdef DEBUG
-      printf("PUSH %d TO STACK\n", val);
-#endif
+    setGuestLength(vm, len);
+    break;
+  }
+  case CALL_OPEN: {
+    char filename[0x100] = {'\0'};
+    readBlock(vm, FILENAME_BUFFER, filename, sizeof(filename) - 1);
+
+    uint8_t mode = vm->_registers[R_G7];
 
-      break;
+    vm->_registers[R_G6] =
+        mode <= FILE_APPEND ? openHandle(&vm->_files, filename, mode) : 0;
+    break;
+  }
+  case CALL_READ: {
+    uint8_t handle = guestHandle(vm);
+    char buf[BUFFER_MAX];
+    int len = readHandle(&vm->_files, handle, buf, guestLength(vm));
+
+    writeBlock(vm, INPUT_BUFFER, buf, len);
+    setGuestLength(vm, len);
+    break;
+  }
+  case CALL_WRITE: {
+    uint8_t handle = guestHandle(vm);
+    int len = guestLength(vm);
+    bool written = true;
+
+    // Straight from guest memory, one page at a time
+    for (int done = 0; done < len;) {
+      uint16_t at = INPUT_BUFFER + done;
+      int chunk = pageChunk(at, len - done);
+
+      written &= writeHandle(&vm->_files, handle,
+                             vm->_pages[at >> 8] + (at & 0xFF), chunk);
+      done += chunk;
     }
-    case OP_POP: {
-      uint8_t val = cycle(vm);
-      push(vm, val);
 
-#ifdef DEBUG
-      printf("PUSH %d TO STACK\n", val);
-#endif
+    setGuestLength(vm, written ? len : 0);
+    break;
+  }
+  case CALL_SEEK: {
+    uint8_t handle = guestHandle(vm);
+    uint8_t whence = vm->_registers[R_G7];
+    int64_t position = -1;
+
+    if (whence <= 2) {
+      position = seekHandle(&vm->_files, handle, (int32_t)guestOffset(vm),
+                            whence == 0   ? SEEK_SET
+                            : whence == 1 ? SEEK_CUR
+                                          : SEEK_END);
+    }
 
-      break;
+    setGuestOffset(vm, position >= 0 ? position : UINT32_MAX);
+    break;
+  }
+  case CALL_CLOSE: {
+    closeHandle(&vm->_files, guestHandle(vm));
+    break;
+  }
+  case CALL_CORE: {
+    vm->_registers[R_G0] = vm->_core;
+    vm->_registers[R_G1] = vm->_machine ? vm->_machine->count : 1;
+    break;
+  }
+  case CALL_JOIN: {
+    Machine *machine = vm->_machine;
+    uint8_t core = vm->_registers[R_G0];
+
+    // Back in front of the call, so it runs again once the host resumes
+    if (machine && core != vm->_core && core < machine->count &&
+        !coreFinished(machine, core)) {
+      vm->_programCounter--;
+      suspend(vm, STATUS_WAITING);
     }
-    case OP_CALL: {
-      switch (vm->_syscall) {
-      case CALL_PRINT: {
-#ifdef DEBUG
-        printf("SYSCALL PRINT\n");
-#endif
-        char buf[0x1000] = {'\0'};
-        memcpy(buf, vm->_memory + PRINT_BUFFER, sizeof(buf));
-        printf("%s", buf);
-        break;
-      }
-      case CALL_PCLEAR: {
-#ifdef DEBUG
-        printf("SYSCALL PCLEAR\n");
-#endif
-        memset(vm->_memory + PRINT_BUFFER, '\0', 0x1000);
-        break;
-      }
-      case CALL_FREAD: {
-#ifdef DEBUG
-        printf("SYSCALL FREAD\n");
-#endif
-        char *filename = (char *)vm->_memory + FILENAME_BUFFER;
+    break;
+  }
+  default: {
+    const char *message = "Nothing in syscall register.\n";
+    writeOutput(vm, message, strlen(message));
+  }
+  }
+}
 
-        FILE *fptr = fopen(filename, "r");
+// Whether the syscall reaches the console or the file system, the ones a
+// recording logs
+static bool hostCall(uint8_t call) {
+  switch (call) {
+  case CALL_FREAD:
+  case CALL_FWRITE:
+  case CALL_CREAD:
+  case CALL_FREADAT:
+  case CALL_OPEN:
+  case CALL_READ:
+  case CALL_WRITE:
+  case CALL_SEEK:
+  case CALL_CLOSE:
+    return true;
+  default:
+    return false;
+  }
+}
 
-        if (!fptr) {
-          printf("Cannot open file '%s'.\n", filename);
-          exit(-1);
-        }
+// Returns how many bytes the syscall that just returned wrote from address
+static int callWrites(VM *vm, uint8_t call, uint16_t *address) {
+  switch (call) {
+  case CALL_CREAD:
+    *address = 0;
+    return BUFFER_MAX;
+  case CALL_FREAD:
+    *address = INPUT_BUFFER;
+    return BUFFER_MAX;
+  case CALL_FREADAT:
+  case CALL_READ:
+    *address = INPUT_BUFFER;
+    return guestLength(vm);
+  default:
+    *address = 0;
+    return 0;
+  }
+}
 
-        fseek(fptr, 0, SEEK_END);
+// Runs the syscall on the host and logs what it did to the guest. One that
+// faults is logged by stop().
+static void recordCall(VM *vm) {
+  Recording *recording = vm->_recording;
+  SyscallRecord *record = recording->record;
+  uint8_t call = vm->_registers[R_SC];
 
-        int size = ftell(fptr);
-        rewind(fptr);
+  recording->inCall = true;
+  performCall(vm);
+  recording->inCall = false;
 
-        char *buf = malloc((size + 1) * sizeof(char));
+  record->call = call;
+  record->fault = FAULT_NONE;
+  memcpy(record->GP, vm->_registers + R_G0, sizeof(record->GP));
 
-        memcpy(vm->_memory + INPUT_BUFFER, buf, size);
+  record->length = callWrites(vm, call, &record->address);
+  readBlock(vm, record->address, record->bytes, record->length);
 
-        free(buf);
+  // Trailing zeros are left to the replay to clear
+  record->stored = record->length;
+  while (record->stored > 0 && record->bytes[record->stored - 1] == 0) {
+    record->stored--;
+  }
 
-        fclose(fptr);
+  writeRecord(recording, record);
+}
 
-        break;
-      }
-      case CALL_FWRITE: {
-#ifdef DEBUG
-        printf("SYSCALL FWRITE\n");
-#endif
-        char *filename = (char *)vm->_memory + FILENAME_BUFFER;
+// Does what the logged syscall did, without touching the host
+static void replayCall(VM *vm) {
+  SyscallRecord *record = vm->_recording->record;
+  uint8_t call = vm->_registers[R_SC];
 
-        FILE *fptr;
+  if (!readRecord(vm->_recording, record)) {
+    stop(vm, FAULT_REPLAY, vm->_programCounter - 1, call,
+         "Replay log has no syscall %d.\n", call);
+  }
 
-        fptr = fopen(filename, "w");
+  if (record->call != call) {
+    stop(vm, FAULT_REPLAY, vm->_programCounter - 1, call,
+         "Replay log holds syscall %d, not %d.\n", record->call, call);
+  }
 
-        if (!fptr) {
-          printf("Could not write to file '%s'.\n", filename);
-        }
+  if (record->fault != FAULT_NONE) {
+    stop(vm, record->fault, vm->_programCounter - 1, record->value, "%s",
+         record->message);
+  }
 
-        char buf[BUFFER_MAX] = {'\0'};
+  memcpy(vm->_registers + R_G0, record->GP, sizeof(record->GP));
+  writeBlock(vm, record->address, record->bytes, record->stored);
+  fillBlock(vm, record->address + record->stored, '\0',
+            record->length - record->stored);
+}
 
-        memcpy(buf, vm->_memory + INPUT_BUFFER, BUFFER_MAX);
+static void systemCall(VM *vm) {
+  if (vm->_recording && hostCall(vm->_registers[R_SC])) {
+    if (vm->_recording->replaying) {
+      replayCall(vm);
+    } else {
+      recordCall(vm);
+    }
+    return;
+  }
 
-        fwrite(buf, sizeof(char), BUFFER_MAX, fptr);
+  performCall(vm);
+}
 
-        fclose(fptr);
-        break;
-      }
-      case CALL_CREAD: {
-#ifdef DEBUG
-        printf("SYSCALL CREAD\n");
-#endif
-        char buf[BUFFER_MAX];
+// Address a load or store goes to, which for the register indirect and
+// indexed forms depends on the registers
+static uint16_t operandAddress(VM *vm, const MicroOp *u) {
+  switch (u->op) {
+  case OP_LDR:
+  case OP_STR:
+    return (REG(u->b + 1) << 8) | REG(u->b);
+  case OP_LDX:
+  case OP_STX:
+    return u->address + REG(u->b);
+  default:
+    return u->address;
+  }
+}
 
-        scanf("%s", buf);
+// Fetches the next instruction for the checked loop, which honours the trace,
+// the budget and the breakpoint. A fused record that would run past the
+// budget or the breakpoint is swapped for its first instruction, decoded into
+// single, so both land exactly.
+static inline const MicroOp *checkedFetch(VM *vm, MicroOp *single) {
+  uint16_t pc = vm->_programCounter;
+  const MicroOp *u = fetch(vm);
 
-        memcpy(vm->_memory, buf, BUFFER_MAX);
-        break;
-      }
-      case CALL_ICLEAR: {
-        memset(vm->_memory, '\0', BUFFER_MAX);
-        break;
-      }
-      default: {
-        printf("Nothing in syscall register.\n");
-      }
-      }
-      break;
+  if (vm->_breakpoint == pc && vm->_stepped) {
+    suspend(vm, STATUS_BREAK);
+  }
+
+  if (vm->_budget < u->count ||
+      (vm->_breakpoint != NO_BREAKPOINT &&
+       (uint16_t)(vm->_breakpoint - pc - 1) < u->len - 1)) {
+    if (vm->_budget == 0) {
+      suspend(vm, STATUS_PAUSED);
     }
-    case OP_HALT: {
-#ifdef DEBUG
-        printf("HALT\n");
+
+    decodeSingle(vm, pc, single);
+    u = single;
+  }
+
+  if (vm->_budget != NO_BUDGET) {
+    vm->_budget -= u->count;
+  }
+  vm->_stepped = true;
+
+  if (vm->_trace) {
+    traceInstruction(vm->_trace, vm->_registers, pc, u,
+                     readByte(vm, operandAddress(vm, u)));
+  }
+
+  if (vm->_profile) {
+    profileInstruction(vm->_profile, pc, u, vm->_registers[R_SP]);
+  }
+
+  return u;
+}
+
+#if defined(THREADED_DISPATCH) && defined(__GNUC__)
+#define USE_COMPUTED_GOTO
 #endif
-      printf("Program ran successfully.\n");
-      exit(0);
+
+#define RUN_LOOP runPlain
+#define CHECKED 0
+#define JITTED 0
+#define VERIFIED 0
+#define POLLED 0
+#include "interpret.inc"
+#undef RUN_LOOP
+#undef CHECKED
+#undef JITTED
+#undef VERIFIED
+#undef POLLED
+
+#define RUN_LOOP runVerified
+#define CHECKED 0
+#define JITTED 0
+#define VERIFIED 1
+#define POLLED 0
+#include "interpret.inc"
+#undef RUN_LOOP
+#undef CHECKED
+#undef JITTED
+#undef VERIFIED
+#undef POLLED
+
+#define RUN_LOOP runChecked
+#define CHECKED 1
+#define JITTED 0
+#define VERIFIED 0
+#define POLLED 0
+#include "interpret.inc"
+#undef RUN_LOOP
+#undef CHECKED
+#undef JITTED
+#undef VERIFIED
+#undef POLLED
+
+#define RUN_LOOP runJit
+#define CHECKED 0
+#define JITTED 1
+#define VERIFIED 0
+#define POLLED 0
+#include "interpret.inc"
+#undef RUN_LOOP
+#undef CHECKED
+#undef JITTED
+#undef VERIFIED
+#undef POLLED
+
+#define RUN_LOOP runJitChecked
+#define CHECKED 1
+#define JITTED 1
+#define VERIFIED 0
+#define POLLED 0
+#include "interpret.inc"
+#undef RUN_LOOP
+#undef CHECKED
+#undef JITTED
+#undef VERIFIED
+#undef POLLED
+
+#define RUN_LOOP runPlainPolled
+#define CHECKED 0
+#define JITTED 0
+#define VERIFIED 0
+#define POLLED 1
+#include "interpret.inc"
+#undef RUN_LOOP
+#undef CHECKED
+#undef JITTED
+#undef VERIFIED
+#undef POLLED
+
+#define RUN_LOOP runVerifiedPolled
+#define CHECKED 0
+#define JITTED 0
+#define VERIFIED 1
+#define POLLED 1
+#include "interpret.inc"
+#undef RUN_LOOP
+#undef CHECKED
+#undef JITTED
+#undef VERIFIED
+#undef POLLED
+
+#define RUN_LOOP runJitPolled
+#define CHECKED 0
+#define JITTED 1
+#define VERIFIED 0
+#define POLLED 1
+#include "interpret.inc"
+#undef RUN_LOOP
+#undef CHECKED
+#undef JITTED
+#undef VERIFIED
+#undef POLLED
+
+// Runs verified code on the verified loop and everything else on the plain
+// loop, which hand the program over to each other. The verifier walks the
+// program the first time. Machine cores run the variants polling _interrupt.
+static void runUnlimited(VM *vm) {
+  void (*verified)(VM *) = vm->_machine ? runVerifiedPolled : runVerified;
+  void (*plain)(VM *) = vm->_machine ? runPlainPolled : runPlain;
+
+  if (!vm->_verified) {
+    verifyCode(vm);
+  }
+
+  while (true) {
+    if (verifiedAt(vm, vm->_programCounter)) {
+      verified(vm);
     }
-    default:
-      printf("Unkown Command '%d'.\n", op);
-      exit(-1);
+
+    plain(vm);
+  }
+}
+
+enum VMStatus run(VM *vm, uint64_t budget) {
+  vm->_budget = budget;
+  vm->_stepped = false;
+
+  // Picked once here so the plain loop never checks for a trace, a budget or
+  // the JIT. Traced, profiled and runs towards a breakpoint are always
+  // interpreted so every instruction is seen; compiled blocks charge the
+  // budget themselves. The loops only leave through stop() and suspend(),
+  // but for the plain and verified loops handing over to each other.
+  if (!setjmp(vm->_stopped)) {
+    if (vm->_trace || vm->_profile || vm->_breakpoint != NO_BREAKPOINT) {
+      runChecked(vm);
+    } else if (vm->_jit && budget == NO_BUDGET && vm->_machine) {
+      runJitPolled(vm);
+    } else if (vm->_jit && budget == NO_BUDGET) {
+      runJit(vm);
+    } else if (vm->_jit) {
+      runJitChecked(vm);
+    } else if (budget == NO_BUDGET) {
+      runUnlimited(vm);
+    } else {
+      runChecked(vm);
     }
   }
+
+  // The host sees everything the program printed once run() returns
+  flushOutput(vm);
+
+  // Compiled code charges an unlimited budget as well
+  if (budget == NO_BUDGET) {
+    vm->_budget = NO_BUDGET;
+  }
+
+  return vm->_state;
+}
+
+void killCpu(VM *vm, const char *message) {
+  if (vm->_trace) {
+    freeTrace(vm->_trace);
+    vm->_trace = NULL;
+  }
+
+  snprintf(vm->_message, sizeof(vm->_message), "%s", message);
+
+  vm->_state = STATUS_FAULTED;
+  vm->_fault = FAULT_KILLED;
+  vm->_faultPc = vm->_programCounter;
+  vm->_faultValue = 0;
 }
@@ -0,0 +1,97 @@
+#ifndef AOT_H_
+#define AOT_H_
+
+// Runtime for programs translated to C ahead of time by gisc2c. The
+// translation runs the instructions it knows natively and hands everything
+// else, syscalls, faults and code it never saw, to the interpreter one
+// instruction at a time. Once the program rewrites any byte that was
+// translated, the interpreter runs the rest of it.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+// Register named by a decoded register operand, as in the interpreter
+#define AOT_REG(code) (vm->_registers[code])
+
+struct Translation {
+  // Image the program was translated from
+  const uint8_t *image;
+  // One bit per byte of the image translated
+  const uint8_t *covered;
+
+  // Runs translated code from the program counter and returns with the
+  // program counter on the first instruction it leaves to the interpreter
+  void (*run)(VM *vm);
+
+  // Set once a write changed a translated byte
+  bool stale;
+};
+
+typedef struct Translation Translation;
+
+// Runs the translated program on the console the way prog runs its image and
+// returns the exit status
+int runTranslation(Translation *translation);
+
+// Called for every write to memory holding decoded code, marks the
+// translation stale if the write changed a translated byte
+void translationWritten(VM *vm, uint16_t address, int len);
+
+// Stores like the interpreter. Returns false once the store made the
+// translation stale, the program then continues in the interpreter.
+static inline bool aotWrite(VM *vm, uint16_t address, uint8_t val) {
+  uint8_t page = address >> 8;
+
+  // Pages holding translated code have their decode pages allocated, so only
+  // plain data takes the short way
+  if (vm->_owned[page] && !vm->_decode.pages[page] &&
+      !vm->_decode.pages[(uint16_t)(address - MAX_RECORD_LEN + 1) >> 8]) {
+    vm->_pages[page][address & 0xFF] = val;
+    return true;
+  }
+
+  storeByte(vm, address, val);
+  return !vm->_translation->stale;
+}
+
+// The stack page is never translated, so pushes cannot make the translation
+// stale. Returns false when the stack is full.
+static inline bool aotPush(VM *vm, uint8_t val) {
+  if (vm->_registers[R_SP] == 255) {
+    return false;
+  }
+
+  aotWrite(vm, 0xF000 + vm->_registers[R_SP]++, val);
+  return true;
+}
+
+// Pushes the return address of a jump, or returns false without pushing
+// anything when both bytes do not fit. The interpreter then runs the jump and
+// raises the overflow exactly where it happens.
+static inline bool aotLink(VM *vm, uint16_t next) {
+  if (vm->_registers[R_SP] >= 254) {
+    return false;
+  }
+
+  aotPush(vm, next);
+  aotPush(vm, next >> 8);
+  return true;
+}
+
+// Pops a return address, or returns false without popping anything when the
+// stack holds less than one
+static inline bool aotReturn(VM *vm) {
+  if (vm->_registers[R_SP] < 2) {
+    return false;
+  }
+
+  uint8_t hi = readByte(vm, 0xF000 + --vm->_registers[R_SP]);
+  uint8_t lo = readByte(vm, 0xF000 + --vm->_registers[R_SP]);
+
+  vm->_programCounter = (hi << 8) + lo;
+  return true;
+}
+
+#endif
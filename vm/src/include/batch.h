@@ -0,0 +1,60 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// One run of the image, reading its console input from a file
+struct BatchInstance {
+  char *input;
+
+  // Everything the program printed, including the final status message
+  char *output;
+  size_t outputLen;
+
+  int status;
+  double seconds;
+};
+
+typedef struct BatchInstance BatchInstance;
+
+struct Batch {
+  const uint8_t *image;
+  bool jit;
+
+  // Watchdog limits for each instance, 0 for none, see Scheduler
+  uint64_t maxInstructions;
+  double timeout;
+
+  BatchInstance *instances;
+  int count;
+
+  // Wall time of the last runBatch
+  double seconds;
+};
+
+typedef struct Batch Batch;
+
+// Reads the input list, one input file per line with blank lines skipped.
+// Returns false if the list cannot be read.
+bool loadBatch(Batch *batch, const char *list, const uint8_t *image);
+
+// Runs every instance on threads worker threads, each with its own VM
+void runBatch(Batch *batch, int threads);
+
+// Runs every instance on the calling thread, time-slicing their VMs slice
+// instructions at a time. Interpreted only, the JIT setting is ignored.
+void runBatchSliced(Batch *batch, uint64_t slice);
+
+// Writes the output of instance i to dir/i.out, returns false on the first
+// file that cannot be written
+bool writeBatchOutput(Batch *batch, const char *dir);
+
+// Prints one line per instance followed by the totals
+void printBatchSummary(Batch *batch, FILE *out);
+
+void freeBatch(Batch *batch);
+
+#endif
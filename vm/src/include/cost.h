@@ -0,0 +1,33 @@
+#ifndef COST_H_
+#define COST_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Cycles charged when no cost table says otherwise
+#define DEFAULT_OP_CYCLES 1
+#define DEFAULT_MEMORY_CYCLES 1
+#define DEFAULT_BRANCH_CYCLES 2
+#define DEFAULT_SYSCALL_CYCLES 20
+
+// Modeled cycles of an instruction: its opcode's cost, plus memory for every
+// byte it reads or writes (stack links included), plus branch when it
+// transfers control and syscall for a call
+struct CostModel {
+  uint32_t ops[256];
+  uint32_t memory;
+  uint32_t branch;
+  uint32_t syscall;
+};
+
+typedef struct CostModel CostModel;
+
+void initCostModel(CostModel *costs);
+
+// Reads a cost table over the defaults, one 'NAME CYCLES' line each where
+// NAME is a mnemonic or one of memory, branch and syscall. Blank lines and
+// lines starting with '#' are skipped. Returns false, saying why, if the
+// table cannot be read.
+bool loadCostModel(CostModel *costs, const char *path);
+
+#endif
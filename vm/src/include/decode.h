@@ -0,0 +1,134 @@
+#ifndef DECODE_H_
+#define DECODE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Longest record in bytes, fused sequences included. A write to memory
+// invalidates every record that starts up to this many bytes before it.
+#define MAX_RECORD_LEN 10
+
+#define DECODE_PAGE_SIZE 256
+#define DECODE_PAGES 256
+
+// Internal opcodes produced by the decoder, never found in an image
+enum {
+  UOP_BAD_REGISTER = 0xF0,
+  UOP_UNKNOWN,
+  // add r, b; st r, address; subr r, r as emitted by the assembler's
+  // pushByteToRam. a is the register, b the immediate.
+  UOP_STORE_IMM,
+  // cmp x, y followed by a conditional jump. The compare only looks at its
+  // operand bytes, so a is the status it sets and b is 1 if the jump is taken.
+  UOP_CMP_JUMP,
+  // mv r, SR followed by a conditional jump. a is the source register and b
+  // the jump's opcode.
+  UOP_TEST_JUMP,
+  // mv r, SR followed by a conditional branch. a is the source register and b
+  // the conditional jump testing the same condition.
+  UOP_TEST_BRANCH,
+};
+
+// One decoded instruction, or a fused sequence of them. Register operands are
+// checked here and kept as their code, which indexes the VM's register file
+// directly. For UOP_BAD_REGISTER and UOP_UNKNOWN, a holds the offending raw
+// byte.
+struct MicroOp {
+  // Opcode, 0 while the record has not been decoded
+  uint8_t op;
+  // Length of the instruction or fused sequence in bytes
+  uint8_t len;
+  // Number of instructions the record stands for
+  uint8_t count;
+  // First operand, a register code or raw byte
+  uint8_t a;
+  // Second operand, a register code or immediate. For OP_LDR and OP_STR the
+  // register holding the pair's low byte, the high byte being in the next
+  // one. For the conditional branches the conditional jump testing the same
+  // condition.
+  uint8_t b;
+  // op on records the verifier decoded, 0 on every other record. The verified
+  // loop dispatches on it, so reaching code the verifier did not vouch for
+  // costs it no check of its own.
+  uint8_t verifiedOp;
+  // 16 bit address operand
+  uint16_t address;
+  // Source address of a block copy
+  uint16_t source;
+  // Byte count of a block copy or fill
+  uint16_t size;
+};
+
+typedef struct MicroOp MicroOp;
+
+// How an instruction's operands are laid out, named after the assembler's
+// GENERATE_* emitters (R register, V value, A address, W 16 bit value, P
+// register pair)
+enum OperandFormat {
+  FORMAT_NONE,
+  FORMAT_R,
+  FORMAT_RV,
+  FORMAT_RR,
+  FORMAT_RA,
+  FORMAT_A,
+  FORMAT_V,
+  FORMAT_VV,
+  FORMAT_AAW,
+  FORMAT_RAW,
+  FORMAT_RP,
+  FORMAT_RRA,
+};
+
+struct OpInfo {
+  const char *name;
+  enum OperandFormat format;
+};
+
+typedef struct OpInfo OpInfo;
+
+// One record per byte address. Pages are allocated the first time code in
+// them is decoded, so an unallocated page also means no write into it can
+// invalidate anything.
+struct DecodeCache {
+  MicroOp *pages[DECODE_PAGES];
+};
+
+typedef struct DecodeCache DecodeCache;
+
+struct VM;
+
+// Returns the mnemonic and operand format of an opcode, name is NULL for
+// opcodes that do not exist
+const OpInfo *opInfo(uint8_t op);
+
+// Returns the name of a register code
+const char *registerName(uint8_t code);
+
+// Initializes an empty decode cache
+void initDecodeCache(DecodeCache *cache);
+
+// Frees every decoded page
+void freeDecodeCache(DecodeCache *cache);
+
+// Decodes the instruction at pc into the cache and returns its record. Unless
+// the VM is tracing, a frequent sequence starting at pc is fused into a single
+// record covering all of it.
+MicroOp *decode(struct VM *vm, uint16_t pc);
+
+// Decodes only the instruction at pc into uop, without fusing it with the
+// instructions after it or touching the cache
+void decodeSingle(struct VM *vm, uint16_t pc, MicroOp *uop);
+
+// Returns whether execution can continue with the instruction after one with
+// the decoded opcode
+bool fallsThrough(uint8_t op);
+
+// Returns whether the decoded opcode goes to its record's address. The linking
+// jumps also reach the instruction after them, where the subroutine returns
+// to.
+bool jumps(uint8_t op);
+
+// Drops every record that overlaps [address, address + len)
+void invalidateDecode(DecodeCache *cache, uint16_t address, int len);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef FILES_H_
+#define FILES_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Host files a program can hold open at once. Handles run from 1, 0 is never
+// a valid handle so it can report a failed open.
+#define FILE_HANDLES 15
+// Writes are collected up to this many bytes before reaching the file
+#define FILE_BUFFER_SIZE (1 << 16)
+
+enum FileMode {
+  FILE_READ,
+  // Creates the file or truncates it
+  FILE_WRITE,
+  // Creates the file, every write goes to its end
+  FILE_APPEND,
+};
+
+struct HostFile {
+  // -1 while the handle is free
+  int fd;
+
+  // Written bytes not yet passed to the file, allocated on the first write
+  uint8_t *buffer;
+  size_t buffered;
+};
+
+typedef struct HostFile HostFile;
+
+struct FileTable {
+  HostFile files[FILE_HANDLES];
+};
+
+typedef struct FileTable FileTable;
+
+void initFiles(FileTable *table);
+
+// Opens the file called name and returns its handle, or 0 if it cannot be
+// opened or every handle is in use
+uint8_t openHandle(FileTable *table, const char *name, enum FileMode mode);
+
+bool validHandle(const FileTable *table, uint8_t handle);
+
+// The calls below take a valid handle. Reading and seeking pass pending
+// writes to the file first.
+
+// Returns the number of bytes read, 0 at the end of the file or on error
+size_t readHandle(FileTable *table, uint8_t handle, void *buf, size_t len);
+
+// Returns false if the file could not take the bytes pending before them
+bool writeHandle(FileTable *table, uint8_t handle, const void *buf,
+                 size_t len);
+
+// Moves to offset relative to whence as in lseek, returns the new position or
+// -1 on error
+int64_t seekHandle(FileTable *table, uint8_t handle, int64_t offset,
+                   int whence);
+
+// Writes out anything pending and frees the handle
+void closeHandle(FileTable *table, uint8_t handle);
+
+// Closes every open handle
+void freeFiles(FileTable *table);
+
+#endif
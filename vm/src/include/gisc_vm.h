@@ -0,0 +1,85 @@
+#ifndef GISC_VM_H_
+#define GISC_VM_H_
+
+// Embedding API for the GISC virtual machine. Every call works on its own
+// gisc_vm and none of them exit the process, so any number of VMs can live in
+// one host, each driven by one thread at a time.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct gisc_vm gisc_vm;
+
+typedef enum gisc_status {
+  // The instruction limit was reached, the VM can be stepped further
+  GISC_PAUSED,
+  // The program counter reached the address given to gisc_vm_run_until
+  GISC_BREAKPOINT,
+  // The program executed halt
+  GISC_HALTED,
+  // The program faulted, see gisc_vm_fault
+  GISC_FAULTED,
+} gisc_status;
+
+typedef enum gisc_fault_kind {
+  GISC_FAULT_NONE,
+  GISC_FAULT_BAD_REGISTER,
+  GISC_FAULT_PC_WRITE,
+  GISC_FAULT_UNKNOWN_OPCODE,
+  GISC_FAULT_STACK_OVERFLOW,
+  GISC_FAULT_STACK_UNDERFLOW,
+  GISC_FAULT_FILE,
+  GISC_FAULT_KILLED,
+  GISC_FAULT_REPLAY,
+} gisc_fault_kind;
+
+typedef struct gisc_fault {
+  gisc_fault_kind kind;
+  // Address of the instruction that faulted or halted
+  uint16_t pc;
+  // Offending register code or opcode
+  uint8_t value;
+  // The message the standalone VM would have printed
+  const char *message;
+} gisc_fault;
+
+// Creates a VM running a copy of image. Images shorter than 64 KB are zero
+// filled. Returns NULL if image is longer or memory runs out.
+gisc_vm *gisc_vm_create(const uint8_t *image, size_t len);
+
+// Frees the VM, it must not be running
+void gisc_vm_destroy(gisc_vm *vm);
+
+// Sets the streams the program's console input and output go to, stdin and
+// stdout by default
+void gisc_vm_set_io(gisc_vm *vm, FILE *input, FILE *output);
+
+// Executes up to count instructions. executed, if not NULL, receives how many
+// ran. Once the program halted or faulted every call returns that status
+// again without running anything.
+gisc_status gisc_vm_step(gisc_vm *vm, uint64_t count, uint64_t *executed);
+
+// Runs until the program counter reaches address after at least one
+// instruction, or until limit instructions ran, 0 for no limit
+gisc_status gisc_vm_run_until(gisc_vm *vm, uint16_t address, uint64_t limit,
+                              uint64_t *executed);
+
+// Runs until the program halts or faults
+gisc_status gisc_vm_run(gisc_vm *vm);
+
+// Returns how the program ended, kind is GISC_FAULT_NONE while it runs or
+// after it halted
+gisc_fault gisc_vm_fault(const gisc_vm *vm);
+
+uint16_t gisc_vm_pc(const gisc_vm *vm);
+
+// Returns the value of a register by its instruction encoding, SR 0x01 to G9
+// 0x0E with PC included, or -1 for codes that name no register
+int gisc_vm_register(const gisc_vm *vm, uint8_t code);
+
+// Copies len bytes of guest memory starting at address into buf
+void gisc_vm_read(const gisc_vm *vm, uint16_t address, void *buf, size_t len);
+
+#endif
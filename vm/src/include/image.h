@@ -0,0 +1,31 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A program image laid out as the VM's initial memory, MEMORY_SIZE bytes that
+// stay unchanged while any VM uses them
+struct Image {
+  const uint8_t *bytes;
+  // Bytes read from the file, the rest of memory is zero
+  size_t len;
+};
+
+typedef struct Image Image;
+
+enum ImageStatus {
+  IMAGE_LOADED,
+  IMAGE_UNREADABLE,
+  // The file holds more than MEMORY_SIZE bytes
+  IMAGE_TOO_LARGE,
+};
+
+// Loads the image in path, or from stdin if path is "-". Regular files are
+// mapped rather than read, so only the pages a program touches are ever
+// loaded; pipes are read. Files shorter than MEMORY_SIZE are zero filled.
+enum ImageStatus loadImage(Image *image, const char *path);
+
+void freeImage(Image *image);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Times a branch target is reached before its block is compiled
+#define JIT_THRESHOLD 64
+// Most instructions compiled into one block
+#define JIT_MAX_BLOCK 128
+// Fewest instructions a block must run before leaving for the interpreter.
+// Entering and leaving compiled code costs more than interpreting fewer.
+#define JIT_MIN_BLOCK 4
+// Size of the executable code buffer, flushed entirely when full
+#define JIT_CODE_SIZE (4 << 20)
+#define JIT_MAX_PENDING 4096
+
+// Native entry points and hotness counters for one 256 byte page of guest
+// code. entry must stay the first member, generated code indexes it directly.
+struct JitPage {
+  void *entry[256];
+  uint16_t counter[256];
+};
+
+typedef struct JitPage JitPage;
+
+// A jump out of compiled code to a block that did not exist yet, patched to
+// jump straight into the block once it is compiled
+struct JitPending {
+  uint32_t site;
+  uint16_t target;
+};
+
+typedef struct JitPending JitPending;
+
+struct Jit {
+  // mmap'd read/write/execute buffer
+  uint8_t *code;
+  size_t used;
+  // Shared stubs at the start of the buffer, kept across flushes
+  size_t stubsEnd;
+  uint8_t *enter;
+  uint8_t *exit;
+  uint8_t *dynamic;
+  uint8_t *call;
+
+  JitPage *pages[256];
+
+  // One bit per guest byte that compiled code was translated from
+  uint8_t covered[256][32];
+  bool anyCovered;
+
+  JitPending pending[JIT_MAX_PENDING];
+  int pendingCount;
+
+  // Instructions of the block being compiled that have run by the point
+  // being emitted, and those of the instruction being emitted. Every way out
+  // of a block charges them to the VM's budget.
+  uint32_t done;
+  uint32_t current;
+};
+
+typedef struct Jit Jit;
+
+struct VM;
+
+// Maps the code buffer, returns false if this host has no JIT backend
+bool initJit(Jit *jit);
+
+// Drops all compiled code and hotness counters so the JIT can be handed to
+// another VM
+void resetJit(Jit *jit);
+
+// Unmaps the code buffer and frees every page
+void freeJit(Jit *jit);
+
+// Called by the interpreter after a branch lands on the program counter. Runs
+// compiled code from there if the target is hot, returning once the native
+// code reaches something it cannot handle or a block would overrun the budget,
+// with the VM state written back and the instructions run taken off _budget.
+void jitBranch(struct VM *vm);
+
+// Drops all compiled code if any of it was translated from
+// [address, address + len)
+void jitInvalidate(Jit *jit, uint16_t address, int len);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef MACHINE_H_
+#define MACHINE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "jit.h"
+#include "vm.h"
+
+// A core's id is a byte, as CALL_CORE hands it over in G0
+#define MACHINE_MAX_CORES 256
+
+// Cores sharing one memory, each with its own registers and running on its
+// own host thread. Every core starts at address 0 and tells itself apart with
+// CALL_CORE.
+//
+// Apart from the stack page, which each core keeps to itself, every page
+// lives in one copy of the image all cores read and write. Plain loads and
+// stores are not ordered between cores, programs synchronize with the atomic
+// instructions and fences. Code is decoded per core, so a core rewriting code
+// another core runs is not seen there.
+//
+// The machine ends once core 0 halts or any core faults. The cores still
+// running are stopped through their _interrupt flag, which the loops cores
+// run poll at every taken branch, so they need no budget.
+struct Machine {
+  VM *cores;
+  int count;
+
+  // One compiler per core, NULL to only interpret
+  Jit *jits;
+
+  uint8_t *memory;
+
+  // Set once a core halted or faulted, and once the machine ends. Written
+  // with lock held and read atomically.
+  bool *finished;
+  bool stopping;
+
+  pthread_mutex_t lock;
+  // Signalled whenever a core finishes
+  pthread_cond_t changed;
+};
+
+typedef struct Machine Machine;
+
+// Initializes a machine of count cores, between 1 and MACHINE_MAX_CORES,
+// running instructions, which must be of length MEMORY_SIZE. It is copied, so
+// it need not outlive the machine.
+void initMachine(Machine *machine, const uint8_t *instructions, int count);
+
+// Gives every core its own native code compiler. Returns false, leaving the
+// cores interpreting, when there is no JIT on this host.
+bool jitMachine(Machine *machine);
+
+// Returns whether core halted or faulted
+static inline bool coreFinished(Machine *machine, int core) {
+  return __atomic_load_n(&machine->finished[core], __ATOMIC_ACQUIRE);
+}
+
+// Runs every core on a thread of its own and returns once the machine ended.
+// Cores stopped early are killed.
+void runMachine(Machine *machine);
+
+void freeMachine(Machine *machine);
+
+#endif
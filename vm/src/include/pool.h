@@ -0,0 +1,16 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+// Runs one task, worker is the index of the thread running it
+typedef void (*PoolTask)(void *ctx, int task, int worker);
+
+// Runs fn for every task in [0, count) on threads worker threads and returns
+// once all of them are done. Each worker starts with an equal share of the
+// tasks and, once its own run out, steals half of what another worker has
+// left, so uneven tasks still keep every thread busy.
+void runPool(int threads, int count, PoolTask fn, void *ctx);
+
+// Returns the number of online processors, at least 1
+int processorCount(void);
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cost.h"
+#include "decode.h"
+
+// Deepest call stack tracked, as many links as the stack page holds
+#define PROFILE_MAX_DEPTH 128
+// Addresses listed in the report
+#define PROFILE_TOP_PCS 20
+
+// A label from the symbol map the assembler writes
+struct Symbol {
+  uint16_t address;
+  char *name;
+};
+
+typedef struct Symbol Symbol;
+
+// One distinct call stack, linked to the stack it was called from
+struct StackNode {
+  // Address the innermost frame was entered at
+  uint16_t entry;
+
+  int parent;
+  int child;
+  int sibling;
+
+  // Instructions retired with exactly this stack
+  uint64_t count;
+  // Their modeled cycles
+  uint64_t cycles;
+};
+
+typedef struct StackNode StackNode;
+
+// A call whose link is still on the guest stack
+struct Frame {
+  int node;
+  // Stack pointer the link was pushed at
+  uint8_t sp;
+};
+
+typedef struct Frame Frame;
+
+// Instruction counts of a run. Every jump pushes a link and programs drop the
+// ones they do not return through, so a call is taken to last for as long as
+// its link stays on the stack.
+struct Profile {
+  uint64_t ops[256];
+  uint64_t pcs[0x10000];
+  uint64_t total;
+
+  // Cycle model, NULL when only counting instructions
+  const CostModel *costs;
+  uint64_t opCycles[256];
+  uint64_t cycles;
+
+  // Node 0 is the stack the program starts with
+  StackNode *nodes;
+  int nodeCount;
+  int nodeCapacity;
+
+  Frame frames[PROFILE_MAX_DEPTH];
+  int depth;
+
+  // The last instruction counted. Its stack is settled at the next one, once
+  // the stack pointer shows what it did.
+  bool pending;
+  uint8_t lastOp;
+  uint16_t lastNext;
+  uint8_t lastSp;
+  // Bytes of memory it accesses besides a link it may push
+  uint32_t lastBytes;
+
+  // Sorted by address
+  Symbol *symbols;
+  int symbolCount;
+};
+
+typedef struct Profile Profile;
+
+void initProfile(Profile *profile);
+
+// Reads a symbol map, one 'ADDRESS NAME' line per label with the address in
+// hex. Returns false if it cannot be read.
+bool loadSymbols(Profile *profile, const char *path);
+
+// Counts the instruction about to execute, sp being the stack pointer before
+// it runs
+void profileInstruction(Profile *profile, uint16_t pc, const MicroOp *u,
+                        uint8_t sp);
+
+// Writes instruction counts per opcode, per label when symbols are loaded and
+// for the hottest addresses
+void writeProfileReport(Profile *profile, FILE *out);
+
+// Writes one 'frame;frame;frame count' line per call stack, the collapsed
+// format flame graph tools read
+void writeCollapsedStacks(Profile *profile, FILE *out);
+
+// Writes the modeled cycles, instructions and cycles per instruction of the
+// run, then the same per opcode and per subroutine. Needs a cost model.
+void writeCycleReport(Profile *profile, FILE *out);
+
+void freeProfile(Profile *profile);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef RECORD_H_
+#define RECORD_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "vm.h"
+
+// What one syscall that reaches the console or the file system did to the
+// guest. The bytes written to memory are kept up to the last one that is not
+// zero, the rest of the written range was cleared.
+struct SyscallRecord {
+  uint8_t call;
+
+  // enum Fault the call stopped the program with, FAULT_NONE if it returned
+  uint8_t fault;
+  uint8_t value;
+  char message[MESSAGE_MAX];
+
+  // General purpose registers once it returned, and the memory it wrote
+  uint8_t GP[11];
+  uint16_t address;
+  uint16_t length;
+  uint16_t stored;
+  uint8_t bytes[BUFFER_MAX];
+};
+
+typedef struct SyscallRecord SyscallRecord;
+
+// Log of the syscalls of one run, either being written while the program
+// runs on the host or read back in place of the host
+struct Recording {
+  FILE *file;
+  bool replaying;
+
+  // Set while a recorded syscall runs, so a fault it raises is logged too
+  bool inCall;
+
+  // Scratch record, too large for the stack
+  SyscallRecord *record;
+};
+
+typedef struct Recording Recording;
+
+// Creates the log at path for recording, or opens it for replaying. Returns
+// false if it cannot be opened or, when replaying, is not a syscall log.
+bool openRecording(Recording *recording, const char *path, bool replaying);
+
+// Appends the record to the log
+void writeRecord(Recording *recording, const SyscallRecord *record);
+
+// Reads the next record of the log, returns false at its end
+bool readRecord(Recording *recording, SyscallRecord *record);
+
+void closeRecording(Recording *recording);
+
+#endif
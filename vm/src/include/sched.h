@@ -0,0 +1,53 @@
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include <stdint.h>
+
+#include "vm.h"
+
+// Instructions a VM runs before the scheduler moves on to the next one
+#define SCHED_SLICE 100000
+
+// One VM sharing the scheduler's thread
+struct SchedEntry {
+  VM *vm;
+
+  // Instructions it ran and host time it spent running so far
+  uint64_t executed;
+  double seconds;
+};
+
+typedef struct SchedEntry SchedEntry;
+
+struct Scheduler {
+  SchedEntry *entries;
+  int count;
+  int capacity;
+
+  // Instructions each VM runs per turn
+  uint64_t slice;
+
+  // Watchdog, a VM that runs more instructions or spends longer running than
+  // this is killed. 0 for no limit.
+  uint64_t maxInstructions;
+  double timeout;
+};
+
+typedef struct Scheduler Scheduler;
+
+// Initializes an empty scheduler handing out slice instructions per turn,
+// with no watchdog limits
+void initScheduler(Scheduler *sched, uint64_t slice);
+
+// Adds a VM and returns its index in entries. The VM must stay valid until
+// the scheduler is freed.
+int scheduleVm(Scheduler *sched, VM *vm);
+
+// Runs the paused VMs round-robin on the calling thread, one slice each per
+// turn, until every one of them halted, faulted or was killed by the
+// watchdog. A program blocked reading its console blocks the others too.
+void runScheduler(Scheduler *sched);
+
+void freeScheduler(Scheduler *sched);
+
+#endif
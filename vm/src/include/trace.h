@@ -0,0 +1,80 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "decode.h"
+
+#define TRACE_BUFFER_SIZE (1 << 20)
+// Most instructions --trace-last can keep
+#define TRACE_MAX_LAST (1 << 20)
+
+// State of one instruction captured just before it executes
+struct TraceEntry {
+  uint16_t pc;
+  uint16_t address;
+  // Source and byte count of a block copy or fill
+  uint16_t source;
+  uint16_t size;
+  uint8_t op;
+  uint8_t a;
+  uint8_t b;
+  // Values of the operand registers and the addressed byte
+  uint8_t valA;
+  uint8_t valB;
+  uint8_t mem;
+  uint8_t sr;
+  uint8_t sp;
+};
+
+typedef struct TraceEntry TraceEntry;
+
+struct Trace {
+  // Opcodes to trace, every opcode when none are selected
+  bool ops[256];
+  bool anyOp;
+
+  // Inclusive range of program counters to trace
+  uint16_t pcStart;
+  uint16_t pcEnd;
+
+  // Stop after this many traced instructions, 0 for no limit
+  uint64_t first;
+  // Only keep the most recent instructions, 0 to write every one out
+  uint64_t last;
+
+  // Instructions that passed the filters so far
+  uint64_t count;
+
+  TraceEntry *ring;
+
+  // Lines not yet written to out, allocated when the first one is formatted
+  char *buffer;
+  int bufferLen;
+  FILE *out;
+};
+
+typedef struct Trace Trace;
+
+// Initializes a trace writing to out that accepts every instruction
+void initTrace(Trace *trace, FILE *out);
+
+// Parses a comma separated list of mnemonics into the opcode filter, returns
+// false on an unknown mnemonic
+bool traceOps(Trace *trace, const char *list);
+
+// Records the instruction about to execute if it passes the filters. regs is
+// the VM's register file, indexed by register code.
+void traceInstruction(Trace *trace, const uint8_t *regs, uint16_t pc,
+                      const MicroOp *uop, uint8_t mem);
+
+// Writes out buffered lines so they land before other output
+void flushTrace(Trace *trace);
+
+// Writes out the kept instructions when only the last ones are kept, flushes
+// and frees the trace
+void freeTrace(Trace *trace);
+
+#endif
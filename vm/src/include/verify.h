@@ -0,0 +1,17 @@
+#ifndef VERIFY_H_
+#define VERIFY_H_
+
+struct VM;
+
+// Walks the code reachable from address 0 and from the program counter,
+// following every jump whose target is known, and proves each instruction it
+// reaches well formed: an opcode that exists with register operands the
+// program may use. Those instructions are decoded and their records marked
+// verified, see MicroOp.verifiedOp. Every instruction the walk reached gets a
+// decode page, so the verified loop can go from a verified record to any
+// record it leads to without looking the page up first. The walk stops at
+// instructions that are not well formed, which are left to the checks of the
+// other loops.
+void verifyCode(struct VM *vm);
+
+#endif
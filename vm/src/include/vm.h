@@ -1,16 +1,25 @@
 #ifndef VM_H_
 #define VM_H_
 
+#include <setjmp.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
-#define DEBUG
+#include "decode.h"
+#include "files.h"
+#include "jit.h"
+#include "profile.h"
+#include "trace.h"
 
 #define MEMORY_SIZE 65536
+#define MEMORY_PAGE_SIZE 256
+#define MEMORY_PAGES (MEMORY_SIZE / MEMORY_PAGE_SIZE)
 #define BUFFER_MAX 4096
 #define INPUT_BUFFER 0x9001
 #define PRINT_BUFFER 0xA001
 #define FILENAME_BUFFER 0xB001
+#define OUTPUT_BUFFER_SIZE (1 << 16)
 
 enum {
   OP_ADD = 1,
@@ -36,9 +45,49 @@ enum {
   OP_PUSH,
   OP_POP,
   OP_CALL,
-  OP_HALT
+  OP_HALT,
+  OP_COPY,
+  OP_FILL,
+  OP_LDR,
+  OP_STR,
+  OP_LDX,
+  OP_STX,
+  // Branches that leave the stack alone, then their short forms taking a
+  // signed 8 bit offset from the next instruction
+  OP_BR,
+  OP_BRE,
+  OP_BRNE,
+  OP_BRG,
+  OP_BRL,
+  OP_BRS,
+  OP_BRES,
+  OP_BRNES,
+  OP_BRGS,
+  OP_BRLS,
+  // Subroutine call, pushes the return address for OP_RET
+  OP_JSR,
+  // Atomic read-modify-writes of one byte of memory, ordered with every other
+  // atomic and fence on any core
+  OP_XCHG,
+  OP_XADD,
+  OP_CAS,
+  OP_FENCE
 };
 
+// Returns whether the conditional jump op is taken with the given status
+static inline bool branchTaken(uint8_t op, uint8_t status) {
+  switch (op) {
+  case OP_JE:
+    return status == 1;
+  case OP_JNE:
+    return status != 1;
+  case OP_JG:
+    return status == 0;
+  default:
+    return status == 2;
+  }
+}
+
 enum {
   R_SR = 0x01,
   R_SP,
@@ -63,22 +112,99 @@ enum SysCalls {
   CALL_FREAD,
   CALL_FWRITE,
   CALL_CREAD,
-  CALL_ICLEAR
+  CALL_ICLEAR,
+  // Reads up to G5:G4 bytes (at most BUFFER_MAX) of the file named in
+  // FILENAME_BUFFER, from offset G3:G2:G1:G0, into INPUT_BUFFER. G5:G4 is set
+  // to the bytes delivered, 0 past the end of the file.
+  CALL_FREADAT,
+  // The calls below work on handles. Lengths are given in G5:G4, at most
+  // BUFFER_MAX, and set to the bytes transferred; data goes through
+  // INPUT_BUFFER and the handle is passed in G6.
+
+  // Opens the file named in FILENAME_BUFFER, G7 holding an enum FileMode, and
+  // sets G6 to its handle or to 0 if it cannot be opened
+  CALL_OPEN,
+  CALL_READ,
+  CALL_WRITE,
+  // Moves to the signed offset G3:G2:G1:G0 from the start, the current
+  // position or the end for G7 0, 1 or 2. G3:G2:G1:G0 is set to the new
+  // position, all ones on error.
+  CALL_SEEK,
+  CALL_CLOSE,
+  // Sets G0 to the core running the program and G1 to the number of cores,
+  // 0 and 1 outside of a machine
+  CALL_CORE,
+  // Waits until core G0 halted or faulted. Returns at once outside of a
+  // machine and for the calling core or one that does not exist.
+  CALL_JOIN
+};
+
+// Why run() returned
+enum VMStatus {
+  // The instruction budget ran out, run() continues where it left off
+  STATUS_PAUSED,
+  // The program counter reached the breakpoint
+  STATUS_BREAK,
+  // The program executed halt
+  STATUS_HALTED,
+  // The program did something the CPU cannot carry out, see _fault
+  STATUS_FAULTED,
+  // The program waits in CALL_JOIN for another core of its machine, run()
+  // tries the call again
+  STATUS_WAITING,
+};
+
+enum Fault {
+  FAULT_NONE,
+  // Register operand that does not exist, _faultValue holds its code
+  FAULT_BAD_REGISTER,
+  // Register operand naming the program counter
+  FAULT_PC_WRITE,
+  // Opcode that does not exist, _faultValue holds it
+  FAULT_UNKNOWN_OPCODE,
+  FAULT_STACK_OVERFLOW,
+  FAULT_STACK_UNDERFLOW,
+  // A file syscall could not open its file
+  FAULT_FILE,
+  // The host ended the program, see killCpu
+  FAULT_KILLED,
+  // A replayed syscall the log does not hold, _faultValue holds the call
+  FAULT_REPLAY,
+};
+
+// Budget meaning run() only returns once the program halts or faults
+#define NO_BUDGET UINT64_MAX
+#define NO_BREAKPOINT -1
+
+#define MESSAGE_MAX 256
+
+// The file the program reads with CALL_FREAD or CALL_FREADAT, mapped once and
+// kept open while the program keeps reading the same file
+struct MappedFile {
+  char name[0x100];
+  int fd;
+  const uint8_t *data;
+  size_t size;
 };
 
+typedef struct MappedFile MappedFile;
+
+struct Machine;
+struct Translation;
+struct Recording;
+
 struct VM {
-  // Each bit different kinds of compare as well as sign and carry
-  uint8_t _statusRegister;
-  // Points 2 byte lower than the last element pushed to the stack
-  uint8_t _stackPointer;
-  // Holds the syscall to the executed
-  uint8_t _syscall;
+  // Registers indexed by their code, R_SR to R_G10, so a decoded operand
+  // names its register directly. Entry 0 is unused and so is the one at R_PC,
+  // the program counter being wider than a byte.
+  //
+  // R_SR: each bit different kinds of compare as well as sign and carry
+  // R_SP: points 2 byte lower than the last element pushed to the stack
+  // R_SC: holds the syscall to the executed
+  uint8_t _registers[16];
   // Points to next instruction to be executed
   uint16_t _programCounter;
 
-  // General purpose registers
-  uint8_t _GP[11];
-
   // Memory space of the CPU. Technically not true memory because it is lumped
   // together inside of the CPU making it an MCU but I don't care.
 
@@ -88,15 +214,142 @@ struct VM {
   // 0x9000 -> 0xA000 reserved for input buffering and
   // 0xA001 -> 0xB000 reserved for the print buffer
   // 0xB001 -> 0xB0FF reserved for the filename buffer
-  uint8_t _memory[MEMORY_SIZE];
+  //
+  // Split into pages that point into the loaded image, shared by every VM
+  // running it, until the first write to a page gives this VM its own copy.
+  uint8_t *_pages[MEMORY_PAGES];
+  // Pages copied out of the image, the only ones writes may go to directly
+  bool _owned[MEMORY_PAGES];
+
+  // Instructions decoded from memory, kept in sync by every memory write
+  DecodeCache _decode;
+  // Set once verifyCode() walked the program, which the first run() without
+  // a budget does
+  bool _verified;
+
+  // Execution trace, NULL when tracing is off
+  Trace *_trace;
+
+  // Instruction counts, NULL when not profiling. Owned by the host.
+  Profile *_profile;
+
+  // Native code compiler, NULL to only interpret
+  Jit *_jit;
+
+  // Code translated ahead of time, told about every write to decoded code.
+  // NULL when there is none.
+  struct Translation *_translation;
+
+  // Log the syscalls reaching the console and the file system are recorded
+  // to or replayed from, NULL to only use the host. Owned by the host.
+  struct Recording *_recording;
+
+  // Machine this CPU is a core of, NULL when it runs on its own
+  struct Machine *_machine;
+  uint8_t _core;
+  // Set from another thread to pause run() at the next taken branch, which is
+  // how the machine stops its cores
+  bool _interrupt;
+
+  // Console the program reads from and prints to, stdin and stdout by default
+  FILE *_input;
+  FILE *_output;
+  // Console output not yet written to _output, allocated on the first print.
+  // It is written out when full, before the program reads its console and
+  // before run() returns.
+  char *_outputBuffer;
+  size_t _outputLen;
+  // fd is -1 while no file is mapped
+  MappedFile _mapped;
+  // Files opened with CALL_OPEN
+  FileTable _files;
+
+  // Instructions the current run() may still execute before pausing, what
+  // is left of a limited budget once it returns
+  uint64_t _budget;
+  // Address run() stops in front of once it has executed an instruction, or
+  // NO_BREAKPOINT
+  int32_t _breakpoint;
+  // Set once the current run() has executed an instruction
+  bool _stepped;
+
+  // Why the last run() returned. Once the program halted or faulted, the
+  // fault, the address of the instruction (or fused sequence) that raised it
+  // and the message the program would end with are kept here.
+  enum VMStatus _state;
+  enum Fault _fault;
+  uint16_t _faultPc;
+  uint8_t _faultValue;
+  char _message[MESSAGE_MAX];
+
+  // Where run() resumes once the program stops or pauses
+  jmp_buf _stopped;
 };
 
 typedef struct VM VM;
 
-// Initializes CPU, instructions array must be of length MEMORY_SIZE
-void initCpu(VM *vm, uint8_t *instructions);
+// Registers and memory of a VM at one point in time. Taking a snapshot hands
+// the VM's own pages over to it, so the VM copies a page again on its next
+// write and any page that no longer matches the snapshot is known to be dirty.
+struct Snapshot {
+  uint8_t registers[16];
+  uint16_t programCounter;
+
+  uint8_t *pages[MEMORY_PAGES];
+  // Pages freed along with the snapshot
+  bool owned[MEMORY_PAGES];
+};
+
+typedef struct Snapshot Snapshot;
+
+// Initializes CPU, instructions array must be of length MEMORY_SIZE. Its pages
+// are shared rather than copied, so it must outlive the CPU and not change
+// while the CPU uses it.
+void initCpu(VM *vm, const uint8_t *instructions);
+
+// Makes the CPU core number core of machine, sharing its memory, before it
+// first runs. The stack page stays the CPU's own, copied out of the memory as
+// it is now.
+void attachCore(VM *vm, struct Machine *machine, uint8_t core);
+
+// Reads one byte of guest memory
+static inline uint8_t readByte(const VM *vm, uint16_t address) {
+  return vm->_pages[address >> 8][address & 0xFF];
+}
+
+// Writes one byte of guest memory the way a store instruction does
+void storeByte(VM *vm, uint16_t address, uint8_t val);
+
+// Copies and fills guest memory the way copy and fill do
+void copyMemory(VM *vm, uint16_t dest, uint16_t src, int len);
+void fillMemory(VM *vm, uint16_t address, uint8_t val, int len);
+
+// Runs the CPU with its instructions loaded into memory until the program
+// halts or faults, budget instructions ran or the breakpoint set in the VM is
+// reached. A paused CPU picks up where it left off on the next run(), and
+// _budget holds what was left of a limited budget.
+enum VMStatus run(VM *vm, uint64_t budget);
+
+// Ends the program from outside run(), which must not be running, as if it
+// faulted at the program counter with message
+void killCpu(VM *vm, const char *message);
+
+// Releases memory held by the CPU
+void freeCpu(VM *vm);
+
+// Captures the registers and memory of the CPU. The snapshot must outlive the
+// CPU and every CPU restored or forked from it.
+void snapshotCpu(VM *vm, Snapshot *snapshot);
+
+// Puts the CPU back in the state captured by snapshot. Only pages written
+// since are touched, returns how many there were.
+int restoreCpu(VM *vm, const Snapshot *snapshot);
+
+// Initializes a new CPU in the state captured by snapshot, sharing its pages
+// until they are written
+void forkCpu(VM *vm, const Snapshot *snapshot);
 
-// Runs the CPU with its instructions loaded into memory
-void run(VM *vm);
+// Releases the pages held by the snapshot
+void freeSnapshot(Snapshot *snapshot);
 
 #endif